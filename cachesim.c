@@ -0,0 +1,266 @@
+/**@file cachesim.c
+ * @brief Replays virtual machine memory traces against models of the
+ * Arduino's memory callbacks and of a cache for the image in flash
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * On the Arduino every memory access the virtual machine makes goes through
+ * 'rom_read_cb' or 'rom_write_cb' in 'test.cpp', which find the page an
+ * address is in by checking each in turn, the image itself being read out
+ * of flash. This tool takes a trace made by 'host -t', maps it on to the
+ * same pages, and estimates the cost of each access in AVR cycles for
+ * different ways of doing this, including with a direct mapped or two way
+ * set associative cache in SRAM of the lines of the image in flash most
+ * recently used, for a range of line sizes and capacities. Build with
+ * 'make cachesim', 'make simulate' makes a trace and replays it.
+ *
+ * Usage: cachesim [-c cycles] [-b bytes] trace
+ *
+ * -c  cycles per instruction spent in the virtual machine itself, outside
+ *     of the memory callbacks, used to estimate instructions per second
+ * -b  SRAM that can be spared for a cache, the best one that fits is given
+ *
+ * The cycle counts are estimates, made by reading the code 'avr-gcc -Os'
+ * makes for callbacks like these, and not measurements, so it is the
+ * difference between the estimates that matters. They are given in 'costs'
+ * below and are easily changed. */
+#include "embed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGE_SIZE  (128u)     /**< as in 'test.cpp' */
+#define PAGE_2     (0x2000u)  /**< variables and terminal input buffer */
+#define PAGE_3     (0x2400u)  /**< variable stack */
+#define PAGE_8     (EMBED_CORE_SIZE - PAGE_SIZE) /**< return stack */
+#define EEPROM     (0x4000u)  /**< pages 4 to 7 are mapped on to EEPROM */
+#define CLOCK      (16e6)     /**< Arduino clock frequency, Hz */
+#define MAX_WAYS   (2u)
+
+/* Estimated cycles for each part of an access */
+static const struct {
+	unsigned check;       /**< a 'within' check that fails */
+	unsigned ram;         /**< reading or writing a cell in a page */
+	unsigned eeprom;      /**< 'eeprom_read_word' or 'eeprom_write_word' */
+	unsigned flash_bytes; /**< a cell read with two calls to 'pgm_read_byte' */
+	unsigned flash_word;  /**< a cell read with 'pgm_read_word' */
+	unsigned hit;         /**< finding a line in the cache and reading a cell from it */
+	unsigned way;         /**< checking the tag of a second way */
+	unsigned fill;        /**< fetching a line on a miss, not counting the copy */
+	unsigned fill_cell;   /**< copying a cell with 'memcpy_P' */
+} costs = {
+	.check = 6, .ram = 8, .eeprom = 60, .flash_bytes = 16, .flash_word = 10,
+	.hit = 24, .way = 8, .fill = 12, .fill_cell = 16,
+};
+
+typedef enum { PAGE_0, FLASH, PAGE_1, PAGE2, PAGE3, PAGE8, EEPROM_PAGE, UNMAPPED, REGIONS } region_e;
+
+static const char *region_names[REGIONS] = {
+	"page 0", "flash", "page 1", "page 2", "page 3", "page 8", "eeprom", "unmapped",
+};
+
+typedef struct {
+	unsigned ways, line, lines; /**< 'line' is in cells, 'lines' is per way */
+	unsigned long hits, misses;
+	unsigned *tags;             /**< line address plus one, zero if empty */
+	unsigned char *recent;      /**< way most recently used, for each set */
+} cache_t;
+
+static unsigned blksz; /**< cells of the image in flash, as in 'test.cpp' */
+
+static region_e region(const unsigned addr) {
+	if (addr < PAGE_SIZE)
+		return PAGE_0;
+	if (addr < blksz)
+		return FLASH;
+	if (addr < blksz + PAGE_SIZE)
+		return PAGE_1;
+	if (addr >= PAGE_2 && addr < PAGE_2 + PAGE_SIZE)
+		return PAGE2;
+	if (addr >= PAGE_3 && addr < PAGE_3 + PAGE_SIZE)
+		return PAGE3;
+	if (addr >= PAGE_8 && addr < PAGE_8 + PAGE_SIZE)
+		return PAGE8;
+	if (addr >= EEPROM && addr < EEPROM + (PAGE_SIZE * 5))
+		return EEPROM_PAGE;
+	return UNMAPPED;
+}
+
+/* The callbacks find the page an address is in by checking each in the
+ * order given, the cost of an access includes the checks that fail first.
+ * Writes skip the check for flash if 'skip' is set. */
+static const region_e original[] = { PAGE_0, FLASH, PAGE_1, PAGE2, PAGE3, PAGE8, EEPROM_PAGE };
+
+static unsigned long chain(const region_e r, const region_e *order, const int skip) {
+	unsigned checks = 0;
+	for (unsigned i = 0; i < EEPROM_PAGE + 1u && order[i] != r; i++)
+		checks += !(skip && order[i] == FLASH);
+	return checks * costs.check;
+}
+
+static unsigned long access_cost(const region_e r) {
+	return r == EEPROM_PAGE ? costs.eeprom : r == UNMAPPED ? 0 : costs.ram;
+}
+
+static unsigned long cache_read(cache_t *c, const unsigned addr) {
+	const unsigned line = addr / c->line, set = line % c->lines;
+	for (unsigned w = 0; w < c->ways; w++) {
+		if (c->tags[(set * c->ways) + w] == line + 1u) {
+			c->hits++;
+			c->recent[set] = w;
+			return costs.hit + (w * costs.way) + (c->ways > 1 ? costs.way : 0);
+		}
+	}
+	const unsigned victim = c->ways > 1 ? !c->recent[set] : 0;
+	c->misses++;
+	c->tags[(set * c->ways) + victim] = line + 1u;
+	c->recent[set] = victim;
+	return costs.hit + ((c->ways - 1) * costs.way) + costs.fill + (c->line * costs.fill_cell);
+}
+
+static unsigned char *load(const char *name, size_t *length) {
+	FILE *f = fopen(name, "rb");
+	unsigned char *t = NULL;
+	long size = 0;
+	if (!f)
+		return NULL;
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+		goto fail;
+	if (!(t = malloc(size + 1)) || fread(t, 1, size, f) != (size_t)size)
+		goto fail;
+	fclose(f);
+	*length = size / 3;
+	return t;
+fail:
+	free(t);
+	fclose(f);
+	return NULL;
+}
+
+static void usage(const char *arg0) {
+	fprintf(stderr, "usage: %s [-c cycles] [-b bytes] trace\n", arg0);
+}
+
+int main(int argc, char **argv) {
+	static const unsigned line_sizes[] = { 1, 2, 4, 8, 16 }; /* cells */
+	static const unsigned capacities[] = { 64, 128, 256, 512, 1024 }; /* bytes of data */
+	unsigned long counts[REGIONS] = { 0 }, fetches = 0, reads = 0, writes = 0;
+	unsigned long before = 0, after = 0, others = 0;
+	unsigned vm = 200, budget = 192;
+	size_t length = 0;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c") && (i + 1) < argc) {
+			vm = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-b") && (i + 1) < argc) {
+			budget = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (i + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	unsigned char *t = load(argv[i], &length);
+	if (!t) {
+		fprintf(stderr, "could not load trace '%s'\n", argv[i]);
+		return 1;
+	}
+	blksz = embed_default_block_size / 2;
+
+	for (size_t j = 0; j < length; j++) {
+		const unsigned kind = t[j * 3], addr = t[(j * 3) + 1] | (t[(j * 3) + 2] << 8);
+		fetches += kind == 'x';
+		reads   += kind == 'r';
+		writes  += kind == 'w';
+		counts[region(addr)]++;
+	}
+	if (!fetches) {
+		fprintf(stderr, "no instructions in trace\n");
+		return 1;
+	}
+
+	/* The pages are checked most used first, EEPROM is slow anyway */
+	region_e ordered[EEPROM_PAGE + 1];
+	memcpy(ordered, original, sizeof ordered);
+	for (int j = 1; j < EEPROM_PAGE; j++)
+		for (int k = j; k > 0 && counts[ordered[k]] > counts[ordered[k - 1]]; k--) {
+			const region_e swap = ordered[k];
+			ordered[k] = ordered[k - 1];
+			ordered[k - 1] = swap;
+		}
+
+	/* Costs not depending on the cache are found first, flash reads are
+	 * costed separately for each way of making them */
+	for (size_t j = 0; j < length; j++) {
+		const unsigned kind = t[j * 3], addr = t[(j * 3) + 1] | (t[(j * 3) + 2] << 8);
+		const region_e r = region(addr);
+		if (r == FLASH && kind != 'w') {
+			before += costs.flash_bytes + chain(r, original, 0);
+			after  += costs.flash_word + chain(r, ordered, 0);
+			continue;
+		}
+		const int write = kind == 'w';
+		before += access_cost(r) + chain(r, original, 0);
+		after  += access_cost(r) + chain(r, ordered, write);
+		others += access_cost(r) + chain(r, ordered, write);
+	}
+	printf("%lu instructions, %lu reads, %lu writes, image %u cells\n", fetches, reads, writes, blksz);
+	for (int r = 0; r < REGIONS; r++)
+		if (counts[r])
+			printf("%-8s %5.1f%% of accesses\n", region_names[r], (100.0 * counts[r]) / length);
+	printf("\npages checked in the order:");
+	for (int r = 0; r <= EEPROM_PAGE; r++)
+		printf("%s %s", r ? "," : "", region_names[ordered[r]]);
+	printf("\n\nestimated cycles per instruction in the memory callbacks, and instructions\n"
+		"per second at %.0f MHz with %u cycles per instruction in the virtual machine\n\n", CLOCK / 1e6, vm);
+	const double b = (double)before / fetches, a = (double)after / fetches;
+	printf("%-40s %6.1f %8.0f\n", "original order, pgm_read_byte", b, CLOCK / (vm + b));
+	printf("%-40s %6.1f %8.0f\n\n", "most used first, pgm_read_word", a, CLOCK / (vm + a));
+	printf("cache, most used first  ways  line  lines  SRAM   hit%%   cycles     ips\n");
+
+	double best = a;
+	cache_t chosen = { 0 };
+	unsigned chosen_bytes = 0;
+	for (unsigned w = 1; w <= MAX_WAYS; w++) {
+		for (size_t l = 0; l < sizeof(line_sizes) / sizeof(line_sizes[0]); l++) {
+			for (size_t k = 0; k < sizeof(capacities) / sizeof(capacities[0]); k++) {
+				cache_t c = { .ways = w, .line = line_sizes[l] };
+				c.lines = capacities[k] / (line_sizes[l] * sizeof(cell_t) * w);
+				if (c.lines == 0)
+					continue;
+				c.tags   = calloc(c.lines * w, sizeof *c.tags);
+				c.recent = calloc(c.lines, 1);
+				if (!c.tags || !c.recent)
+					return 1;
+				unsigned long cost = others;
+				for (size_t j = 0; j < length; j++) {
+					const unsigned kind = t[j * 3], addr = t[(j * 3) + 1] | (t[(j * 3) + 2] << 8);
+					if (kind != 'w' && region(addr) == FLASH)
+						cost += cache_read(&c, addr);
+				}
+				/* tags are two bytes, the most recently used way one byte per set */
+				const unsigned bytes = capacities[k] + (c.lines * w * 2) + (w > 1 ? c.lines : 0);
+				const double cycles = (double)cost / fetches;
+				printf("%23s %5u %5u %6u %5u %6.1f %8.1f %8.0f\n", "", w, c.line, c.lines, bytes,
+						(100.0 * c.hits) / (c.hits + c.misses), cycles, CLOCK / (vm + cycles));
+				if (bytes <= budget && cycles < best) {
+					best = cycles;
+					chosen = c;
+					chosen_bytes = bytes;
+				}
+				free(c.tags);
+				free(c.recent);
+			}
+		}
+	}
+	if (chosen.ways)
+		printf("\nbest within %u bytes: %u way, %u cells a line, %u lines, %u bytes, %.0f ips\n",
+				budget, chosen.ways, chosen.line, chosen.lines, chosen_bytes, CLOCK / (vm + best));
+	else
+		printf("\nno cache within %u bytes is quicker than reading flash directly\n", budget);
+	free(t);
+	return 0;
+}
@@ -2,7 +2,6 @@
 #include <assert.h>
 #include "crc8.h"
 #define POLYVAL (0xEBu) /**< https://users.ece.cmu.edu/~koopman/crc/ */
-#define INIT    (0xFFu)
 
 static inline uint8_t crc8_core(uint8_t data, uint8_t crc) {
 	crc ^= data;
@@ -17,9 +16,13 @@ static inline uint8_t crc8_core(uint8_t data, uint8_t crc) {
 
 uint8_t crc8(const uint8_t * const data, const size_t length) {
 	assert(data);
-	uint8_t crc = INIT;
+	uint8_t crc = CRC8_INIT;
 	for (size_t i = 0; i < length; i++)
 		crc = crc8_core(data[i], crc);
 	return crc;
 }
 
+uint8_t crc8_add(const uint8_t crc, const uint8_t data) {
+	return crc8_core(data, crc);
+}
+
@@ -11,7 +11,10 @@
 extern "C" {
 #endif
 
+#define CRC8_INIT (0xFFu) /**< CRC of no data, to add bytes to one at a time */
+
 uint8_t crc8(const uint8_t * const data, const size_t length);
+uint8_t crc8_add(const uint8_t crc, const uint8_t data);
 
 #ifdef __cplusplus
 }
@@ -6,8 +6,22 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifndef __AVR__
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcat_P strcat
+#endif
+
 #define SHADOW    (7)     /**< start location of shadow registers */
 #define MIN(X, Y) ((X) > (Y) ? (Y) : (X))
+#define ORDER_MAX (8)     /**< most word lists the image has in its search order */
+
+/* A word header consists of a link to the previous word in its word list (a
+ * byte address, zero ends the list) followed by the name of the word as a
+ * counted string, the top bits of the count are used as flags. */
+#define NAME_HIDDEN    (0x80)
+#define NAME_IMMEDIATE (0x40)
+#define NAME_LENGTH    (0x1F)
 
 typedef cell_t        m_t; /**< The VM is 16-bit, 'uintptr_t' would be more useful */
 typedef signed_cell_t s_t; /**< used for signed calculation and casting */
@@ -17,6 +31,7 @@ typedef double_cell_t d_t; /**< should be double the size of 'm_t' and unsigned
 m_t  embed_mmu_read_cb(embed_t const * const h, m_t addr)       { return ((m_t*)h->m)[addr]; }
 void embed_mmu_write_cb(embed_t * const h, m_t addr, m_t value) { ((m_t*)h->m)[addr] = value; }
 
+static inline int embed_mmu_flat(embed_t const * const h) { return h->o.read == embed_mmu_read_cb && h->o.write == embed_mmu_write_cb; }
 static inline int is_big_endian(void)              { return (*(uint16_t *)"\0\xff" < 0x100); }
 static void embed_normalize(embed_t *h, size_t l)  { assert(h); if (is_big_endian()) embed_buffer_swap(h->m, l); }
 int embed_nputc_cb(int ch, void *file)             { (void)file; return ch; }
@@ -87,41 +102,191 @@ int embed_puts(embed_t *h, const char *s) {
 	return r;
 }
 
-int embed_push(embed_t *h, m_t value) {
-	assert(h);
+/* The dictionary pointer is found from the definition of 'here', which is a
+ * literal address followed by a fetch, so any change to the dictionary can
+ * be spotted. Cached definitions are thrown away if the dictionary pointer
+ * is not where it was left after the last definition was compiled, they are
+ * not reclaimed from the dictionary. */
+static int embed_cache_locate(embed_t *h, embed_cache_t *c) {
+	m_t xt[2] = { 0 };
+	if (embed_eval(h, "' here ' catch\n") < 0 || embed_popn(h, xt, 2) < 0)
+		return -1;
+	const m_t literal = h->o.read(h, xt[0] >> 1);
+	if (!(literal & 0x8000))
+		return -1;
+	c->cp    = literal & 0x7FFF;
+	c->catch_xt = xt[1];
+	return 0;
+}
+
+/* 'xt' is run under 'catch', as the interpreter is not within one while it
+ * waits for input, by calling 'catch' as if from where the interpreter is
+ * waiting. It returns to there afterwards, finds no more input and leaves
+ * the virtual machine. */
+int embed_execute(embed_t *h, embed_cache_t *c, m_t xt) {
+	assert(h && c);
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	if (!c->cp && embed_cache_locate(h, c) < 0)
+		return -1;
+	if ((xt >> 1) >= embed_cells(h) || embed_push(h, xt) < 0)
+		return -1;
+	const m_t pc = mr(h, 0), rp = mr(h, 2);
+	if (rp <= mr(h, 3))
+		return -1;
+	mw(h, rp - 1, pc << 1);
+	mw(h, 2, rp - 1);
+	mw(h, 0, c->catch_xt >> 1);
+	m_t e = 0;
+	const int r = embed_eval(h, "");
+	if (r < 0 || embed_pop(h, &e) < 0)
+		return -1;
+	const int code = (s_t)e; /* the number thrown, if any */
+	return code > 0 ? -code : code;
+}
+
+static size_t embed_string_hash(const char *s) {
+	size_t hash = 0;
+	while (*s)
+		hash = (hash * 31u) + (uint8_t)*s++;
+	return hash;
+}
+
+/* A definition that fails to compile is taken back out of the dictionary,
+ * along with anything it left on the stack */
+static int embed_cache_compile(embed_t *h, embed_cache_t *c, const char *str, m_t *xt) {
+	const size_t depth = embed_depth(h);
+	const m_t here = h->o.read(h, c->cp >> 1);
+	if (embed_eval(h, ":noname\n") >= 0 && embed_eval(h, str) >= 0 && embed_eval(h, "\n;\n") >= 0)
+		if (embed_depth(h) == depth + 1)
+			return embed_pop(h, xt);
+	h->o.write(h, c->cp >> 1, here);
+	for (m_t discard = 0; embed_depth(h) > depth;)
+		if (embed_pop(h, &discard) < 0)
+			break;
+	return -1;
+}
+
+int embed_eval_cached(embed_t *h, embed_cache_t *c, const char *str) {
+	assert(h && c && c->entries && str);
+	assert(c->size && !(c->size & (c->size - 1)));
+	if (!c->cp && embed_cache_locate(h, c) < 0)
+		return embed_eval(h, str);
+	const m_t here = h->o.read(h, c->cp >> 1);
+	if (here != c->here) {
+		memset(c->entries, 0, c->size * sizeof(c->entries[0]));
+		c->here = here;
+	}
+	const size_t mask = c->size - 1, length = strlen(str), hash = embed_string_hash(str);
+	if (!length || length >= EMBED_CACHE_SOURCE)
+		return embed_eval(h, str);
+	for (size_t i = hash & mask, j = 0; j < c->size; i = (i + 1) & mask, j++) {
+		embed_cache_entry_t * const e = &c->entries[i];
+		if (e->source[0] && e->hash == hash && !strcmp(e->source, str))
+			return e->xt ? embed_execute(h, c, e->xt) : embed_eval(h, str);
+		if (e->source[0])
+			continue;
+		/* it is evaluated the first time, and only compiled if that did
+		 * not move the dictionary pointer, strings that do, such as
+		 * 'create x', would leave a definition behind every time */
+		const int r = embed_eval(h, str);
+		m_t xt = 0;
+		if (r < 0 || h->o.read(h, c->cp >> 1) != here)
+			return r;
+		memcpy(e->source, str, length + 1);
+		e->hash   = hash;
+		e->xt     = embed_cache_compile(h, c, str, &xt) < 0 ? 0 : xt;
+		c->here   = h->o.read(h, c->cp >> 1);
+		return r;
+	}
+	return embed_eval(h, str); /* cache full */
+}
+
+/* Bulk stack transfers check the depth and read and write the registers once
+ * for the whole transfer, instead of once per cell, and move the cells with
+ * 'memcpy' when the default MMU callbacks are in use. */
+int embed_popn(embed_t *h, m_t *s, const size_t n) {
+	assert(h && (s || !n));
 	const embed_mmu_read_t  mr = h->o.read;
 	const embed_mmu_write_t mw = h->o.write;
 	assert(mr && mw);
-	m_t rp = mr(h, 2), sp = mr(h, 3), sp0 = mr(h, 3 + SHADOW);
-	if (sp < 32 || sp < sp0)
+	const m_t rp = mr(h, 2), sp = mr(h, 3), sp0 = mr(h, 3 + SHADOW);
+	if (sp < 32 || sp < sp0 || (size_t)(sp - sp0) < n)
 		return -4; /* stack underflow */
-	if (sp > (EMBED_CORE_SIZE - 2) || (sp + 1) > rp)
+	if (sp > (EMBED_CORE_SIZE - 1) || sp > rp)
 		return -3; /* stack overflow */
-	mw(h, ++sp, mr(h, 1));
-	mw(h, 1, value);
-	mw(h, 3, sp);
+	if (!n)
+		return 0;
+	if (embed_mmu_flat(h)) {
+		m_t * const m = h->m;
+		s[n - 1] = m[1];
+		memcpy(s, &m[sp - n + 2], (n - 1) * sizeof(*s));
+		m[1] = m[sp - n + 1];
+		m[3] = sp - n;
+		return 0;
+	}
+	s[n - 1] = mr(h, 1);
+	for (size_t i = 1; i < n; i++)
+		s[n - 1 - i] = mr(h, sp - i + 1);
+	mw(h, 1, mr(h, sp - n + 1));
+	mw(h, 3, sp - n);
 	return 0;
 }
 
-int embed_pop(embed_t *h, m_t *value) {
-	assert(h);
+int embed_pushn(embed_t *h, const m_t *s, const size_t n) {
+	assert(h && (s || !n));
 	const embed_mmu_read_t  mr = h->o.read;
 	const embed_mmu_write_t mw = h->o.write;
 	assert(mr && mw);
-	m_t rp = mr(h, 2), sp = mr(h, 3), sp0 = mr(h, 3+SHADOW);
-	if (value)
-		*value = 0;
-	if (sp < 32 || (sp - 1) < sp0)
+	if (!n)
+		return 0;
+	m_t rp = mr(h, 2), sp = mr(h, 3), sp0 = mr(h, 3 + SHADOW);
+	if (sp < 32 || sp < sp0)
 		return -4; /* stack underflow */
-	if (sp > (EMBED_CORE_SIZE - 1) || sp > rp)
+	if ((sp + n) > (EMBED_CORE_SIZE - 1) || (sp + n) > rp)
 		return -3; /* stack overflow */
-	if (value)
-		*value = mr(h, 1);
-	mw(h, 1, mr(h, sp--));
+	if (embed_mmu_flat(h)) {
+		m_t * const m = h->m;
+		m[sp + 1] = m[1];
+		memcpy(&m[sp + 2], s, (n - 1) * sizeof(*s));
+		m[1] = s[n - 1];
+		m[3] = sp + n;
+		return 0;
+	}
+	mw(h, ++sp, mr(h, 1));
+	for (size_t i = 0; i < (n - 1); i++)
+		mw(h, ++sp, s[i]);
+	mw(h, 1, s[n - 1]);
 	mw(h, 3, sp);
 	return 0;
 }
 
+int embed_push(embed_t *h, m_t value) {
+	return embed_pushn(h, &value, 1);
+}
+
+int embed_pop(embed_t *h, m_t *value) {
+	m_t v = 0;
+	const int r = embed_popn(h, &v, 1);
+	if (value)
+		*value = v;
+	return r;
+}
+
+const m_t *embed_stack_window(embed_t *h, m_t *tos, size_t *depth) {
+	assert(h && tos && depth);
+	*tos = 0, *depth = 0;
+	if (!embed_mmu_flat(h))
+		return NULL;
+	const m_t * const m = h->m;
+	const m_t rp = m[2], sp = m[3], sp0 = m[3 + SHADOW];
+	if (sp < 32 || sp <= sp0 || sp > (EMBED_CORE_SIZE - 1) || sp > rp)
+		return NULL;
+	*tos   = m[1];
+	*depth = sp - sp0;
+	return &m[sp0 + 2];
+}
+
 size_t embed_depth(embed_t *h) {
 	assert(h);
 	const embed_mmu_read_t  mr = h->o.read;
@@ -129,6 +294,154 @@ size_t embed_depth(embed_t *h) {
 	return sp - sp0;
 }
 
+int embed_primitives_cb(embed_t *h, void *param) {
+	assert(h && param);
+	const embed_primitives_t * const p = (const embed_primitives_t*)param;
+	m_t s[EMBED_PRIMITIVE_CELLS + 1];
+	const m_t op = h->o.read(h, 1);
+	if (op >= p->length) {
+		const int r = embed_popn(h, s, 1);
+		return r ? r : 21; /* not implemented */
+	}
+	embed_primitive_t e; /* copied out of program memory on the AVR */
+	memcpy_P(&e, &p->primitives[op], sizeof e);
+	if (!(e.fn) || e.in > EMBED_PRIMITIVE_CELLS || e.out > EMBED_PRIMITIVE_CELLS)
+		return 21;
+	int r = embed_popn(h, s, e.in + 1); /* arguments and 'op' */
+	if (r)
+		return r;
+	if ((r = e.fn(h, p->param, s)))
+		return r;
+	return embed_pushn(h, s, e.out);
+}
+
+/* 'system' is added to the search order to find 'vm', the order is then put
+ * back as it was, as 'system' might have been in it already */
+int embed_primitives_bind(embed_t *h, const embed_primitives_t *p) {
+	assert(h && p);
+	m_t order[ORDER_MAX], n = 0;
+	if (embed_eval(h, "get-order\n") < 0 || embed_pop(h, &n) < 0 || n > ORDER_MAX || embed_popn(h, order, n) < 0)
+		return -1;
+	int r = embed_eval(h, "system +order\n");
+	for (size_t i = 0; i < p->length && r >= 0; i++) {
+		embed_primitive_t e;
+		memcpy_P(&e, &p->primitives[i], sizeof e);
+		char line[64] = ": ", digits[8] = { 0 }, *d = &digits[sizeof(digits) - 1];
+		if (!e.name)
+			continue;
+		if (strlen_P(e.name) > NAME_LENGTH || i > 0xFFFFu)
+			return -1;
+		size_t n = i;
+		do { *--d = '0' + (n % 10); n /= 10; } while (n);
+		strcat_P(line, e.name);
+		strcat(line, " ");
+		strcat(line, d);
+		strcat(line, " vm ;\n");
+		r = embed_eval(h, line);
+	}
+	if (embed_pushn(h, order, n) < 0 || embed_push(h, n) < 0 || embed_eval(h, "set-order\n") < 0)
+		return -1;
+	return r < 0 ? -1 : 0;
+}
+
+/* The registers in a task control block are kept as 'embed_vm' would find
+ * them in the core when carrying on after returning, which is the state the
+ * console task is left in when there is no input. The bottom of the variable
+ * stack, from the shadow registers, is switched as well so the stack checks
+ * made by 'embed_popn' and the like are against the stack of the running
+ * task. 'pause' is instead called from within the 'vm' instruction, which
+ * pops the return stack after the callback returns, so the return stack
+ * pointer is adjusted by one when a task is saved and loaded from within it.
+ * Each stack has a limit, the variable stack grows up to below its limit and
+ * the return stack down to above its. */
+enum { TCB_NEXT, TCB_PC, TCB_T, TCB_RP, TCB_SP, TCB_SP0, TCB_LIMIT, TCB_RLIMIT };
+
+int embed_task_init(embed_t *h, embed_tasks_t *t, m_t tcb, m_t limit, m_t rlimit) {
+	assert(h && t);
+	if ((size_t)tcb + EMBED_TASK_CELLS > embed_cells(h))
+		return -1;
+	h->o.write(h, tcb + TCB_NEXT, tcb);
+	h->o.write(h, tcb + TCB_LIMIT, limit);
+	h->o.write(h, tcb + TCB_RLIMIT, rlimit);
+	t->current = tcb;
+	return 0;
+}
+
+int embed_task_spawn(embed_t *h, embed_tasks_t *t, m_t tcb, m_t xt, m_t sp0, m_t rp0, m_t limit, m_t rlimit) {
+	assert(h && t);
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	const size_t l = embed_cells(h);
+	if ((size_t)tcb + EMBED_TASK_CELLS > l || sp0 >= l || rp0 >= l || limit > l || rlimit >= rp0 || tcb == t->current)
+		return -1;
+	mw(h, t->current + TCB_RP,  mr(h, 2)); /* so it is checked like the others */
+	mw(h, t->current + TCB_SP,  mr(h, 3));
+	mw(h, t->current + TCB_SP0, mr(h, 3 + SHADOW));
+	m_t task = t->current, found = 0;
+	for (size_t i = 0; !i || task != t->current; i++, task = mr(h, task + TCB_NEXT)) {
+		if (i > l / EMBED_TASK_CELLS) /* not a ring */
+			return -1;
+		if (task == tcb) {
+			found = 1;
+			continue;
+		}
+		const m_t rp = mr(h, task + TCB_RP);
+		if (rp > rlimit && rp <= rp0)
+			return -3; /* already in the return stack of the new task */
+		if (rp > rp0 && rp0 > mr(h, task + TCB_RLIMIT))
+			mw(h, task + TCB_RLIMIT, rp0);
+		if (mr(h, task + TCB_SP0) > sp0 || sp0 >= mr(h, task + TCB_LIMIT))
+			continue;
+		if (mr(h, task + TCB_SP) >= sp0)
+			return -3; /* already in the stack of the new task */
+		mw(h, task + TCB_LIMIT, sp0);
+	}
+	if (!found) {
+		h->o.write(h, tcb + TCB_NEXT, h->o.read(h, t->current + TCB_NEXT));
+		h->o.write(h, t->current + TCB_NEXT, tcb);
+	}
+	h->o.write(h, tcb + TCB_PC, xt >> 1);
+	h->o.write(h, tcb + TCB_T,  0);
+	h->o.write(h, tcb + TCB_RP, rp0);
+	h->o.write(h, tcb + TCB_SP, sp0);
+	h->o.write(h, tcb + TCB_SP0, sp0);
+	h->o.write(h, tcb + TCB_LIMIT, limit);
+	h->o.write(h, tcb + TCB_RLIMIT, rlimit);
+	return 0;
+}
+
+static int embed_task_next(embed_t *h, embed_tasks_t *t, const m_t adjust) {
+	assert(h && t);
+	const m_t from = t->current, to = h->o.read(h, from + TCB_NEXT);
+	if (h->o.read(h, 3) >= h->o.read(h, from + TCB_LIMIT) || h->o.read(h, 2) + adjust <= h->o.read(h, from + TCB_RLIMIT))
+		return -3; /* into the stacks of another task, or a control block */
+	if (to == from)
+		return 0;
+	if ((size_t)to + EMBED_TASK_CELLS > embed_cells(h))
+		return -1;
+	h->o.write(h, from + TCB_PC, h->o.read(h, 0));
+	h->o.write(h, from + TCB_T,  h->o.read(h, 1));
+	h->o.write(h, from + TCB_RP, h->o.read(h, 2) + adjust);
+	h->o.write(h, from + TCB_SP, h->o.read(h, 3));
+	h->o.write(h, from + TCB_SP0, h->o.read(h, 3 + SHADOW));
+	h->o.write(h, 0, h->o.read(h, to + TCB_PC));
+	h->o.write(h, 1, h->o.read(h, to + TCB_T));
+	h->o.write(h, 2, h->o.read(h, to + TCB_RP) - adjust);
+	h->o.write(h, 3, h->o.read(h, to + TCB_SP));
+	h->o.write(h, 3 + SHADOW, h->o.read(h, to + TCB_SP0));
+	t->current = to;
+	return 0;
+}
+
+int embed_task_switch(embed_t *h, embed_tasks_t *t) {
+	return embed_task_next(h, t, 0);
+}
+
+int embed_pause_cb(embed_t *h, void *param, m_t *s) {
+	(void)s;
+	return -embed_task_next(h, (embed_tasks_t*)param, 1); /* thrown negated, as -3 for stack overflow */
+}
+
 embed_opt_t embed_opt_default(void) {
 	embed_opt_t o = {
 		.get      = embed_ngetc_cb, .put   = embed_nputc_cb, .save = NULL,
@@ -140,6 +453,327 @@ embed_opt_t embed_opt_default(void) {
 	return o;
 }
 
+static inline uint8_t embed_byte(embed_t const * const h, const m_t addr) {
+	const m_t c = h->o.read(h, addr >> 1);
+	return (addr & 1) ? c >> 8 : c;
+}
+
+static int embed_bytes_equal(embed_t const * const h, m_t a, m_t b, uint8_t length) {
+	while (length--)
+		if (embed_byte(h, a++) != embed_byte(h, b++))
+			return 0;
+	return 1;
+}
+
+static int embed_name_match(embed_t const * const h, const m_t link, const m_t a) {
+	const uint8_t length = embed_byte(h, a);
+	if ((embed_byte(h, link + 2) & (NAME_HIDDEN | NAME_LENGTH)) != length)
+		return 0;
+	return embed_bytes_equal(h, link + 3, a + 1, length);
+}
+
+static m_t embed_name_hash(embed_t const * const h, const m_t a) {
+	const uint8_t length = embed_byte(h, a) & NAME_LENGTH;
+	m_t hash = length;
+	for (m_t i = 0; i < length; i++)
+		hash = (hash * 31u) + embed_byte(h, a + 1 + i);
+	return hash;
+}
+
+static void embed_index_reset(embed_index_t *x) {
+	assert(x);
+	memset(x->table, 0, x->size * EMBED_INDEX_ENTRY * sizeof(m_t));
+	memset(x->heads, 0, sizeof(x->heads));
+	memset(x->checks, 0, sizeof(x->checks));
+}
+
+/* A word defined where a forgotten one was has the same link address, so
+ * the newest word of each chain is checked for having the same link field
+ * and name as when it was indexed */
+static m_t embed_index_check(embed_t const * const h, const m_t link) {
+	return h->o.read(h, link >> 1) ^ embed_name_hash(h, link + 2);
+}
+
+/* Each entry keeps the link pointing to the word, 'prev', as well, so a
+ * search need not walk the word list to find it */
+static int embed_index_insert(embed_t const * const h, embed_index_t *x, const m_t link, const m_t chain, const m_t prev) {
+	const size_t mask = x->size - 1;
+	const uint8_t length = embed_byte(h, link + 2) & NAME_LENGTH;
+	for (size_t i = embed_name_hash(h, link + 2) & mask, j = 0; j < x->size; i = (i + 1) & mask, j++) {
+		m_t * const e = &x->table[i * EMBED_INDEX_ENTRY];
+		if (!e[0]) {
+			e[0] = link, e[1] = chain, e[2] = prev;
+			return 0;
+		}
+		if (e[1] == chain && (embed_byte(h, e[0] + 2) & NAME_LENGTH) == length && embed_bytes_equal(h, e[0] + 3, link + 3, length)) {
+			if (link > e[0]) /* newer definitions are at higher addresses */
+				e[0] = link, e[2] = prev;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* The word that was the newest in a chain has words linked in above it, so
+ * is now pointed to by the oldest of those, if it is in the index at all */
+static void embed_index_relink(embed_t const * const h, embed_index_t *x, const m_t link, const m_t chain, const m_t prev) {
+	const size_t mask = x->size - 1;
+	for (size_t i = embed_name_hash(h, link + 2) & mask, j = 0; j < x->size; i = (i + 1) & mask, j++) {
+		m_t * const e = &x->table[i * EMBED_INDEX_ENTRY];
+		if (!e[0])
+			return;
+		if (e[0] == link && e[1] == chain) {
+			e[2] = prev;
+			return;
+		}
+	}
+}
+
+/* A chain whose newest word has changed is removed, its entries are kept but
+ * marked as belonging to no chain so the entries after them can be found */
+static void embed_index_drop(embed_index_t *x, const int c) {
+	for (size_t i = 0; i < x->size; i++) {
+		m_t * const e = &x->table[i * EMBED_INDEX_ENTRY];
+		if (e[0] && e[1] == (m_t)c)
+			e[1] = EMBED_INDEX_CHAINS;
+	}
+	x->heads[c]  = 0;
+	x->checks[c] = 0;
+}
+
+/* Find the chain in the index for the word list starting at 'head', setting
+ * 'top' to the word the chain starts at, returns negative if the word list
+ * cannot be indexed. Words defined above a chain are added to it, whereas
+ * anything else linked to one is left for the search to check before using
+ * the index; the cell holding a word list is searched as if it were a word
+ * and changes with each definition, so it is not made into a chain. */
+static int embed_index_update(embed_t const * const h, embed_index_t *x, const m_t head, m_t *top) {
+	const embed_mmu_read_t mr = h->o.read;
+	const size_t l = embed_cells(h);
+	int c = 0;
+	m_t p = head, low = (m_t)-1;
+	*top = head;
+	for (size_t n = 0; p; p = mr(h, p >> 1), n++) {
+		if (n > l)
+			return -1; /* cyclic word list */
+		for (c = 0; c < EMBED_INDEX_CHAINS; c++) {
+			if (x->heads[c] != p)
+				continue;
+			if (x->checks[c] == embed_index_check(h, p))
+				goto found;
+			embed_index_drop(x, c); /* cut back and defined again */
+		}
+		low = p < low ? p : low;
+	}
+	for (c = 0; c < EMBED_INDEX_CHAINS && x->heads[c]; c++)
+		;
+	if (c == EMBED_INDEX_CHAINS) {
+		embed_index_reset(x);
+		c = 0;
+	}
+found:
+	if (p && low < p) {
+		*top = p;
+		return c;
+	}
+	m_t prev = head;
+	for (m_t q = head; q != p; prev = q, q = mr(h, q >> 1)) {
+		if (embed_index_insert(h, x, q, c, prev) < 0) {
+			embed_index_reset(x);
+			return -1;
+		}
+	}
+	if (p && p != head)
+		embed_index_relink(h, x, p, c, prev);
+	x->heads[c]  = head;
+	x->checks[c] = embed_index_check(h, head);
+	return c;
+}
+
+/* Search the word list starting at 'head' for the counted string at 'a',
+ * returning the link of the word found (or zero) and the link that points to
+ * it in 'prev', or the link itself if it is the first word in the list. */
+static m_t embed_search(embed_t const * const h, const m_t a, const m_t head, m_t *prev) {
+	assert(prev);
+	embed_index_t * const x = h->o.index;
+	const uint8_t length = embed_byte(h, a);
+	if (x && x->size && length <= NAME_LENGTH) {
+		m_t top = head, p = head, q = head;
+		const int c = embed_index_update(h, x, head, &top);
+		for (; c >= 0 && p != top; q = p, p = h->o.read(h, p >> 1)) {
+			if (embed_name_match(h, p, a)) {
+				*prev = q;
+				return p;
+			}
+		}
+		const size_t mask = x->size - 1;
+		for (size_t i = embed_name_hash(h, a) & mask, j = 0; c >= 0 && j < x->size; i = (i + 1) & mask, j++) {
+			const m_t * const e = &x->table[i * EMBED_INDEX_ENTRY];
+			if (!e[0])
+				return 0;
+			if (e[1] != (m_t)c || (embed_byte(h, e[0] + 2) & NAME_LENGTH) != length || !embed_bytes_equal(h, e[0] + 3, a + 1, length))
+				continue;
+			if (embed_byte(h, e[0] + 2) & NAME_HIDDEN)
+				break; /* an older definition might be visible */
+			*prev = e[0] == top ? q : e[2];
+			return e[0];
+		}
+	}
+	for (m_t p = head, q = head; p; q = p, p = h->o.read(h, p >> 1)) {
+		if (embed_name_match(h, p, a)) {
+			*prev = q;
+			return p;
+		}
+	}
+	return 0;
+}
+
+int embed_find_install(embed_t *h, m_t xt) {
+	assert(h);
+	const m_t call = h->o.read(h, xt >> 1), native = 0x7E1C; /* ALU 30 and exit */
+	if ((call & 0xE000) != 0x4000 && (call & 0xE000) != 0x0000) /* a call, or a branch if tail called */
+		return -1;
+	h->o.write(h, call & 0x1FFF, native);
+	return h->o.read(h, call & 0x1FFF) == native ? 0 : -1;
+}
+
+/* Block memory operations work on byte addresses, with the default MMU on a
+ * little endian machine these map directly onto the core, otherwise memory is
+ * accessed a cell at a time in chunks of BLOCK_CHUNK bytes. */
+#define BLOCK_CHUNK (32u)
+
+static void embed_bytes_read(embed_t const * const h, m_t addr, uint8_t *b, size_t length) {
+	const embed_mmu_read_t mr = h->o.read;
+	while (length) {
+		const m_t c = mr(h, addr >> 1);
+		if (addr & 1) {
+			*b++ = c >> 8;
+			addr++, length--;
+			continue;
+		}
+		*b++ = c;
+		addr++, length--;
+		if (length)
+			*b++ = c >> 8, addr++, length--;
+	}
+}
+
+static void embed_bytes_write(embed_t * const h, m_t addr, const uint8_t *b, size_t length) {
+	const embed_mmu_read_t  mr = h->o.read;
+	const embed_mmu_write_t mw = h->o.write;
+	while (length) {
+		if ((addr & 1) || length == 1) { /* partial cell, read-modify-write */
+			const m_t c = mr(h, addr >> 1);
+			mw(h, addr >> 1, (addr & 1) ? (c & 0x00FFu) | ((m_t)*b << 8) : (c & 0xFF00u) | *b);
+			b++, addr++, length--;
+			continue;
+		}
+		mw(h, addr >> 1, b[0] | ((m_t)b[1] << 8));
+		b += 2, addr += 2, length -= 2;
+	}
+}
+
+/* Byte by byte forward copy, so overlapping moves to a higher address
+ * replicate the source, the same as 'cmove' does. */
+static void embed_move(embed_t * const h, m_t src, m_t dst, m_t length, const int flat) {
+	uint8_t *m = h->m, buf[BLOCK_CHUNK];
+	const int overlap = dst > src && (m_t)(dst - src) < length;
+	if (flat && !overlap) {
+		memmove(m + dst, m + src, length);
+		return;
+	}
+	m_t chunk = overlap ? dst - src : length;
+	chunk = flat ? chunk : MIN(chunk, BLOCK_CHUNK);
+	while (length) {
+		const m_t n = MIN(chunk, length);
+		if (flat) {
+			memcpy(m + dst, m + src, n);
+		} else {
+			embed_bytes_read(h, src, buf, n);
+			embed_bytes_write(h, dst, buf, n);
+		}
+		src += n, dst += n, length -= n;
+	}
+}
+
+static void embed_fill(embed_t * const h, m_t addr, m_t length, const uint8_t c, const int flat) {
+	uint8_t buf[BLOCK_CHUNK];
+	if (flat) {
+		memset((uint8_t*)h->m + addr, c, length);
+		return;
+	}
+	memset(buf, c, sizeof buf);
+	while (length) {
+		const m_t n = MIN(BLOCK_CHUNK, length);
+		embed_bytes_write(h, addr, buf, n);
+		addr += n, length -= n;
+	}
+}
+
+/* Same result as 'compare' in the image, which is not quite the standard
+ * one, it returns the difference in lengths if they differ, or the
+ * difference between the first two bytes that differ, or zero. */
+static m_t embed_compare(embed_t const * const h, m_t a1, m_t u1, m_t a2, m_t u2, const int flat) {
+	uint8_t b1[BLOCK_CHUNK], b2[BLOCK_CHUNK];
+	if (u1 != u2)
+		return u1 - u2;
+	while (u1) {
+		const m_t n = MIN(BLOCK_CHUNK, u1);
+		const uint8_t *p1 = (const uint8_t*)h->m + a1, *p2 = (const uint8_t*)h->m + a2;
+		if (!flat) {
+			embed_bytes_read(h, a1, b1, n);
+			embed_bytes_read(h, a2, b2, n);
+			p1 = b1, p2 = b2;
+		}
+		if (memcmp(p1, p2, n))
+			for (m_t i = 0; i < n; i++)
+				if (p1[i] != p2[i])
+					return p1[i] - p2[i];
+		a1 += n, a2 += n, u1 -= n;
+	}
+	return 0;
+}
+
+/* ALU operation 31, 'op' selects the operation, which pops its arguments
+ * off the stack ('sp' and 'tos'). Returns zero or a number to throw. */
+static int embed_block(embed_t * const h, const m_t op, m_t *sp, m_t *tos) {
+	const embed_mmu_read_t mr = h->o.read;
+	const d_t bytes = (d_t)embed_cells(h) * 2;
+	const int flat = embed_mmu_flat(h) && !is_big_endian();
+	const m_t a = mr(h, *sp - 3), b = mr(h, *sp - 2), c = mr(h, *sp - 1), d = mr(h, *sp);
+	switch (op) {
+	case EMBED_BLOCK_MOVE: /* a1 a2 u -- */
+		if (((d_t)b + d) > bytes || ((d_t)c + d) > bytes)
+			return -9; /* invalid memory address */
+		embed_move(h, b, c, d, flat);
+		break;
+	case EMBED_BLOCK_FILL: /* a u c -- */
+		if (((d_t)b + c) > bytes)
+			return -9;
+		embed_fill(h, b, c, d, flat);
+		break;
+	case EMBED_BLOCK_COMPARE: /* a1 u1 a2 u2 -- n */
+		if (((d_t)a + b) > bytes || ((d_t)c + d) > bytes)
+			return -9;
+		*sp -= 4;
+		*tos = embed_compare(h, a, b, c, d, flat);
+		return 0;
+	default:
+		return 21; /* not implemented */
+	}
+	*tos = mr(h, *sp - 3);
+	*sp -= 4;
+	return 0;
+}
+
+int embed_block_install(embed_t *h, m_t xt, embed_block_e op) {
+	assert(h);
+	const m_t addr = xt >> 1, literal = 0x8000 | op, native = 0x7F1C; /* ALU 31 and exit */
+	h->o.write(h, addr,     literal);
+	h->o.write(h, addr + 1, native);
+	return h->o.read(h, addr) == literal && h->o.read(h, addr + 1) == native ? 0 : -1;
+}
+
 #ifdef NDEBUG
 #define trace(VM,PC,INSTRUCTION,T,RP,SP)
 #else
@@ -182,38 +816,73 @@ static inline void trace(embed_t *h, m_t pc, m_t instruction, m_t t, m_t rp, m_t
 }
 #endif
 
-int embed_vm(embed_t * const h) {
-	assert(h);
-	BUILD_BUG_ON (sizeof(m_t)    != sizeof(s_t));
-	BUILD_BUG_ON((sizeof(m_t)*2) != sizeof(d_t));
+/* The masked virtual machine replaces the bounds checks made on every
+ * instruction with guard regions: the core must be a power of two in size
+ * and 'EMBED_GUARDED_SIZE' cells must be allocated for it. Loads, stores and
+ * instruction fetches are masked to the core, whilst the stack pointers are
+ * used as they are, as they are 16-bit any value they take is within the
+ * allocation, overflowing or underflowing a stack writes into the guard region
+ * above the core and not over it. Leaving the core is then detected at the
+ * next call, branch or return instead of on each instruction, and reported as
+ * a critical error as before. It only works with the default MMU.
+ *
+ * Both versions keep the second cell of the variable stack and the top of
+ * the return stack in locals, as well as the top of the variable stack in
+ * 't'. 'nos' is the cell at 'sp' and 'rtop' the cell at 'rp', the core holds
+ * stale values for these two cells. The cells below them are always up to
+ * date, so a cache is only spilled when a stack grows and only filled when it
+ * shrinks. The ALU operations in 'SYNC_ALU' look at the stacks in the core, or
+ * let something else look at them, they are run with the cache spilled and
+ * refill it afterwards. Loads and stores check whether they alias a cached
+ * cell instead, so 'sp@' and 'rp@' do not need to spill anything. */
+#define SYNC_ALU (0xD3700000uL) /**< ALU operations 20-22, 24, 25, 28, 30 and 31 */
+
+static inline int embed_run(embed_t * const h, const int masked) {
 	embed_opt_t *o = &(h->o);
 	static const m_t delta[] = { 0, 1, -2, -1 }; /* two bit signed value */
 	const embed_mmu_read_t  mr    = o->read;
 	const embed_mmu_write_t mw    = o->write;
 	const embed_yield_t     yield = o->yield;
 	void  *yields = o->yields;
+	m_t   *const m = h->m;
 	assert(mr && mw && yield);
-	const m_t l = embed_cells(h);
-	m_t pc = mr(h, 0), t = mr(h, 1), rp = mr(h, 2), sp = mr(h, 3), r = 0;
+	const m_t l = embed_cells(h), mask = l - 1;
+#define READ(ADDR)         (masked ? m[(m_t)(ADDR)] : mr(h, (ADDR)))
+#define WRITE(ADDR, VALUE) (masked ? (void)(m[(m_t)(ADDR)] = (m_t)(VALUE)) : mw(h, (ADDR), (VALUE)))
+#define FILL(ADDR)         ((masked || (ADDR) < l) ? READ(ADDR) : 0)
+#define SPILL()            if (masked || (sp < l && rp < l)) { WRITE(sp, nos); WRITE(rp, rtop); }
+#define GUARD()            if (masked && ((pc | sp | rp) & ~mask)) { r = -1; goto finished; }
+	m_t pc = READ(0), t = READ(1), rp = READ(2), sp = READ(3), r = 0;
+	m_t nos = FILL(sp), rtop = FILL(rp);
 	for (d_t d; !yield(yields); ) {
-		const m_t instruction = mr(h, pc++);
+		const m_t instruction = masked ? m[pc++ & mask] : mr(h, pc++);
 		trace(h, pc, instruction, t, rp, sp);
-		if ((r = -!(sp < l && rp < l && pc < l))) /* critical error */
+		if (!masked && (r = -!(sp < l && rp < l && pc < l))) /* critical error */
 			goto finished;
 		if (0x8000 & instruction) { /* literal */
-			mw(h, ++sp, t);
+			WRITE(sp++, nos);
+			nos     = t;
 			t       = instruction & 0x7FFF;
 		} else if ((0xE000 & instruction) == 0x6000) { /* ALU */
-			m_t n = mr(h, sp), T = t;
-			pc = (instruction & 0x10) ? (mr(h, rp) >> 1) : pc;
-			switch((instruction >> 8u) & 0x1f) {
+			const unsigned alu = (instruction >> 8u) & 0x1f;
+			const int sync = (SYNC_ALU >> alu) & 1;
+			m_t n = nos, T = t;
+			if (instruction & 0x10) {
+				GUARD();
+				pc = rtop >> 1;
+			}
+			if (sync)
+				SPILL();
+			switch(alu) {
 			case  0:  T = t;                  break;
 			case  1:  T = n;                  break;
-			case  2:  T = mr(h, rp);          break;
-			case  3:  T = mr(h, (t>>1)%l);    break;
-			case  4:  mw(h, (t>>1)%l, n); T = mr(h, --sp); break;
-			case  5:  d = (d_t)t + n; T = d >> 16; mw(h, sp, d); n = d; break;
-			case  6:  d = (d_t)t * n; T = d >> 16; mw(h, sp, d); n = d; break;
+			case  2:  T = rtop;               break;
+			case  3: { const m_t a = masked ? (t>>1) & mask : (t>>1)%l;
+					 T = a == sp ? nos : a == rp ? rtop : READ(a); } break;
+			case  4: { const m_t a = masked ? (t>>1) & mask : (t>>1)%l;
+					 WRITE(a, n); rtop = a == rp ? n : rtop; sp--; T = nos = FILL(sp); } break;
+			case  5:  d = (d_t)t + n; T = d >> 16; nos = d; n = d; break;
+			case  6:  d = (d_t)t * n; T = d >> 16; nos = d; n = d; break;
 			case  7:  T = t&n;                break;
 			case  8:  T = t|n;                break;
 			case  9:  T = t^n;                break;
@@ -231,10 +900,10 @@ int embed_vm(embed_t * const h) {
 			case 21: rp = t >> 1; T = n;      break;
 			case 22: if (o->save) { T = o->save(h, o->name, n >> 1, ((d_t)t + 1) >> 1); } else { pc = 4; T = 21; } break;
 			case 23: if (o->put) { T = o->put(t, o->out); } else { pc = 4; T = 21; } break;
-			case 24: if (o->get) { int nd = 0; mw(h, ++sp, t); T = o->get(o->in, &nd); t = T; n = nd; } else { pc = 4; T = 21; } break;
-			case 25: if (t) { d = mr(h, --sp) | ((d_t)n << 16); T= d / t; t = d % t; n = t; } else { pc = 4; T=10; } break;
+			case 24: if (o->get) { int nd = 0; WRITE(++sp, t); T = o->get(o->in, &nd); t = T; n = nd; } else { pc = 4; T = 21; } break;
+			case 25: if (t) { d = READ(--sp) | ((d_t)n << 16); T= d / t; t = d % t; n = t; } else { pc = 4; T=10; } break;
 			case 26: if (t) { T=(s_t)n / t; t=(s_t)n % t; n = t; } else { pc = 4; T = 10; } break;
-			case 27: if (mr(h, rp)) { mw(h, rp, 0); sp--; r = t; t = n; goto finished; }; T = t; break;
+			case 27: if (rtop) { rtop = 0; sp--; r = t; t = n; nos = FILL(sp); goto finished; }; T = t; break;
 			case 28: if (o->callback) {
 					 mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
 					 r = o->callback(h, o->param);
@@ -242,26 +911,89 @@ int embed_vm(embed_t * const h) {
 					 if (r) { pc = 4; T = r; }
 				 } else { pc = 4; T = 21; }  break;
 			case 29: T = o->options; o->options = t; break;
+			case 30: { /* ( a head -- 0 | prev link 1 | prev link -1 ) */
+					 m_t prev = 0;
+					 const m_t link = embed_search(h, n, t, &prev);
+					 if (link) {
+						 WRITE(sp, prev);
+						 WRITE(++sp, link);
+						 n = link;
+						 T = (embed_byte(h, link + 2) & NAME_IMMEDIATE) ? 1 : -1;
+					 } else {
+						 n = READ(--sp);
+						 T = 0;
+					 }
+				 } break;
+			case 31: { /* ( ... op -- ... ) */
+					 const int e = embed_block(h, t, &sp, &T);
+					 if (e) { pc = 4; T = e; }
+				 } break;
 			default: pc = 4; T = 21; /* not implemented */ break;
 			}
-			sp += delta[ instruction       & 0x3];
-			rp -= delta[(instruction >> 2) & 0x3];
-			if (instruction & 0x80)
-				mw(h, sp, t);
-			if (instruction & 0x40)
-				mw(h, rp, t);
+			if (sync) {
+				sp += delta[ instruction       & 0x3];
+				rp -= delta[(instruction >> 2) & 0x3];
+				if (instruction & 0x80)
+					WRITE(sp, t);
+				if (instruction & 0x40)
+					WRITE(rp, t);
+				nos  = FILL(sp);
+				rtop = FILL(rp);
+			} else {
+				const m_t dd = delta[instruction & 0x3], rd = delta[(instruction >> 2) & 0x3];
+				if (dd) {
+					if (dd == 1)
+						WRITE(sp, nos);
+					sp += dd;
+					if (!(instruction & 0x80))
+						nos = FILL(sp);
+				}
+				if (rd) {
+					if (rd == 1)
+						WRITE(rp, rtop);
+					rp -= rd;
+					if (!(instruction & 0x40))
+						rtop = FILL(rp);
+				}
+				nos  = (instruction & 0x80) ? t : nos;
+				rtop = (instruction & 0x40) ? t : rtop;
+			}
 			t = (instruction & 0x20) ? n : T;
 		} else if (0x4000 & instruction) { /* call */
-			mw(h, --rp, pc << 1);
+			GUARD();
+			WRITE(rp--, rtop);
+			rtop    = pc << 1;
 			pc      = instruction & 0x1FFF;
 		} else if (0x2000 & instruction) { /* 0branch */
+			GUARD();
 			pc = !t ? instruction & 0x1FFF : pc;
-			t  = mr(h, sp--);
+			t  = nos;
+			sp--;
+			nos = FILL(sp);
 		} else { /* branch */
+			GUARD();
 			pc = instruction & 0x1FFF;
 		}
 	}
-finished: mw(h, 0, pc), mw(h, 1, t), mw(h, 2, rp), mw(h, 3, sp);
+finished: SPILL();
+	WRITE(0, pc), WRITE(1, t), WRITE(2, rp), WRITE(3, sp);
+#undef READ
+#undef WRITE
+#undef FILL
+#undef SPILL
+#undef GUARD
 	return (s_t)r;
 }
 
+int embed_vm(embed_t * const h) {
+	assert(h);
+	BUILD_BUG_ON (sizeof(m_t)    != sizeof(s_t));
+	BUILD_BUG_ON((sizeof(m_t)*2) != sizeof(d_t));
+	BUILD_BUG_ON(EMBED_GUARDED_SIZE != (1uL << (sizeof(m_t) * 8)));
+#if EMBED_MASKED_ON
+	const m_t l = embed_cells(h);
+	if (h->o.masked && embed_mmu_flat(h) && l && !(l & (l - 1)))
+		return embed_run(h, 1);
+#endif
+	return embed_run(h, 0);
+}
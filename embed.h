@@ -16,6 +16,15 @@ extern "C" {
 #include <stdint.h>
 
 #define EMBED_CORE_SIZE (32768uL)      /**< core size in cells */
+#define EMBED_GUARDED_SIZE (65536uL)   /**< cells to allocate for a core run by the masked virtual machine */
+
+#ifndef EMBED_MASKED_ON
+#ifdef __AVR__
+#define EMBED_MASKED_ON (0) /**< the masked virtual machine doubles the code size of 'embed_vm' */
+#else
+#define EMBED_MASKED_ON (1) /**< compile in the masked virtual machine, see 'embed_opt_t' */
+#endif
+#endif
 
 typedef uint16_t cell_t;               /**< Virtual Machine Cell size: 16-bit*/
 typedef  int16_t signed_cell_t;        /**< Virtual Machine Signed Cell */
@@ -92,6 +101,24 @@ typedef void (*embed_mmu_write_t)(embed_t * const h, cell_t addr, cell_t value);
  * should continue */
 typedef int (*embed_yield_t)(void *param);
 
+#define EMBED_INDEX_CHAINS (4) /**< maximum number of word lists 'embed_index_t' can track */
+#define EMBED_INDEX_ENTRY  (3) /**< cells in each entry of the table of an 'embed_index_t' */
+
+/**@brief An optional hash index over the dictionary, it is used by the
+ * native dictionary search operation (ALU operation 30) to avoid searching
+ * each word list linearly. The index is brought up to date with any words
+ * defined in a word list since the last search, a word list that shrinks
+ * gets a chain of its own, a chain is dropped if its newest word is replaced
+ * by one defined at the same address, and the index is rebuilt when it or
+ * the chains run out, so it does not need invalidating by the user. It
+ * should be zeroed before 'table' and 'size' are set. */
+typedef struct {
+	cell_t *table; /**< hash table, 'size' entries of link address, chain number and the link pointing to it */
+	size_t size;   /**< number of entries in 'table', must be a power of two */
+	cell_t heads[EMBED_INDEX_CHAINS]; /**< newest word indexed in each chain, zero if unused */
+	cell_t checks[EMBED_INDEX_CHAINS]; /**< link field and name hash of each head, to spot it being redefined */
+} embed_index_t;
+
 typedef enum {
 	EMBED_VM_TRACE_ON     = 1u << 0, /**< turn tracing on */
 	EMBED_VM_RAW_TERMINAL = 1u << 1, /**< raw terminal mode */
@@ -106,12 +133,14 @@ typedef struct {
 	embed_mmu_read_t  read;     /**< callback to read location from virtual machine memory */
 	embed_callback_t  callback; /**< arbitrary user supplied callback */
 	embed_yield_t     yield;    /**< callback to force the virtual machine to yield */
+	embed_index_t    *index;    /**< optional dictionary hash index, may be NULL */
 	void	*in,                /**< first argument to 'getc' */
 		*out,               /**< second argument to 'putc' */
 		*param,             /**< first argument to 'callback' */
 		*yields;            /**< parameter to yield */
 	const void *name;           /**< second argument to 'save' */
 	embed_vm_option_e options;  /**< virtual machine options register */
+	int masked;                 /**< use the masked virtual machine, see 'embed_vm' */
 } embed_opt_t; /**< Embed VM options structure for customizing behavior */
 
 struct embed_t { /**@todo merge with embed_opt_t */
@@ -198,6 +227,13 @@ void embed_buffer_swap(cell_t *b, size_t l);
  * options structure contains the callbacks and the data the callbacks might
  * require. You should call this function if you need to customize the virtual
  * machines behavior so it reads or writes to different I/O sources.
+ *
+ * If 'masked' is set in the options, the default MMU is in use and the core
+ * size is a power of two, then a faster version of the virtual machine is
+ * run, which masks addresses instead of checking them on every instruction.
+ * The core must be 'EMBED_GUARDED_SIZE' cells long for this, the cells past
+ * the end of the image are a guard region which the stacks may run into
+ * before the error is detected and returned.
  * @param h, initialized virtual machine
  * @return zero on success, negative on failure */
 int embed_vm(embed_t *h);
@@ -217,11 +253,156 @@ int embed_push(embed_t *h, cell_t value);
  * @return zero on success, negative on failure */
 int embed_pop(embed_t *h, cell_t *value);
 
+/**@brief Pop 'n' values off the stack into 's' in one transfer, the stack
+ * depth is checked once for all of them. This is cheaper than calling
+ * 'embed_pop' 'n' times, and can be called from the same places.
+ * @param h, initialized Virtual Machine
+ * @param s, array of at least 'n' cells to pop into, in stack order so the
+ * top of the stack is placed in 's[n - 1]'
+ * @param n, number of cells to pop
+ * @return zero on success, negative on failure, in which case nothing is
+ * popped */
+int embed_popn(embed_t *h, cell_t *s, const size_t n);
+
+/**@brief Push 'n' values from 's' onto the stack in one transfer.
+ * @param h, initialized Virtual Machine
+ * @param s, array of 'n' cells to push, in stack order so 's[n - 1]' becomes
+ * the top of the stack
+ * @param n, number of cells to push
+ * @return zero on success, negative on failure, in which case nothing is
+ * pushed */
+int embed_pushn(embed_t *h, const cell_t *s, const size_t n);
+
+/**@brief Get read-only access to the variable stack without copying it,
+ * this is only possible if the default MMU callbacks are in use. The top
+ * of the stack is held in a register and not with the rest of the stack, so
+ * it is returned separately. The pointer is invalidated by anything that
+ * changes the stack.
+ * @param h,     initialized Virtual Machine
+ * @param tos,   the top of the stack is written here
+ * @param depth, the stack depth is written here, the array returned is one
+ * cell shorter than this as it does not include the top of the stack
+ * @return pointer to the stack with the deepest cell first, or NULL if the
+ * MMU is not the default one or the stack is empty */
+const cell_t *embed_stack_window(embed_t *h, cell_t *tos, size_t *depth);
+
 /**@brief Return the current variable stack depth
  * @param h, initialized Virtual Machine
  * @return The current stack depth in cells */
 size_t embed_depth(embed_t *h);
 
+#define EMBED_PRIMITIVE_CELLS (8) /**< maximum number of cells a primitive can consume or produce */
+
+/**@brief Function pointer typedef for native primitives, functions written
+ * in C that can be called from Forth. The arguments are popped off the
+ * stack before the call and the results pushed afterwards, both in bulk.
+ * @param h,     initialized Virtual Machine image
+ * @param param, 'param' from the 'embed_primitives_t' the primitive is in
+ * @param s,     on entry, the arguments in stack order with the top of the
+ * stack last, on exit the results in the same order. It is large enough to
+ * hold whichever of the two is larger.
+ * @return zero on success, a number to throw on failure */
+typedef int (*embed_native_t)(embed_t *h, void *param, cell_t *s);
+
+typedef struct {
+	const char *name;   /**< name of Forth word to bind to, may be NULL */
+	embed_native_t fn;  /**< function implementing the primitive */
+	uint8_t in, out;    /**< stack effect, cells consumed and produced */
+} embed_primitive_t; /**< A native primitive and its stack effect */
+
+/* On the AVR the table of primitives, and any names in it, must be in
+ * program memory, 'PROGMEM', so they take up no SRAM. */
+typedef struct {
+	const embed_primitive_t *primitives; /**< table of primitives */
+	size_t length;                       /**< number of entries in 'primitives' */
+	void *param;                         /**< passed to each primitive */
+} embed_primitives_t; /**< A registry of native primitives */
+
+/**@brief 'embed_callback_t' that dispatches to a registry of primitives, set
+ * the callback to this and its parameter to a 'embed_primitives_t'. It pops
+ * the number of the primitive to call, its position in the table, then calls
+ * it with its arguments. This is what 'vm' calls in the image.
+ * @param h,     initialized Virtual Machine image
+ * @param param, pointer to 'embed_primitives_t'
+ * @return zero on success, a number to throw on failure */
+int embed_primitives_cb(embed_t *h, void *param);
+
+/**@brief Define a Forth word for each named primitive in 'p', which calls
+ * it. Each definition takes up dictionary space, leave names NULL and use
+ * 'n vm' to call primitive 'n' if space is tight. The search order is left
+ * as it was.
+ * @param h, initialized Virtual Machine image
+ * @param p, registry of primitives
+ * @return zero on success, negative on failure */
+int embed_primitives_bind(embed_t *h, const embed_primitives_t *p);
+
+#define EMBED_TASK_CELLS (8) /**< cells in a task control block */
+
+/**@brief Tasks are run round robin, each giving up the virtual machine to
+ * the next by calling 'pause'. A task is its registers and its two stacks,
+ * all of which live in the core, so switching tasks is only a matter of
+ * saving four registers and loading another four. Each task has a control
+ * block of 'EMBED_TASK_CELLS' cells in the core, holding a link to the
+ * next task in the ring followed by the saved registers, the bottom of its
+ * variable stack, the limit that stack must stay below and the limit its
+ * return stack must stay above. The stacks are not checked on each
+ * instruction, a task that has gone past either limit is found when it next
+ * gives up the virtual machine, which fails with -3 (stack overflow) and
+ * leaves it running, so what it overwrote is already lost. */
+typedef struct {
+	cell_t current; /**< cell address of the control block of the running task */
+} embed_tasks_t;
+
+/**@brief Make the running task the only one in the ring of tasks.
+ * @param h,   initialized Virtual Machine image
+ * @param t,   tasks to initialize
+ * @param tcb, cell address of the control block for the running task
+ * @param limit, cell address its variable stack must stay below
+ * @param rlimit, cell address its return stack must stay above
+ * @return zero on success, negative on failure */
+int embed_task_init(embed_t *h, embed_tasks_t *t, cell_t tcb, cell_t limit, cell_t rlimit);
+
+/**@brief Add a task to the ring, after the running task, or restart it if
+ * it is already in the ring. A task must not return from 'xt' or throw
+ * without catching it, as there is nothing for it to return to. The limit
+ * of any task whose variable stack could grow into the new one is lowered
+ * to 'sp0', and that of any whose return stack could is raised to 'rp0', it
+ * fails with -3 if one already has.
+ * @param h,   initialized Virtual Machine image
+ * @param t,   tasks set up by 'embed_task_init'
+ * @param tcb, cell address of the control block for the task, this cannot
+ * be the running task
+ * @param xt,  execution token of the word the task runs
+ * @param sp0, cell address of the bottom of its variable stack, which grows
+ * upwards
+ * @param rp0, cell address of the top of its return stack, which grows
+ * downwards
+ * @param limit, cell address its variable stack must stay below
+ * @param rlimit, cell address its return stack must stay above, below 'rp0'
+ * @return zero on success, negative on failure */
+int embed_task_spawn(embed_t *h, embed_tasks_t *t, cell_t tcb, cell_t xt, cell_t sp0, cell_t rp0, cell_t limit, cell_t rlimit);
+
+/**@brief Switch to the next task whilst the virtual machine is stopped, in
+ * a state that 'embed_vm' can carry on from, such as when it has returned
+ * as there is no input. The next call to 'embed_vm' runs the next task.
+ * This is how the console's 'key' pauses, as the image cannot be changed
+ * to call 'pause' itself.
+ * @param h, initialized Virtual Machine image
+ * @param t, tasks set up by 'embed_task_init'
+ * @return zero on success, -3 if the running task has gone past the limit
+ * of either of its stacks, negative on other failures */
+int embed_task_switch(embed_t *h, embed_tasks_t *t);
+
+/**@brief 'embed_native_t' primitive that switches to the next task, this is
+ * 'pause'. It takes and returns nothing, and 'param' of the registry it is
+ * in must point to the 'embed_tasks_t' to use. The task calling it carries
+ * on from the call when it is next switched to.
+ * @param h,     initialized Virtual Machine image
+ * @param param, pointer to 'embed_tasks_t'
+ * @param s,     unused
+ * @return zero on success, a number to throw on failure */
+int embed_pause_cb(embed_t *h, void *param, cell_t *s);
+
 /**@brief Retrieve a copy of some sensible default options, the default options
  * contain callbacks and file handles that will read data from standard in,
  * write data to standard out and save to disk. You can modify the returned
@@ -262,14 +443,90 @@ cell_t *embed_core_get(embed_t *h);
  * @return zero on success, negative on failure */
 int embed_eval(embed_t *h, const char *str);
 
+#define EMBED_CACHE_SOURCE (80) /**< longest string cached, with its terminator */
+
+typedef struct {
+	char source[EMBED_CACHE_SOURCE]; /**< copy of the string the definition was compiled from, empty if unused */
+	size_t hash;                     /**< of 'source' */
+	cell_t xt;                       /**< execution token of the definition, zero if it would not compile */
+} embed_cache_entry_t; /**< An entry in an 'embed_cache_t' */
+
+/**@brief A cache of strings compiled into anonymous definitions by
+ * 'embed_eval_cached'. It is emptied when the dictionary pointer moves, as
+ * that means the dictionary has changed, and should be zeroed before
+ * 'entries' and 'size' are set. */
+typedef struct {
+	embed_cache_entry_t *entries; /**< table of cached definitions */
+	size_t size;                  /**< number of entries, must be a power of two */
+	cell_t here;                  /**< dictionary pointer after the last definition cached */
+	cell_t cp;                    /**< address of the dictionary pointer, found on first use */
+	cell_t catch_xt;              /**< execution token of 'catch', found on first use */
+} embed_cache_t;
+
+/**@brief Execute the word 'xt' under 'catch', with the data stack as
+ * 'embed_eval' would leave it. It must be called when the virtual machine
+ * is waiting for input, as it is after 'embed_eval' returns. Unlike
+ * 'embed_eval' nothing is printed if 'xt' throws.
+ * @param h,  initialized virtual machine
+ * @param c,  cache, used for the location of 'catch'
+ * @param xt, execution token of word to run
+ * @return zero on success, negative on failure or the negated number thrown */
+int embed_execute(embed_t *h, embed_cache_t *c, cell_t xt);
+
+/**@brief Evaluate a string like 'embed_eval', but compile it into an
+ * anonymous definition after it is first evaluated and execute that
+ * afterwards, which skips parsing it and looking up its words. A copy of
+ * the string is kept, so the caller's may change or go away, and it must
+ * behave the same compiled as interpreted: it should not use words that
+ * parse, such as ' or .(, or that act at compile time. Strings that move
+ * the dictionary pointer, such as those that define words, those that do
+ * not compile, and those too long to copy into 'EMBED_CACHE_SOURCE' bytes
+ * are evaluated each time instead.
+ * @param h,   an initialized virtual machine
+ * @param c,   cache to use
+ * @param str, string to evaluate
+ * @return zero on success, negative on failure */
+int embed_eval_cached(embed_t *h, embed_cache_t *c, const char *str);
+
+/**@brief Replace the Forth dictionary search routine with the native one
+ * (ALU operation 30), which is much faster, and faster still if an index is
+ * set in the options.
+ * @param h,  initialized Virtual Machine image, the search routine must be
+ * in writable memory
+ * @param xt, execution token of 'search-wordlist', the first instruction of
+ * which must be a call or branch to the routine to replace
+ * @return zero on success, negative on failure */
+int embed_find_install(embed_t *h, cell_t xt);
+
+typedef enum {
+	EMBED_BLOCK_MOVE,    /**< ( a1 a2 u -- ), as 'cmove' */
+	EMBED_BLOCK_FILL,    /**< ( a u c -- ), as 'fill' */
+	EMBED_BLOCK_COMPARE, /**< ( a1 u1 a2 u2 -- n ), as 'compare' */
+} embed_block_e; /**< Block memory operations, selected by the top of the stack for ALU operation 31 */
+
+/**@brief Replace the word 'xt' with a native block memory operation (ALU
+ * operation 31), which works on a whole range of bytes at once.
+ * @param h,  initialized Virtual Machine image, 'xt' must be in writable
+ * memory and at least two cells long
+ * @param xt, execution token of the word to replace, such as 'cmove'
+ * @param op, operation to replace it with, it should have the same stack
+ * effect as the word replaced
+ * @return zero on success, negative on failure */
+int embed_block_install(embed_t *h, cell_t xt, embed_block_e op);
+
 /**@note This is header shouldn't really be included here, but it needs to be
- * (at least for now) */
+ * (at least for now). Off the AVR it defines nothing but 'EMBED_PROGMEM' */
+#ifdef __AVR__
 #include <avr/pgmspace.h>
+#define EMBED_PROGMEM PROGMEM
+#else
+#define EMBED_PROGMEM
+#endif
 
 /**@brief This array contains the default virtual machine image, generated from
  * 'embed-1.blk', which is included in the library. It contains a fully working
  * eForth image */
-extern PROGMEM const uint8_t embed_default_block[];
+extern EMBED_PROGMEM const uint8_t embed_default_block[];
 
 /**@brief This is size, in bytes, of 'embed_default_block' */
 extern const size_t embed_default_block_size;
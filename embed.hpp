@@ -0,0 +1,206 @@
+/**@file      embed.hpp
+ * @brief     C++20 coroutine wrapper for the Embed Forth Virtual Machine
+ * @copyright Richard James Howe (2017,2018)
+ * @license   MIT
+ *
+ * An 'embed::session' owns a virtual machine and its core, and runs it as a
+ * coroutine. Calling 'resume()' runs the virtual machine until it runs out of
+ * input, produces more output than the watermark, or uses up its time slice,
+ * it then suspends and returns why it did so. None of the state of the
+ * virtual machine is lost by suspending, it carries on from where it left
+ * off when resumed, so a single host thread can run many interactive
+ * sessions by resuming whichever one has work to do, see 'sessions.cpp' and
+ * 'server.cpp'. This needs a hosted C++20 compiler, it is not meant for the
+ * Arduino. */
+#ifndef EMBED_HPP
+#define EMBED_HPP
+
+#include "embed.h"
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace embed {
+
+enum class status {
+	input,  /**< suspended waiting for input, 'feed' the session some */
+	output, /**< suspended as output reached the watermark, drain 'output()' */
+	slice,  /**< suspended as its time slice was used up */
+	halted, /**< the virtual machine has stopped, see 'result()' */
+};
+
+class session {
+public:
+	using clock = std::chrono::steady_clock;
+
+	/**@param watermark, bytes of output to buffer before suspending
+	 * @param slice,     time to run for before suspending */
+	explicit session(size_t watermark = 256, clock::duration slice = std::chrono::milliseconds(1)) :
+		core(EMBED_CORE_SIZE), watermark(watermark), slice(slice) {
+		h.m = core.data();
+		if (embed_default(&h) < 0)
+			result_ = -1, halted = true;
+		start();
+	}
+
+	/**@brief As above, but run the image already loaded into 'image',
+	 * which must be 'EMBED_CORE_SIZE' cells long and outlive the session.
+	 * This lets the caller decide where the core lives, for example in a
+	 * copy-on-write mapping of an image shared with other sessions. */
+	session(cell_t *image, size_t watermark = 256, clock::duration slice = std::chrono::milliseconds(1)) :
+		watermark(watermark), slice(slice) {
+		h.m = image;
+		h.o = embed_opt_default();
+		start();
+	}
+	session(const session&) = delete;
+	session &operator=(const session&) = delete;
+	~session() { task.handle.destroy(); }
+
+	/**@brief Run the virtual machine until it has to suspend
+	 * @return why it suspended */
+	status resume() {
+		if (!task.handle.done())
+			task.handle.resume();
+		return task.handle.done() ? status::halted : reason;
+	}
+
+	/**@brief Queue input for the virtual machine, a session waiting on
+	 * input will continue on the next 'resume()' */
+	void feed(std::string_view s) {
+		if (position == in.size())
+			in.clear(), position = 0;
+		in.append(s);
+	}
+
+	/**@brief Signal that no more input will be fed, the virtual machine
+	 * reads EOF once the queued input is consumed */
+	void close() { closed = true; }
+
+	/**@brief Bytes fed that the virtual machine has not read yet */
+	size_t pending() const { return in.size() - position; }
+
+	/**@brief Limit the number of instructions run on each 'resume()', the
+	 * session suspends with 'status::slice' when it has used them up
+	 * @param instructions, instructions to run, zero for no limit */
+	void budget(unsigned long instructions) { budget_ = instructions; }
+
+	/**@brief Output produced so far, the caller should clear it once it
+	 * has been dealt with */
+	std::string &output() { return out; }
+
+	/**@brief Value returned by the virtual machine, valid once halted */
+	int result() const { return result_; }
+
+	/**@brief The virtual machine, so its options and core can be changed */
+	embed_t *vm() { return &h; }
+
+private:
+	void start() {
+		h.o.get    = get_cb, h.o.in  = this;
+		h.o.put    = put_cb, h.o.out = this;
+		h.o.yield  = yield_cb, h.o.yields = this;
+		task = run();
+	}
+
+	struct task_t {
+		struct promise_type {
+			task_t get_return_object() { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			std::suspend_always final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() { std::terminate(); }
+		};
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	/* Awaits the input source, it is only suspended on if there is
+	 * nothing to read from it */
+	struct readable {
+		session &s;
+		bool await_ready() const noexcept { return s.closed || s.position < s.in.size(); }
+		void await_suspend(std::coroutine_handle<>) noexcept { s.reason = status::input; }
+		void await_resume() const noexcept {}
+	};
+
+	/* Suspends unconditionally, for a time slice or an output watermark */
+	struct yielding {
+		session &s;
+		status why;
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<>) noexcept { s.reason = why; }
+		void await_resume() const noexcept {}
+	};
+
+	/* 'embed_vm' returns when the image sees no input is available (it
+	 * returns one when 'get' sets 'no_data') or the yield callback tells it
+	 * to, its state is saved in the core so it can be called again to
+	 * carry on. Anything else ends the session. */
+	task_t run() {
+		while (!halted) {
+			starved = false, cause = status::halted;
+			deadline = clock::now() + slice, countdown = CHECK_EVERY, remaining = budget_;
+			const int r = embed_vm(&h);
+			if (starved)
+				co_await readable{ *this };
+			else if (cause != status::halted)
+				co_await yielding{ *this, cause };
+			else
+				result_ = r, halted = true;
+		}
+	}
+
+	static int get_cb(void *file, int *no_data) {
+		session &s = *static_cast<session*>(file);
+		if (s.position < s.in.size()) {
+			*no_data = 0;
+			return (unsigned char)s.in[s.position++];
+		}
+		*no_data = s.closed ? 0 : -1;
+		s.starved = !s.closed;
+		return -1;
+	}
+
+	static int put_cb(int ch, void *file) {
+		static_cast<session*>(file)->out.push_back((char)ch);
+		return ch;
+	}
+
+	/* Called once per instruction, so the clock is only looked at once in
+	 * a while */
+	static int yield_cb(void *param) {
+		session &s = *static_cast<session*>(param);
+		if (s.out.size() >= s.watermark)
+			return s.cause = status::output, 1;
+		if (s.budget_ && !--s.remaining)
+			return s.cause = status::slice, 1;
+		if (--s.countdown)
+			return 0;
+		s.countdown = CHECK_EVERY;
+		if (clock::now() >= s.deadline)
+			return s.cause = status::slice, 1;
+		return 0;
+	}
+
+	static constexpr unsigned CHECK_EVERY = 1024; /**< instructions between looking at the clock */
+
+	embed_t h {};
+	std::vector<cell_t> core;
+	std::string in, out;
+	size_t position = 0, watermark;
+	clock::duration slice;
+	clock::time_point deadline;
+	unsigned countdown = CHECK_EVERY;
+	unsigned long budget_ = 0, remaining = 0;
+	status reason = status::slice, cause = status::halted;
+	bool starved = false, closed = false, halted = false;
+	int result_ = 0;
+	task_t task;
+};
+
+} /* namespace embed */
+
+#endif
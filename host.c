@@ -0,0 +1,744 @@
+/**@file host.c
+ * @brief Hosted driver for the eForth virtual machine
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * This runs the same virtual machine and image as the Arduino does, but on
+ * the build machine, so changes to either can be tested and benchmarked
+ * without any hardware attached. Build with 'make host'.
+ *
+ * Usage: host [-m] [-n] [-i] [-r] [-b] [-s] [-t trace] [file...]
+ *
+ * -m  use the masked virtual machine
+ * -n  use the native dictionary search and block memory operations
+ * -i  as '-n', with a hash index for the dictionary search
+ * -r  report how memory was used to stderr on exit, or after '-s', ignoring
+ *     '-m' as the masked virtual machine does not use the memory callbacks
+ * -b  run the benchmarks and exit
+ * -s  print the output of the benchmark script and exit, so the output of
+ *     different images can be compared
+ * -t  write the memory accesses made running a short script to 'trace' and
+ *     exit, for 'cachesim' to replay
+ *
+ * Files are evaluated in order, then input is read from stdin. */
+#include "embed.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define INDEX_SIZE (512u) /**< entries in the dictionary hash index */
+#define PAGE_SIZE  (128u) /**< cells in a page, as in 'test.cpp' */
+#define PAGES      (EMBED_CORE_SIZE / PAGE_SIZE)
+#define CP         (44)   /**< cell holding the dictionary pointer, a byte address */
+#define STACK_SPAN (4096u) /**< cells either stack is expected to stay within */
+#define EEPROM_WRITES (16u) /**< writes to a page few enough for EEPROM to back it */
+#define RAM_PAGES_328P (5u)  /**< pages of RAM 'test.cpp' fits in an ATmega328P */
+#define RAM_PAGES_2560 (24u) /**< 8KB of SRAM, less about 2KB for everything else */
+
+static cell_t core[EMBED_GUARDED_SIZE]; /* large enough for the masked virtual machine */
+static cell_t index_table[INDEX_SIZE * EMBED_INDEX_ENTRY];
+static embed_index_t index_dictionary;
+
+static int file_getc_cb(void *file, int *no_data) {
+	assert(file && no_data);
+	*no_data = 0;
+	return fgetc((FILE*)file);
+}
+
+static int file_putc_cb(int ch, void *file) {
+	assert(file);
+	return fputc(ch, (FILE*)file);
+}
+
+/* Output written during a benchmark is reduced to a checksum, so runs with
+ * different virtual machine options can be checked against each other */
+static int sum_putc_cb(int ch, void *file) {
+	unsigned long *sum = (unsigned long*)file;
+	assert(sum);
+	*sum = (*sum * 31uL) + (unsigned char)ch;
+	return ch;
+}
+
+static double seconds(void) {
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+typedef enum {
+	NATIVE_SEARCH_E = 1u << 0, /**< ALU operation 30, dictionary search */
+	NATIVE_INDEX_E  = 1u << 1, /**< hash index for the dictionary search */
+	NATIVE_BLOCK_E  = 1u << 2, /**< ALU operation 31, block memory operations */
+} native_e;
+
+static int native_install(embed_t *h, const unsigned native) {
+	assert(h);
+	cell_t xt[4] = { 0 };
+	if (embed_eval(h, "' search-wordlist ' cmove ' fill ' compare\n") < 0 || embed_popn(h, xt, 4) < 0)
+		return -1;
+	if (native & NATIVE_SEARCH_E)
+		if (embed_find_install(h, xt[0]) < 0)
+			return -1;
+	if (native & NATIVE_INDEX_E) {
+		memset(&index_dictionary, 0, sizeof index_dictionary);
+		index_dictionary.table = index_table;
+		index_dictionary.size  = INDEX_SIZE;
+		h->o.index = &index_dictionary;
+	}
+	if (native & NATIVE_BLOCK_E)
+		if (embed_block_install(h, xt[1], EMBED_BLOCK_MOVE) < 0 ||
+			embed_block_install(h, xt[2], EMBED_BLOCK_FILL) < 0 ||
+			embed_block_install(h, xt[3], EMBED_BLOCK_COMPARE) < 0)
+			return -1;
+	return 0;
+}
+
+static int setup(embed_t *h, const unsigned native) {
+	assert(h);
+	memset(h, 0, sizeof *h);
+	h->m = core;
+	if (embed_default(h) < 0)
+		return -1;
+	return native ? native_install(h, native) : 0;
+}
+
+/* An MMU that is not flat, but behaves the same, like that of the Arduino */
+static cell_t read_cb(embed_t const * const h, cell_t addr) { return ((cell_t*)h->m)[addr]; }
+static void write_cb(embed_t * const h, cell_t addr, cell_t value) { ((cell_t*)h->m)[addr] = value; }
+
+/* Count memory accesses and instructions executed, the yield callback is
+ * called once per instruction */
+static unsigned long reads, writes, instructions;
+static cell_t count_read_cb(embed_t const * const h, cell_t addr) { reads++; return ((cell_t*)h->m)[addr]; }
+static void count_write_cb(embed_t * const h, cell_t addr, cell_t value) { writes++; ((cell_t*)h->m)[addr] = value; }
+static int count_yield_cb(void *param) { (void)param; instructions++; return 0; }
+
+/* Generate a script, each line of which is less than 80 characters, that
+ * defines many words and looks up a mixture of new and built in words. */
+static char *bench_script(const unsigned definitions) {
+	const size_t line = 80, lines = (definitions * 4) + 1;
+	char *s = calloc(lines, line), *p = s;
+	if (!s)
+		return NULL;
+	p += sprintf(p, ": w0 1 ;\n");
+	for (unsigned i = 1; i < definitions; i++) {
+		p += sprintf(p, ": w%u w%u dup + 1+ ;\n", i, i - 1);
+		p += sprintf(p, "w%u w%u over swap - abs drop drop\n", i, i / 2);
+		p += sprintf(p, "1 2 3 rot rot swap over + + + drop here drop\n");
+		p += sprintf(p, "base @ hex decimal base ! w%u . cr\n", i);
+	}
+	return s;
+}
+
+static int bench_load(const unsigned definitions) {
+	static const char *names[] = { "forth search", "native search", "hashed search" };
+	char *script = bench_script(definitions);
+	if (!script)
+		return -1;
+	unsigned long sums[3] = { 0 };
+	static const unsigned natives[] = { 0, NATIVE_SEARCH_E, NATIVE_SEARCH_E | NATIVE_INDEX_E };
+	for (size_t i = 0; i < 3; i++) {
+		embed_t h;
+		if (setup(&h, natives[i]) < 0)
+			goto fail;
+		h.o.put = sum_putc_cb;
+		h.o.out = &sums[i];
+		const double start = seconds();
+		if (embed_eval(&h, script) < 0)
+			goto fail;
+		printf("load %u definitions, %-14s %8.3f s\n", definitions, names[i], seconds() - start);
+	}
+	free(script);
+	if (sums[0] != sums[1] || sums[0] != sums[2]) {
+		fprintf(stderr, "benchmark output differs\n");
+		return -1;
+	}
+	return 0;
+fail:
+	free(script);
+	fprintf(stderr, "benchmark failed\n");
+	return -1;
+}
+
+static int nop_cb(embed_t *h, void *param, cell_t *s) {
+	(void)h; (void)param; (void)s;
+	return 0;
+}
+
+static int sum_cb(embed_t *h, void *param, cell_t *s) {
+	(void)h; (void)param;
+	s[0] = s[0] + s[1] + s[2];
+	return 0;
+}
+
+static const embed_primitive_t primitives[] = {
+	{ "p0", nop_cb, 0, 0 },
+	{ "p3", sum_cb, 3, 1 },
+};
+
+static const embed_primitives_t registry = {
+	primitives, sizeof(primitives) / sizeof(primitives[0]), NULL
+};
+
+/* The way callbacks were written before the registry existed */
+static int switch_cb(embed_t *h, void *param) {
+	(void)param;
+	cell_t op = 0, a = 0, b = 0, c = 0;
+	int r = embed_pop(h, &op);
+	if (r)
+		return r;
+	switch (op) {
+	case 0: break;
+	case 1:
+		if ((r = embed_pop(h, &c)) || (r = embed_pop(h, &b)) || (r = embed_pop(h, &a)))
+			return r;
+		return embed_push(h, a + b + c);
+	default: return 21;
+	}
+	return 0;
+}
+
+static int bench_call(void) {
+	static const struct { const char *name, *loop; int registry; } loops[] = {
+		{ "empty loop",                   "",                1 },
+		{ "registry, no arguments",       "0 vm",            1 },
+		{ "registry, three arguments",    "1 2 3 1 vm drop", 1 },
+		{ "registry, bound word",         "p0",              1 },
+		{ "switch, no arguments",         "0 vm",            0 },
+		{ "switch, three arguments",      "1 2 3 1 vm drop", 0 },
+		{ "forth, three arguments",       "1 2 3 + + drop",  1 },
+	};
+	const unsigned long calls = 100uL * 10000uL;
+	for (size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+		char line[80];
+		double best = 0;
+		embed_t h;
+		if (setup(&h, 0) < 0)
+			return -1;
+		h.o.callback = embed_primitives_cb;
+		h.o.param    = (void*)&registry;
+		if (embed_primitives_bind(&h, &registry) < 0)
+			return -1;
+		if (!loops[i].registry)
+			h.o.callback = switch_cb;
+		snprintf(line, sizeof line, "system +order : b 99 for 9999 for %s next next ;\n", loops[i].loop);
+		if (embed_eval(&h, line) < 0)
+			return -1;
+		for (int j = 0; j < 3; j++) {
+			const double start = seconds();
+			if (embed_eval(&h, "b\n") < 0 || embed_depth(&h) != 0)
+				return -1;
+			const double taken = seconds() - start;
+			best = (j == 0 || taken < best) ? taken : best;
+		}
+		printf("call %-28s %8.1f ns\n", loops[i].name, (best * 1e9) / calls);
+	}
+	return 0;
+}
+
+static int bench_stack(void) {
+	const unsigned long transfers = 10000000uL;
+	for (int flat = 1; flat >= 0; flat--) {
+		embed_t h;
+		cell_t s[3] = { 1, 2, 3 };
+		double start = 0, single = 0, bulk = 0;
+		if (setup(&h, 0) < 0)
+			return -1;
+		if (!flat)
+			h.o.read = read_cb, h.o.write = write_cb;
+		start = seconds();
+		for (unsigned long i = 0; i < transfers; i++)
+			if (embed_push(&h, s[0]) || embed_push(&h, s[1]) || embed_push(&h, s[2]) ||
+				embed_pop(&h, &s[2]) || embed_pop(&h, &s[1]) || embed_pop(&h, &s[0]))
+				return -1;
+		single = seconds() - start;
+		start = seconds();
+		for (unsigned long i = 0; i < transfers; i++)
+			if (embed_pushn(&h, s, 3) || embed_popn(&h, s, 3))
+				return -1;
+		bulk = seconds() - start;
+		printf("stack, %-9s 3 pushes and pops %6.1f ns, pushn and popn %6.1f ns\n",
+				flat ? "flat MMU" : "MMU", (single * 1e9) / transfers, (bulk * 1e9) / transfers);
+	}
+	return 0;
+}
+
+static int bench_block(void) {
+	static const char *check =
+		"create b1 64 allot create b2 64 allot\n"
+		": p 63 for r@ 60 + b1 r@ + c! next ; p b2 64 char b fill\n"
+		"b1 64 type cr b1 10 + 7 char z fill\n"
+		"b1 b1 3 + 20 cmove b1 64 type cr\n"
+		"b1 5 + b1 1+ 30 cmove b1 64 type cr\n"
+		"b1 3 + b2 7 + 11 cmove b2 64 type cr\n"
+		"b1 64 b2 64 compare . b2 64 b1 64 compare . b1 5 b1 6 compare . cr\n"
+		"b2 1+ 5 b2 1+ 5 compare . b1 2 + 9 b2 9 + 9 compare . cr\n";
+	static const char *setup_buffers =
+		"create c1 1024 allot create c2 1024 allot c1 1024 0 fill c2 1024 0 fill\n"
+		": m 999 for c1 c2 1024 cmove next ;\n"
+		": c 999 for c1 1024 c2 1024 compare drop next ;\n";
+	static const struct { const char *name; unsigned native; int flat; } runs[] = {
+		{ "forth",            0,              1 },
+		{ "native, flat MMU", NATIVE_BLOCK_E, 1 },
+		{ "native, MMU",      NATIVE_BLOCK_E, 0 },
+	};
+	const double megabytes = (1000.0 * 1024.0) / (1024.0 * 1024.0);
+	unsigned long sums[3] = { 0 };
+	for (size_t i = 0; i < 3; i++) {
+		double start = 0, move = 0, compare = 0;
+		embed_t h;
+		if (setup(&h, runs[i].native) < 0)
+			return -1;
+		if (!runs[i].flat)
+			h.o.read = read_cb, h.o.write = write_cb;
+		h.o.put = sum_putc_cb;
+		h.o.out = &sums[i];
+		if (embed_eval(&h, check) < 0 || embed_eval(&h, setup_buffers) < 0)
+			return -1;
+		start = seconds();
+		if (embed_eval(&h, "m\n") < 0)
+			return -1;
+		move = seconds() - start;
+		start = seconds();
+		if (embed_eval(&h, "c\n") < 0 || embed_depth(&h) != 0)
+			return -1;
+		compare = seconds() - start;
+		printf("block, 1KB, %-18s cmove %8.2f MB/s, compare %8.2f MB/s\n",
+				runs[i].name, megabytes / move, megabytes / compare);
+	}
+	if (sums[0] != sums[1] || sums[0] != sums[2]) {
+		fprintf(stderr, "block operation output differs\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int bench_masked(void) {
+	static const char *loop = ": b 99 for 9999 for 1 2 + 3 and dup if drop then next next ;\n";
+	static const char *names[] = { "checked", "masked" };
+	char *script = bench_script(100);
+	if (!script)
+		return -1;
+	unsigned long sums[2] = { 0 };
+	for (int masked = 0; masked < 2; masked++) {
+		double best = 0;
+		embed_t h;
+		if (setup(&h, 0) < 0)
+			goto fail;
+		h.o.masked = masked;
+		h.o.put = sum_putc_cb;
+		h.o.out = &sums[masked];
+		if (embed_eval(&h, script) < 0 || embed_eval(&h, loop) < 0)
+			goto fail;
+		for (int j = 0; j < 3; j++) {
+			const double start = seconds();
+			if (embed_eval(&h, "b\n") < 0 || embed_depth(&h) != 0)
+				goto fail;
+			const double taken = seconds() - start;
+			best = (j == 0 || taken < best) ? taken : best;
+		}
+		/* running off the end of the return stack is a critical error */
+		if (embed_eval(&h, ": u r> drop r> drop r> drop r> drop r> drop r> drop ; u\n") >= 0)
+			goto fail;
+		printf("vm, %-8s %8.2f M loops/s\n", names[masked], 1.0 / best);
+	}
+	free(script);
+	if (sums[0] != sums[1]) {
+		fprintf(stderr, "masked virtual machine output differs\n");
+		return -1;
+	}
+	return 0;
+fail:
+	free(script);
+	fprintf(stderr, "benchmark failed\n");
+	return -1;
+}
+
+static int bench_access(void) {
+	static const char *names[] = { "load", "loop" };
+	char *script = bench_script(100);
+	if (!script)
+		return -1;
+	for (int i = 0; i < 2; i++) {
+		embed_t h;
+		if (setup(&h, 0) < 0)
+			goto fail;
+		if (i && embed_eval(&h, ": b 99 for 999 for 1 2 + 3 and dup if drop then next next ;\n") < 0)
+			goto fail;
+		h.o.read  = count_read_cb, h.o.write = count_write_cb;
+		h.o.yield = count_yield_cb;
+		reads = writes = instructions = 0;
+		if (embed_eval(&h, i ? "b\n" : script) < 0)
+			goto fail;
+		/* instruction fetches are not counted, they cannot be avoided */
+		reads -= instructions;
+		printf("access, %s, %9lu instructions, %5.3f reads %5.3f writes per instruction\n",
+				names[i], instructions, (double)reads / instructions, (double)writes / instructions);
+	}
+	free(script);
+	return 0;
+fail:
+	free(script);
+	fprintf(stderr, "benchmark failed\n");
+	return -1;
+}
+
+static int bench_eval(void) {
+	static const char *commands[] = {
+		"1 2 + drop\n",
+		"base @ hex decimal base ! 1 2 3 rot rot swap over + + + drop\n",
+	};
+	static embed_cache_entry_t entries[8];
+	const unsigned long calls = 2000uL;
+	for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		double plain = 0, cached = 0;
+		embed_cache_t cache = { .entries = entries, .size = 8 };
+		embed_t h;
+		memset(entries, 0, sizeof entries);
+		if (setup(&h, 0) < 0)
+			return -1;
+		double start = seconds();
+		for (unsigned long j = 0; j < calls; j++)
+			if (embed_eval(&h, commands[i]) < 0)
+				return -1;
+		plain = seconds() - start;
+		start = seconds();
+		for (unsigned long j = 0; j < calls; j++)
+			if (embed_eval_cached(&h, &cache, commands[i]) < 0)
+				return -1;
+		cached = seconds() - start;
+		if (embed_depth(&h) != 0)
+			return -1;
+		printf("eval, %2u words, embed_eval %7.2f us, embed_eval_cached %7.2f us\n",
+				i ? 16u : 4u, (plain * 1e6) / calls, (cached * 1e6) / calls);
+	}
+	return 0;
+}
+
+static embed_tasks_t tasks;
+
+static const embed_primitive_t task_primitives[] = {
+	{ "pause", embed_pause_cb, 0, 0 },
+};
+
+static const embed_primitives_t task_registry = {
+	task_primitives, sizeof(task_primitives) / sizeof(task_primitives[0]), &tasks
+};
+
+/* The console task and a second task pass the virtual machine back and
+ * forth, the switch itself is done natively so the cost in instructions is
+ * that of calling 'pause' */
+static int bench_task(void) {
+	static const char *setup_tasks =
+		"system +order variable n create tcb 16 cells allot create stack 64 cells allot\n"
+		": w begin 1 n +! pause again ;\n"
+		": b 9999 for pause next ; : b0 9999 for next ;\n"
+		"' w tcb stack\n";
+	const unsigned long pauses = 10000uL;
+	unsigned long counted[2] = { 0 };
+	double taken[2] = { 0 };
+	cell_t a[3] = { 0 }, n = 0;
+	embed_t h;
+	if (setup(&h, 0) < 0)
+		return -1;
+	h.o.callback = embed_primitives_cb;
+	h.o.param    = (void*)&task_registry;
+	if (embed_primitives_bind(&h, &task_registry) < 0)
+		return -1;
+	if (embed_eval(&h, setup_tasks) < 0 || embed_popn(&h, a, 3) < 0)
+		return -1;
+	const cell_t tcb = a[1] >> 1, stack = a[2] >> 1;
+	if (embed_task_init(&h, &tasks, tcb, (cell_t)embed_cells(&h), 0) < 0)
+		return -1;
+	for (int i = 0; i < 2; i++) {
+		h.o.yield = count_yield_cb;
+		instructions = 0;
+		if (embed_eval(&h, "b0\n") < 0)
+			return -1;
+		counted[i] = instructions;
+		instructions = 0;
+		if (embed_eval(&h, "b\n") < 0)
+			return -1;
+		counted[i] = instructions - counted[i];
+		h.o.yield = embed_yield_cb;
+		const double start = seconds();
+		if (embed_eval(&h, "b\n") < 0)
+			return -1;
+		taken[i] = seconds() - start;
+		if (!i && embed_task_spawn(&h, &tasks, tcb + EMBED_TASK_CELLS, a[0], stack, stack + 63, stack + 32, stack + 31) < 0)
+			return -1;
+	}
+	if (embed_eval(&h, "n @\n") < 0 || embed_pop(&h, &n) < 0 || n != 2 * pauses || embed_depth(&h) != 0)
+		return -1;
+	printf("task, one task %5.1f ns, two tasks %5.1f ns per pause, %4.2f instructions per pause\n",
+			(taken[0] * 1e9) / pauses, (taken[1] * 1e9) / pauses, (double)counted[0] / pauses);
+	return 0;
+}
+
+static int bench(void) {
+	if (bench_load(300) < 0)
+		return -1;
+	if (bench_call() < 0)
+		return -1;
+	if (bench_stack() < 0)
+		return -1;
+	if (bench_block() < 0)
+		return -1;
+	if (bench_masked() < 0)
+		return -1;
+	if (bench_access() < 0)
+		return -1;
+	if (bench_eval() < 0)
+		return -1;
+	if (bench_task() < 0)
+		return -1;
+	return 0;
+}
+
+/* With '-r' every access is counted by the page it falls in, the first
+ * read after the yield callback being an instruction fetch, and the stack
+ * pointers and dictionary pointer are followed through what is written. The
+ * report says which pages need RAM, and which could be left in flash or
+ * EEPROM, for a workload, so the pages in 'test.cpp' can be sized to it. */
+typedef struct {
+	unsigned long reads, writes, executes;
+	cell_t low, high; /**< lowest and highest cells written */
+} page_use_t;
+
+static struct {
+	page_use_t pages[PAGES];
+	unsigned char written[EMBED_CORE_SIZE / CHAR_BIT];
+	unsigned long instructions;
+	cell_t image, sp0, rp0, sp_max, rp_min, cp0, cp_max;
+	int fetch;
+} use;
+
+static int report;
+
+static cell_t use_read_cb(embed_t const * const h, cell_t addr) {
+	page_use_t * const p = &use.pages[addr / PAGE_SIZE];
+	if (use.fetch)
+		p->executes++;
+	else
+		p->reads++;
+	use.fetch = 0;
+	return ((cell_t*)h->m)[addr];
+}
+
+static void use_write_cb(embed_t * const h, cell_t addr, cell_t value) {
+	page_use_t * const p = &use.pages[addr / PAGE_SIZE];
+	if (!p->writes++ || addr < p->low)
+		p->low = addr;
+	p->high = addr > p->high ? addr : p->high;
+	use.written[addr / CHAR_BIT] |= 1u << (addr % CHAR_BIT);
+	if (addr >= use.sp0 && (cell_t)(addr - use.sp0) < STACK_SPAN && addr > use.sp_max)
+		use.sp_max = addr;
+	if (addr <= use.rp0 && (cell_t)(use.rp0 - addr) < STACK_SPAN && addr < use.rp_min)
+		use.rp_min = addr;
+	if (addr == CP && value > use.cp_max)
+		use.cp_max = value;
+	((cell_t*)h->m)[addr] = value;
+}
+
+static int use_yield_cb(void *param) { (void)param; use.fetch = 1; use.instructions++; return 0; }
+
+static void use_instrument(embed_t *h) {
+	assert(h);
+	const cell_t *m = (cell_t*)h->m;
+	memset(&use, 0, sizeof use);
+	use.image  = embed_default_block_size / 2;
+	use.sp0    = use.sp_max = m[3];
+	use.rp0    = use.rp_min = m[2];
+	use.cp0    = use.cp_max = m[CP];
+	h->o.masked = 0;
+	h->o.read  = use_read_cb, h->o.write = use_write_cb;
+	h->o.yield = use_yield_cb;
+}
+
+static unsigned use_written(const unsigned page) {
+	unsigned n = 0;
+	for (unsigned i = page * PAGE_SIZE; i < (page + 1u) * PAGE_SIZE; i++)
+		n += (use.written[i / CHAR_BIT] >> (i % CHAR_BIT)) & 1u;
+	return n;
+}
+
+/* Written pages need RAM unless written so rarely that EEPROM would do,
+ * which it cannot for the image as it would be rewritten on every boot.
+ * Unwritten pages are left in flash if they are in the image, and otherwise
+ * need no memory at all, as they only ever read as zero. */
+static const char *use_backing(const unsigned page) {
+	const page_use_t * const p = &use.pages[page];
+	const int in_image = (page * PAGE_SIZE) < use.image;
+	if (p->writes)
+		return (!in_image && p->writes < EEPROM_WRITES) ? "eeprom" : "ram";
+	return in_image ? "flash" : "zero";
+}
+
+static void use_report(FILE *out) {
+	unsigned ram = 0, cells = 0;
+	fprintf(out, "\n%lu instructions, data stack %u cells deep, return stack %u cells deep\n",
+			use.instructions, (unsigned)(use.sp_max - use.sp0), (unsigned)(use.rp0 - use.rp_min));
+	fprintf(out, "dictionary grew by %u bytes, from %u to %u, image %u cells\n\n",
+			(unsigned)(use.cp_max - use.cp0), (unsigned)use.cp0, (unsigned)use.cp_max, (unsigned)use.image);
+	fprintf(out, "page  cells          reads     writes   executes  written  span       backing\n");
+	for (unsigned i = 0; i < PAGES; i++) {
+		const page_use_t * const p = &use.pages[i];
+		if (!p->reads && !p->writes && !p->executes)
+			continue;
+		const char *backing = use_backing(i);
+		const unsigned written = use_written(i);
+		char span[16] = "-";
+		if (p->writes)
+			snprintf(span, sizeof span, "%04x-%04x", (unsigned)p->low, (unsigned)p->high);
+		fprintf(out, "%4u  %04x-%04x %10lu %10lu %10lu %8u  %-9s  %s\n", i, i * PAGE_SIZE,
+				((i + 1u) * PAGE_SIZE) - 1u, p->reads, p->writes, p->executes, written, span, backing);
+		if (!strcmp(backing, "ram"))
+			ram++, cells += written;
+	}
+	fprintf(out, "\n%u pages need RAM, %u cells of them written\n", ram, cells);
+	fprintf(out, "ATmega328P, %u pages of RAM: %s\n", RAM_PAGES_328P, ram <= RAM_PAGES_328P ? "fits" : "does not fit");
+	fprintf(out, "ATmega2560, %u pages of RAM: %s\n", RAM_PAGES_2560, ram <= RAM_PAGES_2560 ? "fits" : "does not fit");
+}
+
+static const char *script_words =
+	": b 99 for 999 for 1 2 + 3 and dup if drop then next next ; b .s cr\n"
+	": s $\" hello\" count type .\"  world\" cr ; s\n"
+	": t throw ; 0 ' t catch . 5 ' t catch . .s cr\n"
+	"create b1 32 allot b1 32 char a fill b1 b1 3 + 9 cmove b1 32 type cr\n"
+	"b1 5 b1 1+ 5 compare . 12345 hex . decimal -7 abs . 7 3 /mod . . cr\n";
+
+static int script(const unsigned native, const int masked) {
+	embed_t h;
+	char *s = bench_script(300);
+	if (!s || setup(&h, native) < 0)
+		goto fail;
+	h.o.masked = masked;
+	h.o.put = file_putc_cb;
+	h.o.out = stdout;
+	if (report)
+		use_instrument(&h);
+	if (embed_eval(&h, s) < 0 || embed_eval(&h, script_words) < 0)
+		goto fail;
+	if (report)
+		use_report(stderr);
+	free(s);
+	return 0;
+fail:
+	free(s);
+	fprintf(stderr, "script failed\n");
+	return -1;
+}
+
+/* Each access is written as a byte giving its kind, 'x' for an instruction
+ * fetch, 'r' for a read and 'w' for a write, followed by the cell address,
+ * low byte first. The yield callback is called before each fetch, so the
+ * first read after it is the fetch. */
+static FILE *trace_file;
+static int trace_fetch;
+
+static void trace_access(const int kind, const cell_t addr) {
+	fputc(kind, trace_file);
+	fputc(addr & 0xFFu, trace_file);
+	fputc(addr >> 8, trace_file);
+}
+
+static cell_t trace_read_cb(embed_t const * const h, cell_t addr) {
+	trace_access(trace_fetch ? 'x' : 'r', addr);
+	trace_fetch = 0;
+	return ((cell_t*)h->m)[addr];
+}
+
+static void trace_write_cb(embed_t * const h, cell_t addr, cell_t value) {
+	trace_access('w', addr);
+	((cell_t*)h->m)[addr] = value;
+}
+
+static int trace_yield_cb(void *param) { (void)param; trace_fetch = 1; return 0; }
+
+/* The script is kept short enough for its definitions to fit in the
+ * dictionary space the Arduino has, so the trace is like its workload */
+static int trace(const char *name) {
+	unsigned long sum = 0;
+	embed_t h;
+	char *s = bench_script(10);
+	if (!s || setup(&h, 0) < 0)
+		goto fail;
+	if (!(trace_file = fopen(name, "wb"))) {
+		fprintf(stderr, "could not open '%s'\n", name);
+		goto fail;
+	}
+	h.o.put   = sum_putc_cb;
+	h.o.out   = &sum;
+	h.o.read  = trace_read_cb, h.o.write = trace_write_cb;
+	h.o.yield = trace_yield_cb;
+	if (embed_eval(&h, s) < 0 || embed_eval(&h, script_words) < 0)
+		goto fail;
+	free(s);
+	return fclose(trace_file) < 0 ? -1 : 0;
+fail:
+	free(s);
+	if (trace_file)
+		fclose(trace_file);
+	fprintf(stderr, "trace failed\n");
+	return -1;
+}
+
+static int eval_file(embed_t *h, FILE *file) {
+	assert(h && file);
+	h->o.get = file_getc_cb;
+	h->o.in  = file;
+	return embed_vm(h);
+}
+
+int main(int argc, char **argv) {
+	embed_t h;
+	unsigned native = 0;
+	int i = 1, r = 0, masked = 0;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-m")) {
+			masked = 1;
+		} else if (!strcmp(argv[i], "-n")) {
+			native = NATIVE_SEARCH_E | NATIVE_BLOCK_E;
+		} else if (!strcmp(argv[i], "-i")) {
+			native = NATIVE_SEARCH_E | NATIVE_BLOCK_E | NATIVE_INDEX_E;
+		} else if (!strcmp(argv[i], "-r")) {
+			report = 1;
+		} else if (!strcmp(argv[i], "-b")) {
+			return bench() < 0 ? 1 : 0;
+		} else if (!strcmp(argv[i], "-s")) {
+			return script(native, masked) < 0 ? 1 : 0;
+		} else if (!strcmp(argv[i], "-t") && (i + 1) < argc) {
+			return trace(argv[i + 1]) < 0 ? 1 : 0;
+		} else {
+			fprintf(stderr, "usage: %s [-m] [-n] [-i] [-r] [-b] [-s] [-t trace] [file...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (setup(&h, native) < 0) {
+		fprintf(stderr, "setup failed\n");
+		return 1;
+	}
+	h.o.masked = masked;
+	h.o.put = file_putc_cb;
+	h.o.out = stdout;
+	if (report)
+		use_instrument(&h);
+	for (; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (!file) {
+			fprintf(stderr, "could not open '%s'\n", argv[i]);
+			return 1;
+		}
+		h.o.options = EMBED_VM_QUITE_ON;
+		r = eval_file(&h, file);
+		fclose(file);
+		if (r < 0)
+			return 1;
+	}
+	h.o.options = 0;
+	r = eval_file(&h, stdin);
+	if (report)
+		use_report(stderr);
+	return r < 0 ? 1 : 0;
+}
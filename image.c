@@ -1,9 +1,7 @@
 /* eForth image */
-#include <stdint.h>
-#include <stddef.h>
-#include <avr/pgmspace.h>
+#include "embed.h"
 
-const PROGMEM uint8_t embed_default_block[] = {
+const EMBED_PROGMEM uint8_t embed_default_block[] = {
 20,0,0,0,255,127,0,36,77,3,0,128,0,0,20,0,0,0,255,127,0,36,137,70,84,
 72,13,10,26,10,38,21,237,86,1,0,132,25,0/* 1 = enable CRC check*/,0,72,9,141,98,28,96,141,98,28,99,
 222,16,28,21,0,0,3,112,97,100,23,64,0,65,54,0,4,99,101,108,108,0,23,64,2,0,
@@ -8,8 +8,6 @@
  * TODO:
  * - Using an LED as a light sensor
  * - Two way communication using an LED
- * - Change so this is non-blocking, a state-machine should
- *   control this.
  * - Add a PWM mode for emitting mode?
  *
  * This LED controller uses two I/O pins so an LED can be used
@@ -23,8 +21,17 @@
  * *Circuit might need changing (input impedance too high/or input
  * floating high/too sensitive to its surroundings).  */
 #include "led.h"
+#include "crc8.h"
 #include <assert.h>
+#include <string.h>
+#ifndef LED_TEST
 #include <Arduino.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define memcpy_P memcpy
+#endif
 
 /* Discharge in dark a takes about 16,000 us, in bright LED light,
  * about 2000 us, that is using the LEDs and resistors that I have,
@@ -33,42 +40,256 @@
  * light levels as opposed to communication. These values would also
  * benefit from calibration. */
 
-const led_sensor_t led_sensor_communications = {
+const led_sensor_t led_sensor_communications PROGMEM = {
 	.tx_mark_us   = 4000,
 	.tx_space_us  = 2000,
 	.tx_period_us = 5000,
 	.rx_charge_us = 200,
 	.rx_sample_us = 4800,
+	.rx_mark_us   = 2200,
+	.rx_dark_us   = 4400,
 };
 
-const led_sensor_t led_sensor_light_level = {
+const led_sensor_t led_sensor_light_level PROGMEM = {
 	.tx_mark_us   = 1000,
 	.tx_space_us  = 500,
 	.tx_period_us = 5000,
 	.rx_charge_us = 2000,
 	.rx_sample_us = 30000,
+	.rx_mark_us   = 0,
+	.rx_dark_us   = 30000,
 };
 
+enum { LED_READ_IDLE, LED_READ_CHARGE, LED_READ_DISCHARGE };
+
+#ifdef LED_TEST /* counts only the tests look at, there is no room for them on the target */
+#define LED_STAT(COUNT) ((COUNT)++)
+#else
+#define LED_STAT(COUNT) ((void)0)
+#endif
+
+/* The profiles above are in flash on the target, so are copied out */
+void led_sensor_load(led_sensor_t *to, const led_sensor_t *from) {
+	assert(to);
+	assert(from);
+	memcpy_P(to, from, sizeof *to);
+}
+
+#ifdef LED_TEST
+/* Simulated hardware for testing on the host, a virtual clock counting
+ * microseconds and two LEDs facing each other, numbered by their anode pin.
+ * Reverse biasing an LED charges it fully, and whilst it is discharging the
+ * charge falls at a rate set by whether the other LED is emitting, until
+ * the cathode reads low. The rates give discharge times of 'led_sim_dark_us'
+ * in the dark and 'led_sim_lit_us' when lit, by default those measured with
+ * real LEDs, about 16ms and 2ms. Noise, from ambient
+ * light changing and the LEDs moving, is made by scaling the rate of each
+ * discharge by a random amount, with a standard deviation of
+ * 'led_sim_noise'. */
+#define LED_TICKS_PER_US (1u)
+
 typedef struct {
-	unsigned long start, prev, current;
-} timer_t;
+	led_t *led;
+	double charge; /* one when charged, the cathode reads low at zero */
+	double gain;   /* of the rate, for this discharge */
+	uint32_t edge; /* when it did */
+	int seen;
+} led_sim_t;
+
+static uint32_t led_clock;
+static led_sim_t led_sim[2];
+static double led_sim_noise;
+static double led_sim_dark_us = 16000.0, led_sim_lit_us = 2000.0;
+static uint32_t led_sim_seed = 1;
+
+static double led_sim_uniform(void) { /* xorshift32 */
+	led_sim_seed ^= led_sim_seed << 13;
+	led_sim_seed ^= led_sim_seed >> 17;
+	led_sim_seed ^= led_sim_seed << 5;
+	return led_sim_seed / 4294967296.0;
+}
+
+static double led_sim_normal(void) { /* near enough, and needs no 'libm' */
+	double r = -6.0;
+	for (int i = 0; i < 12; i++)
+		r += led_sim_uniform();
+	return r;
+}
+
+static uint32_t led_now(void) {
+	return led_clock;
+}
+
+static void led_wake(uint32_t wake) {
+	(void)wake; /* the test ticks at 't->wake' itself */
+}
+
+static void led_sensor_set(led_sensor_t *to, const led_sensor_t *from) {
+	*to = *from;
+}
+
+static void led_sim_step(void) {
+	for (int i = 0; i < 2; i++) {
+		led_sim_t *s = &led_sim[i];
+		const led_t *other = led_sim[!i].led;
+		if (!s->led || s->led->mode != LED_MODE_DISCHARGE_E || s->charge <= 0)
+			continue;
+		s->charge -= s->gain / ((other && other->mode == LED_MODE_EMIT_E) ? led_sim_lit_us : led_sim_dark_us);
+		if (s->charge <= 0 && !s->seen) {
+			s->edge = led_clock;
+			s->seen = 1;
+		}
+	}
+	led_clock++;
+}
 
-static int timer_init(timer_t *t) {
+int led_init(led_t *l, unsigned anode, unsigned cathode, const led_sensor_t *sensor) {
 	assert(l);
-	t->prev    = micros();
-	t->start   = t->prev;
-	t->current = t->prev;
+	assert(sensor);
+	memset(l, 0, sizeof *l);
+	l->anode   = anode;
+	l->cathode = cathode;
+	l->sensor  = sensor;
+	memset(&led_sim[anode & 1u], 0, sizeof led_sim[0]);
+	led_sim[anode & 1u].led = l;
 	return 0;
 }
 
-static int timer_expired(timer_t *t, const unsigned long interval_in_microseconds) {
+int led_mode(led_t *l, led_mode_e mode) {
+	assert(l);
+	if (mode != LED_MODE_EMIT_E && mode != LED_MODE_REVERSE_BIAS_E && mode != LED_MODE_DISCHARGE_E)
+		return -1;
+	if (mode == LED_MODE_REVERSE_BIAS_E)
+		led_sim[l->anode & 1u].charge = 1.0;
+	l->mode = mode;
+	return 0;
+}
+
+int led_read_start(led_t *l) {
 	assert(l);
-	t->current = micros();
-	if ((t->current - t->prev) > interval_in_microseconds) {
-		t->prev = t->current;
+	if (l->reading != LED_READ_IDLE)
+		return -1;
+	led_mode(l, LED_MODE_REVERSE_BIAS_E);
+	l->start   = led_now();
+	l->window  = l->sensor->rx_sample_us;
+	l->reading = LED_READ_CHARGE;
+	return 0;
+}
+
+int led_read_done(led_t *l, unsigned *us) {
+	assert(l);
+	assert(us);
+	led_sim_t *s = &led_sim[l->anode & 1u];
+	const uint32_t elapsed = led_now() - l->start;
+	switch (l->reading) {
+	case LED_READ_CHARGE:
+		if (elapsed < l->sensor->rx_charge_us)
+			return 0;
+		led_mode(l, LED_MODE_DISCHARGE_E);
+		s->gain    = 1.0 + (led_sim_noise * led_sim_normal());
+		s->gain    = s->gain < 0.1 ? 0.1 : s->gain;
+		s->seen    = 0;
+		l->start   = led_now();
+		l->reading = LED_READ_DISCHARGE;
+		return 0;
+	case LED_READ_DISCHARGE: {
+		if (!s->seen && elapsed < l->window)
+			return 0;
+		const uint32_t taken = s->seen ? s->edge - l->start : l->window;
+		l->reading = LED_READ_IDLE;
+		*us = taken < l->window ? taken : l->window;
 		return 1;
 	}
-	return 0;
+	default:
+		return -1;
+	}
+}
+
+void led_read_stop(led_t *l) {
+	assert(l);
+	l->reading = LED_READ_IDLE;
+}
+#else
+/* The discharge is timed with Timer 2 counting at F_CPU/8, half a
+ * microsecond a tick at 16MHz, extended by counting its overflows, and the
+ * edge is caught by a pin change interrupt on the cathode, so it is timed
+ * to within the latency of the interrupt rather than that of a loop around
+ * 'digitalRead' and 'micros' (4us a tick). A cathode without a pin change
+ * interrupt is polled instead. The overflow, every 128us, also ticks the
+ * transceiver, if one is attached, and when it is due to change phase
+ * before the next overflow the compare match interrupt is set to tick it
+ * then, so its phases are timed to the tick of the timer. Timer 2 is no
+ * longer available for PWM on pins 3 and 11, or for 'tone'. */
+#define LED_TICKS_PER_US (F_CPU / 8000000uL)
+
+static volatile uint32_t led_overflows;
+static led_t *volatile led_active; /* read waiting for an edge */
+static led_trx_t *volatile led_ticking;
+static volatile uint32_t led_edge;
+static volatile uint8_t led_edge_seen;
+
+ISR(TIMER2_OVF_vect) {
+	led_overflows++;
+	led_trx_t *t = led_ticking;
+	if (t)
+		led_trx_tick(t);
+}
+
+ISR(TIMER2_COMPA_vect) {
+	TIMSK2 &= ~_BV(OCIE2A);
+	led_trx_t *t = led_ticking;
+	if (t)
+		led_trx_tick(t);
+}
+
+/* Interrupts must be disabled */
+static uint32_t led_ticks(void) {
+	const uint8_t t = TCNT2;
+	uint32_t o = led_overflows;
+	if ((TIFR2 & _BV(TOV2)) && t < 0x80u)
+		o++;
+	return (o << 8) | t;
+}
+
+static uint32_t led_now(void) {
+	const uint8_t sreg = SREG;
+	cli();
+	const uint32_t t = led_ticks();
+	SREG = sreg;
+	return t;
+}
+
+ISR(PCINT0_vect) {
+	led_t *l = led_active;
+	if (!l || (*l->cathode_in & l->cathode_bit))
+		return;
+	led_edge      = led_ticks();
+	led_edge_seen = 1;
+	*l->pcmsk    &= ~l->pcmsk_bit;
+}
+
+ISR(PCINT1_vect, ISR_ALIASOF(PCINT0_vect));
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT0_vect));
+
+static void led_wake(uint32_t wake) {
+	const uint8_t sreg = SREG;
+	cli();
+	const int32_t until = wake - led_ticks();
+	if (until > 0 && until < 0x100) {
+		OCR2A   = (uint8_t)wake;
+		TIFR2   = _BV(OCF2A);
+		TIMSK2 |= _BV(OCIE2A);
+	}
+	SREG = sreg;
+}
+
+/* A profile in use is changed with interrupts off, as the transceiver
+ * reads it from its interrupt */
+static void led_sensor_set(led_sensor_t *to, const led_sensor_t *from) {
+	const uint8_t sreg = SREG;
+	cli();
+	*to = *from;
+	SREG = sreg;
 }
 
 static int parity(unsigned v) {
@@ -80,57 +301,157 @@ static int parity(unsigned v) {
 	return p;
 }
 
+int led_init(led_t *l, unsigned anode, unsigned cathode, const led_sensor_t *sensor) {
+	assert(l);
+	assert(sensor);
+	memset(l, 0, sizeof *l);
+	l->anode        = anode;
+	l->cathode      = cathode;
+	l->sensor       = sensor;
+	l->anode_port   = portOutputRegister(digitalPinToPort(anode));
+	l->anode_ddr    = portModeRegister(digitalPinToPort(anode));
+	l->anode_bit    = digitalPinToBitMask(anode);
+	l->cathode_port = portOutputRegister(digitalPinToPort(cathode));
+	l->cathode_ddr  = portModeRegister(digitalPinToPort(cathode));
+	l->cathode_in   = portInputRegister(digitalPinToPort(cathode));
+	l->cathode_bit  = digitalPinToBitMask(cathode);
+	volatile uint8_t *pcicr = digitalPinToPCICR(cathode);
+	if (pcicr) {
+		l->pcmsk     = digitalPinToPCMSK(cathode);
+		l->pcmsk_bit = _BV(digitalPinToPCMSKbit(cathode));
+		l->pcicr_bit = _BV(digitalPinToPCICRbit(cathode));
+		*pcicr      |= l->pcicr_bit;
+	}
+	TCCR2A  = 0;
+	TCCR2B  = _BV(CS21);
+	TIMSK2 |= _BV(TOIE2);
+	return 0;
+}
+
+/* The registers are changed with interrupts off, as other pins on the same
+ * ports are written to from interrupts, by the Morse code transmitter */
 int led_mode(led_t *l, led_mode_e mode) {
 	assert(l);
+	const uint8_t sreg = SREG;
+	cli();
 	switch (mode) {
 	case LED_MODE_EMIT_E:
-		pinMode(l->anode,   OUTPUT);
-		pinMode(l->cathode, OUTPUT);
-		digitalWrite(l->anode,   HIGH);
-		digitalWrite(l->cathode, LOW);
+		*l->anode_ddr    |= l->anode_bit;
+		*l->cathode_ddr  |= l->cathode_bit;
+		*l->anode_port   |= l->anode_bit;
+		*l->cathode_port &= ~l->cathode_bit;
 		break;
 	case LED_MODE_REVERSE_BIAS_E:
-		pinMode(l->anode,   OUTPUT);
-		pinMode(l->cathode, OUTPUT);
-		digitalWrite(l->anode,   LOW);
-		digitalWrite(l->cathode, HIGH);
+		*l->anode_ddr    |= l->anode_bit;
+		*l->cathode_ddr  |= l->cathode_bit;
+		*l->anode_port   &= ~l->anode_bit;
+		*l->cathode_port |= l->cathode_bit;
 		break;
 	case LED_MODE_DISCHARGE_E:
-		pinMode(l->anode,   OUTPUT);
-		pinMode(l->cathode, INPUT /*INPUT_PULLUP*/);
-		digitalWrite(l->anode, LOW);
+		*l->anode_ddr    |= l->anode_bit;
+		*l->anode_port   &= ~l->anode_bit;
+		*l->cathode_ddr  &= ~l->cathode_bit;
+		*l->cathode_port &= ~l->cathode_bit; /* no pull up */
 		break;
 	default:
+		SREG = sreg;
 		return -1;
 	}
+	SREG = sreg;
 	l->mode = mode;
 	return 0;
 }
 
-int led_set(led_t *l, const int on) {
+/* A read charges the LED, reverse biasing it, then times how long it
+ * takes to discharge through the cathode, which is quicker the more light
+ * falls on it, giving up after 'window', the profile's 'rx_sample_us'
+ * unless changed once it has started. 'led_read_start' begins it
+ * and 'led_read_done' is polled until it returns non zero, the caller being
+ * free to do other things in between. */
+int led_read_start(led_t *l) {
 	assert(l);
-	return led_mode(l, on ? LED_MODE_EMIT_E : LED_MODE_REVERSE_BIAS_E);
+	if (l->reading != LED_READ_IDLE)
+		return -1;
+	led_mode(l, LED_MODE_REVERSE_BIAS_E); /* charge LED */
+	l->start   = led_now();
+	l->window  = l->sensor->rx_sample_us;
+	l->reading = LED_READ_CHARGE;
+	return 0;
 }
 
-static int led_read_pin(led_t *l) {
+int led_read_done(led_t *l, unsigned *us) {
 	assert(l);
-	if (l->mode != LED_MODE_DISCHARGE_E)
+	assert(us);
+	const uint32_t elapsed = led_now() - l->start;
+	switch (l->reading) {
+	case LED_READ_CHARGE: {
+		if (elapsed < (uint32_t)l->sensor->rx_charge_us * LED_TICKS_PER_US)
+			return 0;
+		const uint8_t sreg = SREG;
+		cli();
+		led_mode(l, LED_MODE_DISCHARGE_E);
+		l->start      = led_ticks();
+		led_edge_seen = 0;
+		led_active    = l;
+		if (l->pcmsk) {
+			PCIFR     = l->pcicr_bit;
+			*l->pcmsk |= l->pcmsk_bit;
+		}
+		SREG = sreg;
+		l->reading = LED_READ_DISCHARGE;
+		return 0;
+	}
+	case LED_READ_DISCHARGE: {
+		const uint32_t window = (uint32_t)l->window * LED_TICKS_PER_US;
+		if (!l->pcmsk && !led_edge_seen && !(*l->cathode_in & l->cathode_bit)) {
+			led_edge      = led_now();
+			led_edge_seen = 1;
+		}
+		if (!led_edge_seen && elapsed < window)
+			return 0;
+		const uint8_t sreg = SREG;
+		cli();
+		if (l->pcmsk)
+			*l->pcmsk &= ~l->pcmsk_bit;
+		led_active = NULL;
+		const uint32_t taken = led_edge_seen ? led_edge - l->start : window;
+		SREG = sreg;
+		l->reading = LED_READ_IDLE;
+		*us = (taken < window ? taken : window) / LED_TICKS_PER_US;
+		return 1;
+	}
+	default:
 		return -1;
-	return digitalRead(l->cathode) == HIGH ? 1 : 0;
+	}
 }
 
+void led_read_stop(led_t *l) {
+	assert(l);
+	const uint8_t sreg = SREG;
+	cli();
+	if (l->reading == LED_READ_DISCHARGE) {
+		if (l->pcmsk)
+			*l->pcmsk &= ~l->pcmsk_bit;
+		led_active = NULL;
+	}
+	SREG = sreg;
+	l->reading = LED_READ_IDLE;
+}
+
+/* Each read takes the same time, charging and then the whole of the
+ * sample window whenever the discharge ends, as the bits sent are timed
+ * to the same period */
 unsigned led_read(led_t *l) {
 	assert(l);
-	led_mode(l, LED_MODE_REVERSE_BIAS_E); /* charge LED */
-	delayMicroseconds(l->sensor->rx_charge_us);
-	led_mode(l, LED_MODE_DISCHARGE_E);
-	timer_t t;
-	timer_init(&t);
-	while (!timer_expired(&t, l->sensor->rx_sample_us) && led_read_pin(l))
+	unsigned us = 0;
+	const unsigned long begin = micros();
+	if (led_read_start(l) < 0)
+		return 0;
+	while (led_read_done(l, &us) == 0)
 		;
-	unsigned r = t.current - t.start;
-	delayMicroseconds(l->sensor->rx_sample_us - r);
-	return r;
+	while ((micros() - begin) < ((unsigned long)l->sensor->rx_charge_us + l->sensor->rx_sample_us))
+		;
+	return us;
 }
 
 static int led_send_bit(led_t *l, int on) {
@@ -163,3 +484,1536 @@ int led_send_string(led_t *l, const char *s) {
 	return 0;
 }
 
+void led_trx_attach(led_trx_t *t) {
+	led_ticking = t;
+}
+#endif
+
+int led_set(led_t *l, const int on) {
+	assert(l);
+	return led_mode(l, on ? LED_MODE_EMIT_E : LED_MODE_REVERSE_BIAS_E);
+}
+
+/* Times are in ticks of the clock 'led_now' reads, compared so they can
+ * wrap around. Each period starts when the last was due to end rather than
+ * when it was noticed, so the bits sent do not drift, unless it is so late
+ * a whole period has been missed. */
+#define LED_TICKS(US) ((uint32_t)(US) * LED_TICKS_PER_US)
+
+enum { LED_TRX_READ, LED_TRX_REST, LED_TRX_EMIT, LED_TRX_DARK };
+
+/* What the interrupt took each reading to be: a bit of a byte, the start
+ * pulse, the first light seen after waiting for it, the dark period after a
+ * byte or one with nothing sent, a reading of light when that dark period
+ * was due, or a reading that saw no light whilst waiting for it, which is
+ * how long the dark takes to discharge the LED */
+enum { LED_RAW_BIT, LED_RAW_FIRST, LED_RAW_GAP, LED_RAW_SLIP, LED_RAW_DARK };
+
+static unsigned long led_isqrt(unsigned long n) {
+	unsigned long r = 0, b = 1uL << 30;
+	while (b > n)
+		b >>= 2;
+	for (; b; b >>= 2) {
+		if (n >= r + b) {
+			n -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+static int led_trx_due(uint32_t now, uint32_t deadline) {
+	return (int32_t)(now - deadline) >= 0;
+}
+
+/* The interrupt is passed what it needs from the decoding with interrupts
+ * off: the threshold it frames bytes with, what it needs to work out when
+ * light came on, and how far to have moved the periods it reads in, for
+ * them to start when the sender's do, from when the sender's are worked out
+ * to start and how much that changes each period. Until the dark has been
+ * read it is taken to be eight times slower than light, as it is when
+ * keeping in step. */
+static void led_trx_steer(led_trx_t *t) {
+	const led_sensor_t *s = t->led->sensor;
+	const unsigned lit = t->level[0], dark = t->dark_us > lit ? t->dark_us : 8u * lit;
+	const unsigned dark_at = t->adapt ? t->rx_dark : s->rx_dark_us;
+	const unsigned dawn = t->dark_us ? dark - (dark / 8u) : s->rx_dark_us;
+	const unsigned long lead = dark > lit ? (256uL * dark) / (dark - lit) : 256u;
+#ifndef LED_TEST
+	const uint8_t sreg = SREG;
+	cli();
+#endif
+	t->aim     = -(t->phase + ((int32_t)t->drift * (int16_t)(t->n - t->at)));
+	t->slope   = -t->drift;
+	t->dark_at = dark_at;
+	t->dawn    = dawn;
+	t->lit_us  = lit;
+	t->lead    = lead < 0xFFFFu ? lead : 0xFFFFu;
+#ifndef LED_TEST
+	SREG = sreg;
+#endif
+}
+
+/* The readings fall into three clusters, of marks, spaces and the dark,
+ * each kept as a level and how far readings stray from it on average, above
+ * and below it apart, as spaces stray further towards the dark. The levels
+ * start where the profile's thresholds would put them, halfway between the
+ * levels on a logarithmic scale, and the profile's thresholds are used until
+ * 'LED_TRX_LEARN' bytes have been read, again whenever the profile changes,
+ * when the readings not yet decoded, taken with the last one, are dropped.
+ * A light level profile has none. */
+static void led_trx_levels(led_trx_t *t, const led_sensor_t *s) {
+	if (t->from_mark == s->rx_mark_us && t->from_dark == s->rx_dark_us)
+		return;
+	const unsigned long mark = s->rx_mark_us, dark = s->rx_dark_us, space = led_isqrt(mark * dark);
+	t->from_mark = mark;
+	t->from_dark = dark;
+	t->rx_mark   = mark;
+	t->rx_dark   = dark;
+	t->level[0]  = space ? (mark * mark) / space : 0;
+	t->level[1]  = space;
+	t->level[2]  = space ? (dark * dark) / space : 0;
+	for (uint8_t i = 0; i < 3; i++)
+		t->above[i] = t->below[i] = 0;
+	t->learnt   = 0;
+	t->drift    = 0;
+	t->kept     = 0;
+	t->raw_tail = t->raw_head;
+	t->rx_bits  = 9;
+	led_trx_steer(t);
+}
+
+void led_trx_init(led_trx_t *t, led_t *l) {
+	assert(t);
+	assert(l);
+	memset(t, 0, sizeof *t);
+	t->led   = l;
+	t->state = LED_TRX_REST;
+	t->end   = led_now();
+	t->adapt = 1;
+	t->darks = 2; /* reads the dark first */
+	led_trx_levels(t, l->sensor);
+}
+
+/* A threshold sits between two levels as many spreads from each, so one
+ * that is read cleanly and one that is not, as spaces are when the light
+ * changes, get their fair share of the gap. Spreads are kept from getting
+ * too small when readings come out the same every time, as dark ones can. */
+static unsigned led_trx_between(const led_trx_t *t, uint8_t i) {
+	unsigned long a = t->above[i], b = t->below[i + 1];
+	a = a < t->level[i] / 256u ? t->level[i] / 256u : a;
+	b = b < t->level[i + 1] / 256u ? t->level[i + 1] / 256u : b;
+	return (t->level[i] * b + t->level[i + 1] * a) / (a + b);
+}
+
+#define LED_TRX_CLIP (2) /* spreads, and a sixty-fourth of the level, a reading counts as at most once the levels are learnt */
+
+/* A reading moves the level it is closest to an eighth of the way to it,
+ * or further for the first few bytes so that where the levels started does
+ * not count for long, and the spread on its side of the level where it ends
+ * up a sixteenth, as long as the levels stay in order. After the first two
+ * bytes how far it strays is clipped to 'LED_TRX_CLIP' spreads, so a space
+ * taken for a mark now and then does not widen the marks' spread and pull
+ * the threshold between them up into the spaces. */
+static void led_trx_learn(led_trx_t *t, uint8_t level, unsigned us) {
+	const long was = t->level[level], by = t->learnt < 7u ? t->learnt + 1u : 8;
+	const long moved = was + (((long)us - was) / by), off = (long)us - moved;
+	if (level > 0 && moved <= (long)t->level[level - 1])
+		return;
+	if (level < 2 && moved >= (long)t->level[level + 1])
+		return;
+	unsigned *spread = off < 0 ? &t->below[level] : &t->above[level];
+	const long most = (LED_TRX_CLIP * (long)*spread) + (moved / 64);
+	long by_off = off < 0 ? -off : off;
+	if (t->learnt >= 2u && by_off > most)
+		by_off = most;
+	t->level[level] = moved;
+	*spread = (long)*spread + ((by_off - (long)*spread) / 16);
+}
+
+#define LED_TRX_AIM   (9)  /* sixteenths of the way from the mark threshold to the dark one spaces are read at */
+#define LED_TRX_PHASE (8)  /* the phase is moved at least this fraction of the way to what a reading shows */
+#define LED_TRX_DRIFT (64) /* and the drift */
+#define LED_TRX_KEPT  (4)  /* readings a drift kept from the last frame counts for */
+#define LED_TRX_NOISE (32) /* readings the drift counts for more as spaces spread as far as from the marks */
+
+/* A space is lit for part of the period from its start and read from the
+ * end of the charge, so reading later than the sender leaves less of the
+ * light in the reading and makes it longer, and reading earlier shorter, by
+ * as many times longer as the dark takes to discharge the LED than light
+ * does, less one. Spaces are aimed to read 'LED_TRX_AIM' of the way between
+ * the profile's thresholds, so how far out of step a reading was is worked
+ * out from how far it is from there. A mark read before the light came on
+ * reads longer than the light alone by most of how early it was, so a mark
+ * reading more than a quarter of the way to the threshold shows that too.
+ * A space read as the dark, or a mark as the light alone, only bounds it,
+ * and moves nothing unless it was further out than that. Less how far its
+ * period had been moved, that is how far the sender's periods are from
+ * where they would be were none moved. Where they start, 'phase', and how
+ * much that changes each period, 'drift', as the sender's clock runs at a
+ * different rate, are fitted as a line through the readings since the
+ * start pulse, with gains that fall as more are read, but no lower than
+ * 'LED_TRX_PHASE' and 'LED_TRX_DRIFT' so both go on following the sender.
+ * The drift is kept within a sixty-fourth of a period and from one frame
+ * to the next, and counts as 'LED_TRX_NOISE' more readings for as much as
+ * the spaces' spread is of the gap from the marks, so on a noisy line a
+ * few readings early in a frame do not swing it, while on a clean one it
+ * is picked up within the first byte. Until the dark has been read it is taken to be eight times
+ * slower than light, as it is for the LEDs this was written for. */
+static void led_trx_track(led_trx_t *t, const led_sensor_t *s, unsigned us, int16_t moved) {
+	const long lit = t->level[0], dark = t->dark_us > lit ? (long)t->dark_us : 8 * lit;
+	const long target = (long)s->rx_mark_us + ((((long)s->rx_dark_us - (long)s->rx_mark_us) * LED_TRX_AIM) / 16), most = s->tx_period_us / 4u;
+	const long band = ((long)t->rx_mark - lit) / 4;
+	long late;
+	int seen;
+	if (us < t->rx_mark) {
+		seen = (long)us > lit + band;
+		late = -((((seen ? (long)us - lit : band) * dark) * 16) / (dark - lit));
+	} else {
+		seen = us < t->rx_dark;
+		const long read = seen ? us : (long)t->rx_dark;
+		late = (((read - target) * lit) * 16) / (dark - lit);
+	}
+	const uint16_t since = t->index - t->at;
+	const int32_t guess = t->phase + ((int32_t)t->drift * since), off = late - ((int32_t)moved * 16) - guess;
+	if (!seen && off <= 0)
+		return;
+	/* the gains of a least squares line through n readings, the drift's as if there were more when kept or noisy */
+	const long gap = (long)t->level[1] - lit, noise = gap > 0 ? (LED_TRX_NOISE * ((long)t->above[1] + (long)t->below[1])) / gap : 0;
+	const long n = t->fits + 1, pn = (n * (n + 1)) / (2 * (2 * n - 1)), m = n + noise + (t->kept ? LED_TRX_KEPT : 0), dn = (m * (m + 1)) / 6;
+	if (seen && t->fits) {
+		const long drift = t->drift + (off / ((long)since * (dn > LED_TRX_DRIFT ? LED_TRX_DRIFT : dn)));
+		t->drift = drift > most ? most : drift < -most ? -most : drift;
+	}
+	t->phase = guess + (off / (pn > LED_TRX_PHASE ? LED_TRX_PHASE : pn));
+	t->at    = t->index;
+	t->fits += seen && t->fits < 0xFFu;
+	led_trx_steer(t);
+}
+
+/* Readings of a byte followed by a dark period, so read in step, move the
+ * levels and keep the drift for the next frame, unless one was too late to
+ * tell a space from the dark, when only the marks move theirs */
+static void led_trx_gap(led_trx_t *t, unsigned us) {
+	if (!t->adapt || t->rx_bits != 8)
+		return;
+	if (t->late) {
+		for (uint8_t i = 0; i < 8; i++)
+			if (t->bit_us[i] < t->rx_mark)
+				led_trx_learn(t, 0, t->bit_us[i]);
+		led_trx_steer(t);
+		return;
+	}
+	for (uint8_t i = 0; i < 8; i++)
+		led_trx_learn(t, 2ul * t->bit_us[i] >= (unsigned long)t->level[0] + t->level[1], t->bit_us[i]);
+	led_trx_learn(t, 2, us);
+	t->kept = t->drift;
+	if (t->learnt < LED_TRX_LEARN) {
+		t->learnt++;
+	} else {
+		t->rx_mark = led_trx_between(t, 0);
+		t->rx_dark = led_trx_between(t, 1);
+	}
+	led_trx_steer(t);
+}
+
+/* A reading is decoded as the interrupt framed it, and in the middle of a
+ * byte one as long as the dark is a space read late, giving the byte it
+ * finished, or negative */
+static int led_trx_decode(led_trx_t *t, unsigned us, uint8_t kind, int16_t moved) {
+	const led_sensor_t *s = t->led->sensor;
+	const unsigned mark = t->adapt ? t->rx_mark : s->rx_mark_us;
+	t->index++;
+	if (kind == LED_RAW_DARK || kind == LED_RAW_GAP) {
+		if (kind == LED_RAW_DARK) {
+			t->dark_us = t->dark_us ? t->dark_us - (t->dark_us / 4u) + (us / 4u) : us;
+			led_trx_steer(t);
+		} else {
+			led_trx_gap(t, us);
+		}
+		t->beaconed = t->beaconed || t->run >= LED_BEACON_RUN;
+		t->run      = 0;
+		t->rx_byte  = 0;
+		t->rx_bits  = 0;
+		t->late     = 0;
+		return -1;
+	}
+	t->run += t->run < 0xFFu;
+	if (kind == LED_RAW_FIRST) {
+		t->rx_byte = 0;
+		t->rx_bits = 0;
+		t->index   = 0;
+		t->at      = 0;
+		t->phase   = 0;
+		t->drift   = t->kept;
+		t->fits    = 0;
+		led_trx_steer(t);
+		return -1;
+	}
+	if (kind == LED_RAW_SLIP || t->rx_bits >= 8) { /* the dark was due */
+		if (t->rx_bits == 8)
+			LED_STAT(t->slips);
+		t->rx_bits = 9;
+		return -1;
+	}
+	if (us < mark)
+		t->rx_byte |= 1u << t->rx_bits;
+	else
+		t->late |= us >= t->rx_dark;
+	if (t->adapt && t->level[1] && (us >= mark || t->learnt))
+		led_trx_track(t, s, us, moved);
+	t->bit_us[t->rx_bits] = us;
+	if (++t->rx_bits < 8)
+		return -1;
+	const uint8_t b = t->rx_byte;
+	t->rx_byte = 0;
+	if (!t->adapt) /* or waits for the dark */
+		t->rx_bits = 0;
+	return b;
+}
+
+static void led_trx_queue(led_trx_t *t, unsigned us, uint8_t kind) {
+	if ((uint8_t)(t->raw_head - t->raw_tail) >= LED_TRX_RAW) {
+		t->lost = 1;
+		return;
+	}
+	t->raw[t->raw_head % LED_TRX_RAW]   = us;
+	t->kind[t->raw_head % LED_TRX_RAW]  = kind;
+	t->moved[t->raw_head % LED_TRX_RAW] = t->shift / 16;
+	t->raw_head++;
+}
+
+/* Counts the periods a reading that waited for light took, 'us' from when
+ * it started to when the next one does, less the one it started in, as the
+ * other end counts them */
+static void led_trx_waited(led_trx_t *t, uint32_t us) {
+	const led_sensor_t *s = t->led->sensor;
+	const uint32_t n = (s->rx_charge_us + us + (s->tx_period_us / 2u)) / s->tx_period_us;
+	t->periods += n ? n - 1u : 0;
+}
+
+/* From the interrupt, a dark reading ends a byte after its eighth bit, or
+ * in place of its first when the first was taken for one after a dark
+ * period that was not a start pulse, and without 'adapt' always. After two
+ * in a row the next reading waits for light, counting the periods it waits
+ * through. Light it sees is a start pulse, and as the reading took as long
+ * as one of light and some of the time the dark would take, in proportion
+ * to how much of it was before the light came on, when the light came on is
+ * worked out, and the period for the first bit starts a period after that.
+ * After each reading the period is moved for 'shift' to be what the
+ * decoding aimed for. Without 'adapt' the eighth bit also ends a byte. */
+static void led_trx_receive(led_trx_t *t, unsigned us) {
+	const led_sensor_t *s = t->led->sensor;
+	uint8_t kind = LED_RAW_BIT;
+	if (t->measure || !s->rx_mark_us) { /* the light alone, then waits for the dark */
+		if (t->measure && t->cal_n < LED_CAL_READINGS)
+			t->cal[t->cal_n++] = us;
+		t->hunting = 0;
+		t->bits    = 8;
+		t->darks   = 0;
+		return;
+	}
+	if (t->hunting) {
+		t->hunting = 0;
+		if (us >= t->dawn) { /* waits again straight away */
+			t->darks += t->darks < 0xFFu;
+			led_trx_queue(t, us, LED_RAW_DARK);
+			led_trx_waited(t, us);
+			t->end = t->led->start + LED_TICKS(us);
+			return;
+		}
+		const uint32_t over = us > t->lit_us ? us - t->lit_us : 0;
+		kind     = LED_RAW_FIRST;
+		led_trx_waited(t, ((over * t->lead) >> 8) + s->tx_period_us);
+		t->end   = t->led->start + LED_TICKS((over * t->lead) >> 8) + LED_TICKS(s->tx_period_us);
+		t->bits  = 0;
+		t->darks = 0;
+		t->n     = 0;
+		t->shift = 0;
+		t->aim   = 0;
+	} else if (us >= t->dark_at && (t->bits >= 8 || !t->adapt || (t->bits <= 1u && t->darks >= 2u - t->bits))) {
+		kind     = LED_RAW_GAP;
+		t->darks = t->bits >= 8 ? 1 : t->darks + (t->darks < 0xFFu);
+		t->bits  = 0;
+	} else if (t->bits >= 8 && t->adapt) {
+		kind = LED_RAW_SLIP;
+	} else {
+		t->darks = t->bits == 0 && t->darks && us >= t->dark_at;
+		t->bits  = (t->bits % 8u) + 1u;
+	}
+	led_trx_queue(t, us, kind);
+	t->n++;
+	t->aim += t->slope;
+	const int32_t move = (t->aim - t->shift) / 16;
+	t->shift += move * 16;
+	t->end   += move * (int32_t)LED_TICKS_PER_US;
+}
+
+static void led_trx_next(led_trx_t *t, uint32_t now) {
+	const led_sensor_t *s = t->led->sensor;
+	const uint32_t start = led_trx_due(now, t->end + LED_TICKS(s->tx_period_us)) ? now : t->end;
+	LED_STAT(t->busy);
+	t->periods++;
+	if (!t->tx_bits && (t->bits == 0 || t->bits >= 8) && !t->gap && t->tx_head != t->tx_tail && (!t->adapt || (t->quiet == 1 && t->state == LED_TRX_DARK) || (t->quiet == 3 && t->darks >= 3))) {
+		t->tx_byte = t->tx[t->tx_tail % LED_QUEUE];
+		t->tx_bits = 8;
+		if (t->adapt && t->quiet == 3) { /* the other end is waiting for light */
+			t->tx_byte = (t->tx_byte << 1) | 1u;
+			t->tx_bits = 9;
+		}
+		t->tx_tail++;
+		t->bits    = 0; /* whatever comes back is waited for */
+		t->darks   = 2;
+	}
+	if (t->tx_bits) {
+		const int on = t->tx_byte & 1u;
+		t->tx_byte >>= 1;
+		t->gap   = --t->tx_bits == 0;
+		t->quiet = 0;
+		t->emit  = start + LED_TICKS(on ? s->tx_mark_us : s->tx_space_us);
+		t->end   = start + LED_TICKS(s->tx_period_us);
+		t->state = LED_TRX_EMIT;
+		led_mode(t->led, LED_MODE_EMIT_E);
+		return;
+	}
+	if (t->gap) {
+		t->gap   = 0;
+		t->quiet = 1;
+		t->end   = start + LED_TICKS(s->tx_period_us);
+		t->state = LED_TRX_DARK;
+		led_mode(t->led, LED_MODE_REVERSE_BIAS_E);
+		return;
+	}
+	if (t->beacon) { /* waits out a reading's period as a dark one does, but lit */
+		t->end   = start + LED_TICKS(s->rx_charge_us) + LED_TICKS(s->rx_sample_us);
+		t->quiet = 0;
+		t->state = LED_TRX_DARK;
+		led_mode(t->led, LED_MODE_EMIT_E);
+		return;
+	}
+	t->quiet  += t->quiet < 3u;
+	t->hunting = t->adapt && !t->measure && t->darks >= 2;
+	if (t->adapt && !t->hunting) /* a reading ran into its period, so this one is that much later */
+		t->shift += ((int32_t)(now - start) * 16) / (int32_t)LED_TICKS_PER_US;
+	t->end     = now + LED_TICKS(s->rx_charge_us) + LED_TICKS(t->hunting ? LED_TRX_HUNT_US : s->rx_sample_us);
+	t->state   = LED_TRX_READ;
+	led_read_start(t->led);
+	if (t->hunting)
+		t->led->window = LED_TRX_HUNT_US;
+}
+
+void led_trx_tick(led_trx_t *t) {
+	assert(t);
+	const uint32_t now = led_now();
+	unsigned us = 0;
+	LED_STAT(t->ticks);
+	switch (t->state) {
+	case LED_TRX_READ: {
+		int r = led_read_done(t->led, &us);
+		if (r == 0 && t->hunting && t->dark_us && t->darks >= 3 && t->tx_head != t->tx_tail) { /* stops waiting to send */
+			led_trx_waited(t, (now - t->led->start) / LED_TICKS_PER_US);
+			t->end = now;
+			t->hunting = 0;
+		}
+		if (r == 0 && !led_trx_due(now, t->end))
+			break;
+		if (r == 0) { /* the profile changed part way through it */
+			led_read_stop(t->led);
+			r = -1;
+		}
+		if (r > 0)
+			led_trx_receive(t, us);
+		t->state = LED_TRX_REST;
+		LED_STAT(t->busy);
+	}
+		/* fall through */
+	case LED_TRX_REST:
+	case LED_TRX_DARK:
+		if (led_trx_due(now, t->end))
+			led_trx_next(t, now);
+		break;
+	case LED_TRX_EMIT:
+		if (led_trx_due(now, t->emit)) {
+			t->state = LED_TRX_DARK;
+			LED_STAT(t->busy);
+			led_mode(t->led, LED_MODE_REVERSE_BIAS_E);
+		}
+		break;
+	}
+	const led_t *l = t->led;
+	if (t->state == LED_TRX_EMIT)
+		t->wake = t->emit;
+	else if (t->state == LED_TRX_READ && l->reading == LED_READ_CHARGE)
+		t->wake = l->start + LED_TICKS(l->sensor->rx_charge_us);
+	else if (t->state == LED_TRX_READ)
+		t->wake = l->start + LED_TICKS(l->window);
+	else
+		t->wake = t->end;
+	if (led_trx_due(t->wake, t->end))
+		t->wake = t->end;
+	led_wake(t->wake);
+}
+
+int led_trx_put(led_trx_t *t, uint8_t b) {
+	assert(t);
+	if ((uint8_t)(t->tx_head - t->tx_tail) >= LED_QUEUE)
+		return 0;
+	t->tx[t->tx_head % LED_QUEUE] = b;
+	t->tx_head++;
+	return 1;
+}
+
+/* Readings are decoded up to the end of the next byte, so there is no
+ * queue of bytes. Readings lost as the queue was full leave the byte they
+ * were in unknown, it is dropped. */
+int led_trx_get(led_trx_t *t) {
+	assert(t);
+	led_trx_levels(t, t->led->sensor);
+	while (t->raw_tail != t->raw_head) {
+		const uint8_t i = t->raw_tail++ % LED_TRX_RAW;
+		const int b = led_trx_decode(t, t->raw[i], t->kind[i], t->moved[i]);
+		if (b >= 0)
+			return b;
+	}
+	if (t->lost) {
+		t->lost    = 0;
+		t->rx_bits = 9;
+	}
+	return -1;
+}
+
+int led_trx_busy(const led_trx_t *t) {
+	assert(t);
+	return t->tx_head != t->tx_tail || t->tx_bits || t->gap;
+}
+
+int led_trx_waiting(const led_trx_t *t) {
+	assert(t);
+	return t->raw_head != t->raw_tail;
+}
+
+/* The transceiver's bit coding is kept as the line code: every bit is a
+ * pulse of light, long for a mark and short for a space, so there are no
+ * runs of dark to lose count of bits in, and the dark period after each
+ * byte, which no bit can be mistaken for, marks where bytes start. Frames
+ * are found by their sync byte, a preamble before it giving a receiver
+ * that has only just started listening a byte to miss. */
+enum { LED_LINK_IDLE, LED_LINK_SEND, LED_LINK_SENDING, LED_LINK_WAIT };
+enum { LED_LINK_HUNT, LED_LINK_CONTROL, LED_LINK_LENGTH, LED_LINK_DATA };
+
+#define LED_LINK_NONE (0xFFu) /* not a sequence number, none received yet */
+
+void led_link_init(led_link_t *k, led_trx_t *t) {
+	assert(k);
+	assert(t);
+	memset(k, 0, sizeof *k);
+	k->trx    = t;
+	k->rx_seq = LED_LINK_NONE;
+}
+
+/* The time an acknowledgement takes to send, nine periods a byte, and two
+ * bytes more for the other end to turn around, at the bit period in use */
+static unsigned long led_link_timeout(const led_link_t *k) {
+	const unsigned long period = k->trx->led->sensor->tx_period_us;
+	return ((LED_LINK_OVERHEAD + 2uL) * 9uL * period) / 1000uL;
+}
+
+/* A frame is not built anywhere, each byte of it is worked out as it is
+ * queued on the transceiver, the payload of a data frame being 'tx' */
+static void led_link_frame(led_link_t *k, uint8_t control, uint8_t length) {
+	k->out_control = control;
+	k->out_crc     = CRC8_INIT;
+	k->out_n       = length + LED_LINK_OVERHEAD;
+	k->out_i       = 0;
+}
+
+static uint8_t led_link_out(const led_link_t *k) {
+	const uint8_t i = k->out_i;
+	if (i == 0)
+		return LED_LINK_PREAMBLE;
+	if (i == 1)
+		return LED_LINK_SYNC;
+	if (i == 2)
+		return k->out_control;
+	if (i == 3)
+		return k->out_n - LED_LINK_OVERHEAD;
+	return i + 1u < k->out_n ? k->tx[i - 4u] : k->out_crc;
+}
+
+static void led_link_accept(led_link_t *k) {
+	const uint8_t control = k->in_control, length = k->in_n, seq = control & LED_LINK_SEQ;
+	if (control & LED_LINK_ACK) {
+		if ((k->tx_state == LED_LINK_SENDING || k->tx_state == LED_LINK_WAIT) && seq == k->tx_seq) {
+			k->acked++;
+			k->tx_state = LED_LINK_IDLE;
+			k->tx_seq   = (k->tx_seq + 1u) & LED_LINK_SEQ;
+		}
+		return;
+	}
+	if (seq == k->rx_seq) {
+		LED_STAT(k->duplicates);
+	} else {
+		if (k->rx_full) /* and the payload went nowhere */
+			return;
+		k->rx_n    = length;
+		k->rx_full = 1;
+		k->rx_seq  = seq;
+		k->rx_tune = control & LED_LINK_TUNE;
+		LED_STAT(k->received);
+	}
+	k->ack     = 1;
+	k->ack_seq = seq;
+}
+
+static void led_link_receive(led_link_t *k, uint8_t b) {
+	switch (k->in_state) {
+	case LED_LINK_HUNT:
+		if (b == LED_LINK_SYNC)
+			k->in_state = LED_LINK_CONTROL;
+		return;
+	case LED_LINK_CONTROL:
+		k->in_control = b;
+		k->in_crc     = crc8_add(CRC8_INIT, b);
+		k->in_state   = LED_LINK_LENGTH;
+		return;
+	case LED_LINK_LENGTH:
+		if (b > LED_LINK_MAX) {
+			LED_STAT(k->bad);
+			k->in_state = LED_LINK_HUNT;
+			return;
+		}
+		k->in_n     = b;
+		k->in_i     = 0;
+		k->in_crc   = crc8_add(k->in_crc, b);
+		k->in_state = LED_LINK_DATA;
+		return;
+	case LED_LINK_DATA: /* into 'rx' while it is free, it is only taken once the CRC is right */
+		if (k->in_i < k->in_n) {
+			if (!k->rx_full)
+				k->rx[k->in_i] = b;
+			k->in_i++;
+			k->in_crc = crc8_add(k->in_crc, b);
+			return;
+		}
+		k->in_state = LED_LINK_HUNT;
+		if (k->in_crc != b) {
+			LED_STAT(k->bad);
+			return;
+		}
+		led_link_accept(k);
+		return;
+	}
+}
+
+void led_link_poll(led_link_t *k, unsigned long ms) {
+	assert(k);
+	for (int c = 0; (c = led_trx_get(k->trx)) >= 0; )
+		led_link_receive(k, c);
+	if (k->tx_state == LED_LINK_WAIT && (ms - k->sent_ms) >= led_link_timeout(k)) {
+		if (k->tries < LED_LINK_TRIES) {
+			k->tx_state = LED_LINK_SEND;
+		} else { /* the next frame gets a new number, in case this did arrive */
+			LED_STAT(k->failed);
+			k->tx_state = LED_LINK_IDLE;
+			k->tx_seq   = (k->tx_seq + 1u) & LED_LINK_SEQ;
+		}
+	}
+	if (k->out_i == k->out_n) {
+		if (k->ack) {
+			k->ack = 0;
+			led_link_frame(k, k->ack_seq | LED_LINK_ACK, 0);
+		} else if (k->tx_state == LED_LINK_SEND) {
+			k->tries++;
+			k->frames++;
+			k->tx_state = LED_LINK_SENDING;
+			led_link_frame(k, k->tx_seq | k->tx_tune, k->tx_n);
+		} else if (k->tx_state == LED_LINK_SENDING && !led_trx_busy(k->trx)) {
+			k->sent_ms  = ms; /* the wait starts once it has all gone */
+			k->tx_state = LED_LINK_WAIT;
+		}
+	}
+	while (k->out_i < k->out_n) {
+		const uint8_t b = led_link_out(k);
+		if (!led_trx_put(k->trx, b))
+			break;
+		if (k->out_i++ >= 2u) /* the CRC is over the control byte, length and payload */
+			k->out_crc = crc8_add(k->out_crc, b);
+	}
+}
+
+static int led_link_queue(led_link_t *k, uint8_t tune, const uint8_t *data, size_t length) {
+	const int sending = k->out_i != k->out_n && !(k->out_control & LED_LINK_ACK); /* from 'tx' */
+	if (k->tx_state != LED_LINK_IDLE || sending || length > LED_LINK_MAX)
+		return -1;
+	memcpy(k->tx, data, length);
+	k->tx_n     = length;
+	k->tx_tune  = tune;
+	k->tries    = 0;
+	k->tx_state = LED_LINK_SEND;
+	return 0;
+}
+
+int led_link_send(led_link_t *k, const uint8_t *data, size_t length) {
+	assert(k);
+	assert(data || length == 0);
+	return led_link_queue(k, 0, data, length);
+}
+
+/* Gives up on the frame being sent, the rest of it still goes */
+static void led_link_cancel(led_link_t *k) {
+	if (k->tx_state == LED_LINK_IDLE)
+		return;
+	LED_STAT(k->failed);
+	k->tx_state = LED_LINK_IDLE;
+	k->tx_seq   = (k->tx_seq + 1u) & LED_LINK_SEQ;
+}
+
+int led_link_recv(led_link_t *k, uint8_t *data, size_t length) {
+	assert(k);
+	assert(data || length == 0);
+	if (!k->rx_full || k->rx_tune)
+		return -1;
+	const size_t n = k->rx_n < length ? k->rx_n : length;
+	memcpy(data, k->rx, n);
+	k->rx_full = 0;
+	return k->rx_n;
+}
+
+int led_link_busy(const led_link_t *k) {
+	assert(k);
+	return k->tx_state != LED_LINK_IDLE;
+}
+
+/* The timings for a bit period are worked out from how long the LED takes
+ * to discharge when lit, 'lit_us', and in the dark, 'dark_us'. Readings are
+ * cut off at the end of the period less the time to charge, a space lights
+ * the LED for long enough that its reading falls halfway between a mark's
+ * and that cut off, on a logarithmic scale, and the thresholds are halfway
+ * between those. A mark stays lit halfway through what the lit discharge
+ * leaves of the window, so a reading that starts late still sees it as a
+ * mark rather than as one that started early. Periods that leave less than
+ * twice the lit discharge time to read in, or a dark discharge that short,
+ * are too close to tell apart. 's' keeps its time to charge. */
+int led_sensor_derive(led_sensor_t *s, unsigned lit_us, unsigned dark_us, unsigned period_us) {
+	assert(s);
+	const unsigned long charge = s->rx_charge_us;
+	if (period_us <= charge)
+		return -1;
+	const unsigned long lit = lit_us, window = period_us - charge;
+	const unsigned long top = dark_us < window ? dark_us : window;
+	if (lit == 0 || top < 2u * lit)
+		return -1;
+	const unsigned long space = led_isqrt(lit * top);
+	s->tx_mark_us   = charge + lit + ((window - lit) / 2u);
+	s->tx_space_us  = charge + (((dark_us - space) * lit) / (dark_us - lit));
+	s->tx_period_us = period_us;
+	s->rx_sample_us = window;
+	s->rx_mark_us   = led_isqrt(lit * space);
+	s->rx_dark_us   = led_isqrt(space * top);
+	return 0;
+}
+
+enum {
+	LED_TUNE_IDLE,
+	LED_TUNE_ASK,     /* lit, asking the other end to calibrate */
+	LED_TUNE_TURN,    /* waiting for the period boundary to change profile on */
+	LED_TUNE_SLOTS,   /* measuring, or lit for the other end to measure */
+	LED_TUNE_REPLY,   /* sending what was measured back */
+	LED_TUNE_RESULTS, /* waiting for what the other end measured */
+	LED_TUNE_WAIT,    /* waiting to be told which period to try or keep */
+	LED_TUNE_OFFER,   /* telling the other end which period to try */
+	LED_TUNE_OFFERED,
+	LED_TUNE_TRY,     /* trying it out, until both ends go back */
+	LED_TUNE_SETTLE,  /* telling the other end which period to keep */
+	LED_TUNE_SETTLED,
+	LED_TUNE_STOPPED, /* deaf to beacons until the other end has given up */
+};
+
+/* The first byte of each frame */
+enum { LED_TUNE_RESULT = 'R', LED_TUNE_PERIOD = 'T', LED_TUNE_PROBE_FRAME = 'P' };
+
+/* Periods long enough to send the probes and have them acknowledged, with
+ * some to spare, after which both ends go back to the period known to work */
+#define LED_TUNE_TRIAL ((LED_TUNE_PROBES * (LED_TUNE_PROBE + (2u * LED_LINK_OVERHEAD) + 2u) * 9uL * 5uL) / 4uL)
+
+void led_tune_init(led_tune_t *u, led_link_t *k, led_sensor_t *profile) {
+	assert(u);
+	assert(k);
+	assert(profile);
+	memset(u, 0, sizeof *u);
+	u->link    = k;
+	u->profile = profile;
+	u->good    = *profile;
+}
+
+static int led_tune_send(led_tune_t *u, const uint8_t *m, size_t length) {
+	u->frames = u->link->frames;
+	u->acked  = u->link->acked;
+	return led_link_queue(u->link, LED_LINK_TUNE, m, length);
+}
+
+static int led_tune_sent(const led_tune_t *u) { /* the last frame was acknowledged */
+	return u->link->acked != u->acked;
+}
+
+static void led_tune_put16(uint8_t *m, unsigned v) {
+	m[0] = v;
+	m[1] = v >> 8;
+}
+
+static unsigned led_tune_get16(const uint8_t *m) {
+	return m[0] | ((unsigned)m[1] << 8);
+}
+
+static unsigned led_tune_median(led_trx_t *t) {
+	const uint8_t n = t->cal_n;
+	for (uint8_t i = 1; i < n; i++)
+		for (uint8_t j = i; j > 0 && t->cal[j - 1] > t->cal[j]; j--) {
+			const uint16_t v = t->cal[j];
+			t->cal[j]     = t->cal[j - 1];
+			t->cal[j - 1] = v;
+		}
+	return n ? t->cal[n / 2u] : 0;
+}
+
+/* The end that started it changes profile once the transceiver has started
+ * the period after the one the acknowledgement was received in, or after
+ * the first dark one after the beacon, the other end once it has sent the
+ * acknowledgement, in the dark period after it, or once it has seen the
+ * beacon end, in the period after the first dark one, so both change in
+ * the same period, for it to take effect from the start of the next. */
+static void led_tune_turn(led_tune_t *u, unsigned long periods) {
+	u->start = periods;
+	u->state = LED_TUNE_TURN;
+}
+
+static void led_tune_period(led_tune_t *u, unsigned good_us, unsigned trial_us) {
+	uint8_t m[9] = { LED_TUNE_PERIOD };
+	led_tune_put16(&m[1], u->lit_us);
+	led_tune_put16(&m[3], u->dark_us);
+	led_tune_put16(&m[5], good_us);
+	led_tune_put16(&m[7], trial_us);
+	if (led_tune_send(u, m, sizeof m) == 0)
+		u->state = trial_us ? LED_TUNE_OFFERED : LED_TUNE_SETTLED;
+}
+
+static void led_tune_receive(led_tune_t *u) {
+	led_link_t *k = u->link;
+	const uint8_t *m = k->rx, n = k->rx_n;
+	k->rx_full = 0;
+	if (n == 0)
+		return;
+	switch (m[0]) {
+	case LED_TUNE_RESULT: {
+		if (!u->starter || u->state != LED_TUNE_RESULTS || n != 5)
+			return;
+		const unsigned lit = led_tune_get16(&m[1]), dark = led_tune_get16(&m[3]);
+		led_sensor_t trial = u->good; /* gone back to, as the other end will */
+		u->lit_us    = lit  > u->lit_us  ? lit  : u->lit_us;
+		u->dark_us   = dark < u->dark_us ? dark : u->dark_us;
+		if (led_sensor_derive(&trial, u->lit_us, u->dark_us, u->good.tx_period_us) == 0)
+			u->good = trial;
+		u->period_us = trial.rx_charge_us + (4u * u->lit_us);
+		u->state     = led_sensor_derive(&trial, u->lit_us, u->dark_us, u->period_us) < 0 ? LED_TUNE_SETTLE : LED_TUNE_OFFER;
+		return;
+	}
+	case LED_TUNE_PERIOD: {
+		if (u->starter || u->state != LED_TUNE_WAIT || n != 9)
+			return;
+		led_sensor_t s = u->good;
+		u->lit_us    = led_tune_get16(&m[1]);
+		u->dark_us   = led_tune_get16(&m[3]);
+		u->period_us = led_tune_get16(&m[7]);
+		u->slot      = 1; /* turn to the period being tried, not to calibrating */
+		if (led_sensor_derive(&s, u->lit_us, u->dark_us, led_tune_get16(&m[5])) == 0)
+			u->good = s;
+		led_tune_turn(u, k->trx->periods);
+		return;
+	}
+	}
+}
+
+int led_tune_start(led_tune_t *u) {
+	assert(u);
+	led_trx_t *t = u->link->trx;
+	if (u->state != LED_TUNE_IDLE)
+		return -1;
+	u->good      = *u->profile;
+	u->starter   = 1;
+	u->stopping  = 0;
+	u->bps       = 0;
+	u->slot      = 0;
+	u->failed_us = 0;
+	u->start     = t->periods;
+	u->state     = LED_TUNE_ASK;
+	t->beacon    = 1;
+	return 0;
+}
+
+/* Polls the link as well, taking the frames meant for it. The end that did
+ * not start it is done when told which period to keep. */
+int led_tune_poll(led_tune_t *u, unsigned long ms) {
+	assert(u);
+	led_link_t *k = u->link;
+	led_trx_t *t = k->trx;
+	led_link_poll(k, ms);
+	if (k->rx_full && k->rx_tune)
+		led_tune_receive(u);
+	if (u->state != LED_TUNE_IDLE) /* the traffic of a failed trial can look like one */
+		t->beaconed = 0;
+	switch (u->state) {
+	case LED_TUNE_IDLE:
+		if (!t->beaconed)
+			break;
+		t->beaconed = 0;
+		u->good     = *u->profile;
+		u->starter  = 0;
+		u->stopping = 0;
+		u->bps      = 0;
+		u->slot     = 0;
+		led_tune_turn(u, t->periods);
+		break;
+	case LED_TUNE_ASK: /* the beacon is two slots, after the period it starts in */
+		if ((t->periods - u->start) <= (2u * LED_TUNE_SLOT))
+			break;
+		t->beacon = 0;
+		led_tune_turn(u, t->periods + 1u);
+		break;
+	case LED_TUNE_OFFERED:
+	case LED_TUNE_SETTLED:
+		if (led_link_busy(k))
+			break;
+		if (u->state == LED_TUNE_SETTLED)
+			u->period_us = 0;
+		if (led_tune_sent(u)) {
+			led_tune_turn(u, t->periods);
+			break;
+		}
+		if (u->state == LED_TUNE_OFFERED) { /* if the other end got it, it goes back */
+			u->state = LED_TUNE_SETTLE;
+			break;
+		}
+		led_sensor_set(u->profile, &u->good); /* kept for now, but not agreed */
+		u->state = LED_TUNE_IDLE;
+		return -1;
+	case LED_TUNE_TURN: {
+		const int ready = u->starter ? (long)(t->periods - u->start) > 0 : !(k->ack || k->out_i != k->out_n || led_trx_busy(t));
+		if (!ready)
+			break;
+		u->start    = t->periods;
+		u->start_ms = ms;
+		if (u->slot == 0) { /* calibrate */
+			led_sensor_t s;
+			led_sensor_load(&s, &led_sensor_light_level);
+			led_sensor_set(u->profile, &s);
+			t->cal_n = 0;
+			u->state = LED_TUNE_SLOTS;
+			break;
+		}
+		if (u->period_us == 0) { /* done */
+			led_sensor_set(u->profile, &u->good);
+			u->state = LED_TUNE_IDLE;
+			return 1;
+		}
+		led_sensor_t s = u->good;
+		led_sensor_derive(&s, u->lit_us, u->dark_us, u->period_us);
+		led_sensor_set(u->profile, &s);
+		u->probes = 0;
+		u->passed = 0;
+		u->frames = k->frames;
+		u->acked  = k->acked;
+		u->state  = LED_TUNE_TRY;
+		break;
+	}
+	case LED_TUNE_SLOTS: { /* the first period of each is for the next to take effect */
+		const unsigned long elapsed = t->periods - u->start, within = elapsed % LED_TUNE_SLOT;
+		const uint8_t slot = elapsed / LED_TUNE_SLOT;
+		if (slot != u->slot) {
+			t->measure = 0;
+			if (u->slot == 0)
+				u->dark_us = led_tune_median(t);
+			else if (u->slot == (u->starter ? 1u : 2u))
+				u->lit_us = led_tune_median(t);
+			t->cal_n = 0;
+			u->slot  = slot;
+		}
+		if (slot >= 3) {
+			led_sensor_t s = u->good;
+			t->beacon   = 0;
+			u->start_ms = ms;
+			u->state    = u->starter ? LED_TUNE_RESULTS : LED_TUNE_REPLY;
+			if (u->stopping) { /* after leaving the calibration as the other end will */
+				u->start = t->periods;
+				u->state = LED_TUNE_STOPPED;
+			}
+			if (led_sensor_derive(&s, u->lit_us, u->dark_us, LED_TUNE_BOOT_US) < 0) {
+				led_sensor_set(u->profile, &u->good);
+				if (u->stopping)
+					break;
+				u->state = LED_TUNE_IDLE;
+				return -1;
+			}
+			u->good = s;
+			led_sensor_set(u->profile, &u->good);
+			break;
+		}
+		const int measuring = slot == 0 || slot == (u->starter ? 1u : 2u);
+		t->beacon  = !measuring && within < LED_TUNE_SLOT - 1u;
+		t->measure = measuring && within >= 2u;
+		break;
+	}
+	case LED_TUNE_REPLY: {
+		uint8_t m[5] = { LED_TUNE_RESULT };
+		led_tune_put16(&m[1], u->lit_us);
+		led_tune_put16(&m[3], u->dark_us);
+		if (led_tune_send(u, m, sizeof m) == 0) {
+			u->start_ms = ms;
+			u->state    = LED_TUNE_WAIT;
+		}
+		break;
+	}
+	case LED_TUNE_RESULTS: /* long enough for the reply to be sent as many times as it can be */
+	case LED_TUNE_WAIT:
+		if ((ms - u->start_ms) < (LED_LINK_TRIES + 1uL) * 2uL * led_link_timeout(k))
+			break;
+		led_sensor_set(u->profile, &u->good); /* kept for now, but not agreed */
+		u->state = LED_TUNE_IDLE;
+		return -1;
+	case LED_TUNE_STOPPED: /* for as long as the other end might wait, or try a period, before it gives up */
+		if ((ms - u->start_ms) >= (LED_LINK_TRIES + 1uL) * 2uL * led_link_timeout(k) && (t->periods - u->start) >= LED_TUNE_TRIAL)
+			u->state = LED_TUNE_IDLE;
+		break;
+	case LED_TUNE_OFFER: /* after a trial, once the other end has surely gone back too */
+		if ((t->periods - u->start) < 2u)
+			break;
+		led_tune_period(u, u->good.tx_period_us, u->period_us);
+		break;
+	case LED_TUNE_TRY:
+		if (u->starter && u->probes <= LED_TUNE_PROBES) {
+			if (led_link_busy(k)) {
+				if (k->tries > 1) { /* an error, so that is too quick */
+					led_link_cancel(k);
+					u->probes = LED_TUNE_PROBES + 1u;
+				}
+			} else if ((uint8_t)(k->frames - u->frames) != (uint8_t)(k->acked - u->acked)) {
+				u->probes = LED_TUNE_PROBES + 1u;
+			} else if (u->probes < LED_TUNE_PROBES) {
+				uint8_t m[LED_TUNE_PROBE] = { LED_TUNE_PROBE_FRAME };
+				for (size_t i = 1; i < sizeof m; i++)
+					m[i] = (u->probes * LED_TUNE_PROBE) + (i * 37u);
+				if (led_link_queue(k, LED_LINK_TUNE, m, sizeof m) == 0)
+					u->probes++;
+			} else {
+				u->passed = 1;
+				u->probes = LED_TUNE_PROBES + 1u;
+				u->bps    = ((LED_TUNE_PROBES * LED_TUNE_PROBE * 8uL) * 1000uL) / ((ms - u->start_ms) + 1uL);
+			}
+		}
+		if ((t->periods - u->start) < LED_TUNE_TRIAL)
+			break;
+		led_sensor_set(u->profile, &u->good);
+		u->start_ms = ms;
+		if (!u->starter) {
+			u->state = LED_TUNE_WAIT;
+			break;
+		}
+		u->state = LED_TUNE_SETTLE;
+		u->start = t->periods;
+		if (u->passed) /* the other end is told of it with the next offer */
+			led_sensor_derive(&u->good, u->lit_us, u->dark_us, u->period_us);
+		else
+			u->failed_us = u->period_us;
+		{ /* an eighth quicker, or halfway to one that failed, until that is within an eighth */
+			const unsigned good = u->good.tx_period_us;
+			const unsigned next = u->failed_us ? good - ((good - u->failed_us) / 2u) : good - (good / 8u);
+			led_sensor_t s = u->good;
+			if ((good - next) >= (good / 16u) && led_sensor_derive(&s, u->lit_us, u->dark_us, next) == 0) {
+				u->period_us = next;
+				u->state     = LED_TUNE_OFFER;
+			}
+		}
+		break;
+	case LED_TUNE_SETTLE:
+		if ((t->periods - u->start) < 2u)
+			break;
+		led_tune_period(u, u->good.tx_period_us, 0);
+		break;
+	}
+	return 0;
+}
+
+int led_tune_busy(const led_tune_t *u) {
+	assert(u);
+	return u->state != LED_TUNE_IDLE;
+}
+
+void led_tune_stop(led_tune_t *u, unsigned long ms) {
+	assert(u);
+	led_trx_t *t = u->link->trx;
+	if (u->state == LED_TUNE_IDLE || u->state == LED_TUNE_STOPPED)
+		return;
+	const int calibrating = u->state == LED_TUNE_ASK || u->state == LED_TUNE_SLOTS || (u->state == LED_TUNE_TURN && u->slot == 0);
+	if (calibrating) { /* it keeps to the periods, so is seen out */
+		u->stopping = 1;
+		return;
+	}
+	led_link_cancel(u->link);
+	u->start    = t->periods;
+	u->start_ms = ms;
+	u->state    = LED_TUNE_STOPPED;
+	led_sensor_set(u->profile, &u->good);
+}
+
+#ifdef LED_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The transceivers are ticked as Timer 2 overflowing would tick them, every
+ * 128us, each device being out of step with the other by 'phase'. The cost
+ * of the interrupt on an ATmega328P is estimated for a tick that only checks
+ * the time and for one that starts a phase, which at most queues a reading
+ * and moves the period, to give the load on the processor, where sending
+ * with 'led_send' took all of it. Decoding a reading, outside of the
+ * interrupt, takes some five 32-bit divisions to track the sender, and the
+ * levels learnt at the end of a byte are spread over its readings. */
+#define TEST_TICK_US       (128u)
+#define TEST_IDLE_CYCLES   (60u)
+#define TEST_BUSY_CYCLES   (400u)
+#define TEST_DECODE_CYCLES (5000u)
+#define TEST_CPU_HZ        (16e6)
+
+/* Receivers are left listening for long enough to wait for light once and
+ * read how long the dark takes before anything is sent to them */
+#define TEST_LEAD_US (100000u)
+
+typedef struct {
+	led_t led;
+	led_trx_t trx;
+	uint32_t phase;
+	int on;              /* emitting, as last seen */
+	uint32_t emitted[512]; /* times the light went on and off */
+	size_t e;
+	const uint8_t *msg;  /* to send, queued as there is room */
+	size_t n, queued;
+	uint8_t got[64];     /* received, as it is */
+	size_t g;
+	led_link_t link;     /* takes what is received instead, if 'linked' */
+	int linked;
+	led_sensor_t profile;
+	led_tune_t tune;
+} test_device_t;
+
+static void test_run(test_device_t *d, size_t n, uint32_t us) {
+	for (uint32_t i = 0; i < us; i++) {
+		for (size_t j = 0; j < n; j++) {
+			while (d[j].queued < d[j].n && led_trx_put(&d[j].trx, d[j].msg[d[j].queued]))
+				d[j].queued++;
+			for (int c; !d[j].linked && (led_clock % 1000u) == 0 && d[j].g < sizeof d[j].got && (c = led_trx_get(&d[j].trx)) >= 0; )
+				d[j].got[d[j].g++] = c;
+			if (((led_clock + d[j].phase) % TEST_TICK_US) == 0 || led_clock == d[j].trx.wake)
+				led_trx_tick(&d[j].trx);
+			const int on = d[j].led.mode == LED_MODE_EMIT_E;
+			if (on != d[j].on && d[j].e < sizeof(d[j].emitted) / sizeof(d[j].emitted[0]))
+				d[j].emitted[d[j].e++] = led_clock;
+			d[j].on = on;
+		}
+		led_sim_step();
+	}
+}
+
+static void test_device(test_device_t *d, unsigned anode, uint32_t phase) {
+	memset(d, 0, sizeof *d);
+	d->profile = led_sensor_communications;
+	led_init(&d->led, anode, anode, &d->profile);
+	led_trx_init(&d->trx, &d->led);
+	d->phase = phase;
+}
+
+/* Each bit must be lit for as long as it should be, and start when it
+ * should, to within a tick, with no drift over the message, after a start
+ * pulse as long as a mark */
+static int test_timing(FILE *out, const uint8_t *msg, size_t n) {
+	static test_device_t d;
+	const led_sensor_t *s = &led_sensor_communications;
+	led_clock = 0;
+	test_device(&d, 0, 0);
+	d.msg = msg;
+	d.n   = n;
+	test_run(&d, 1, TEST_LEAD_US + ((n * 9u + 3u) * s->tx_period_us));
+	int r = d.e == (n * 16u) + 2u ? 0 : -1;
+	long worst = r ? 0 : labs((long)(d.emitted[1] - d.emitted[0]) - (long)s->tx_mark_us);
+	r = worst > (long)TEST_TICK_US ? -1 : r;
+	for (size_t i = 0; !r && i < n * 8u; i++) {
+		const int bit = (msg[i / 8u] >> (i % 8u)) & 1u;
+		const uint32_t *e = &d.emitted[(i * 2) + 2];
+		const long lit = (long)(e[1] - e[0]) - (long)(bit ? s->tx_mark_us : s->tx_space_us);
+		const long start = (long)(e[0] - d.emitted[0]) - (long)((i + (i / 8u) + 1u) * s->tx_period_us);
+		worst = labs(lit) > worst ? labs(lit) : worst;
+		worst = labs(start) > worst ? labs(start) : worst;
+		if (labs(lit) > (long)TEST_TICK_US || labs(start) > (long)TEST_TICK_US)
+			r = -1;
+	}
+	const double seconds = led_clock / 1e6;
+	const double load = ((d.trx.ticks * TEST_IDLE_CYCLES) + (d.trx.busy * (TEST_BUSY_CYCLES - TEST_IDLE_CYCLES))) / (seconds * TEST_CPU_HZ);
+	fprintf(out, "timing, %u bytes, %u edges, out by at most %ldus, %s\n", (unsigned)n, (unsigned)d.e, worst, r ? "wrong" : "correct");
+	fprintf(out, "load, sending, %lu ticks, %lu starting a phase, %.1f%% of the processor, was 100%%\n",
+			d.trx.ticks, d.trx.busy, load * 100.0);
+	return r;
+}
+
+/* One device sends to another whose readings start 'offset' into each of
+ * its periods */
+static size_t test_transfer(FILE *load, const uint8_t *msg, size_t n, uint32_t offset, uint32_t phase) {
+	static test_device_t d[2];
+	const led_sensor_t *s = &led_sensor_communications;
+	size_t right = 0;
+	led_clock = 0;
+	test_device(&d[1], 1, phase);
+	test_run(&d[1], 1, TEST_LEAD_US + offset);
+	test_device(&d[0], 0, 0);
+	d[0].msg = msg;
+	d[0].n   = n;
+	test_run(d, 2, (n * 9u + 4u) * s->tx_period_us);
+	for (size_t i = 0; i < n && i < d[1].g; i++)
+		right += d[1].got[i] == msg[i];
+	if (load) { /* of the receiver, decoding at most a reading a period */
+		const led_trx_t *t = &d[1].trx;
+		const double cycles = led_clock * (TEST_CPU_HZ / 1e6);
+		fprintf(load, "load, receiving, %lu ticks, %lu starting a phase, %.1f%% of the processor in the interrupt and %.1f%% decoding\n",
+				t->ticks, t->busy, ((t->ticks * TEST_IDLE_CYCLES) + (t->busy * (TEST_BUSY_CYCLES - TEST_IDLE_CYCLES))) * 100.0 / cycles,
+				(t->periods * TEST_DECODE_CYCLES) * 100.0 / cycles);
+	}
+	return right;
+}
+
+/* One device sends 'count' frames of 'length' bytes to another through a
+ * channel with 'noise' in it, each end polling its link every millisecond.
+ * Every frame passed on must be one that was sent, in order, and none
+ * twice. The frame error rate is of the data frames sent that were not
+ * acknowledged, the goodput the payload passed on a second. */
+static int test_link(FILE *out, double noise, size_t count, size_t length) {
+	static test_device_t d[2];
+	uint8_t sent[LED_LINK_MAX], got[LED_LINK_MAX];
+	size_t queued = 0, passed = 0, wrong = 0;
+	uint32_t seed = 7, checked = 7; /* the payloads sent, and those expected */
+	led_clock     = 0;
+	led_sim_seed  = 1;
+	led_sim_noise = noise;
+	for (int i = 0; i < 2; i++) {
+		test_device(&d[i], i, 0);
+		led_link_init(&d[i].link, &d[i].trx);
+		d[i].linked = 1;
+	}
+	while (led_clock < 600000000ul && (queued < count || led_link_busy(&d[0].link))) {
+		if (queued < count && !led_link_busy(&d[0].link)) {
+			for (size_t i = 0; i < length; i++)
+				sent[i] = (seed = (seed * 1103515245u) + 12345u) >> 16;
+			if (led_link_send(&d[0].link, sent, length) == 0)
+				queued++;
+		}
+		test_run(d, 2, 1000u);
+		led_link_poll(&d[0].link, led_clock / 1000u);
+		led_link_poll(&d[1].link, led_clock / 1000u);
+		const int n = led_link_recv(&d[1].link, got, sizeof got);
+		if (n < 0)
+			continue;
+		/* frames given up on are skipped over, the next is expected */
+		size_t skip = 0;
+		for (; skip < count; skip++) {
+			uint32_t s = checked;
+			int same = n == (int)length;
+			for (size_t i = 0; i < length; i++)
+				same &= got[i] == (uint8_t)((s = (s * 1103515245u) + 12345u) >> 16);
+			checked = s;
+			if (same)
+				break;
+		}
+		passed++;
+		wrong += skip == count;
+	}
+	const led_link_t *k = &d[0].link;
+	const double seconds = led_clock / 1e6;
+	const double fer = k->frames ? (double)(k->frames - k->acked) / k->frames : 0;
+	fprintf(out, "link, noise %4.1f%%, %3u frames sent, %3u acknowledged, %2lu given up, %3u passed on, %lu duplicates, %3lu bad, FER %5.1f%%, %5.1f bits/s\n",
+			noise * 100.0, (unsigned)k->frames, (unsigned)k->acked, k->failed, (unsigned)passed, d[1].link.duplicates, d[1].link.bad + k->bad,
+			fer * 100.0, (passed * length * 8.0) / seconds);
+	led_sim_noise = 0;
+	if (wrong || passed != d[1].link.received || passed > count)
+		return -1;
+	return noise > 0 || (passed == count && k->frames == count) ? 0 : -1;
+}
+
+/* Both ends are calibrated and tuned for a pair of LEDs discharging in
+ * 'lit_us' lit and 'dark_us' in the dark, which must be measured to within
+ * a tenth, with both ends keeping the same bit period, which must then be
+ * able to carry frames. An end only saves the period once it knows the other
+ * settled on it, which it need not when the last frames are lost. Given 'stop_ms', the tune is stopped that far into
+ * it and started again once both ends have given up on it. */
+static int test_tune(FILE *out, double lit_us, double dark_us, double noise, unsigned long stop_ms) {
+	static test_device_t d[2];
+	int r[2] = { 0, 0 };
+	led_clock       = 0;
+	led_sim_seed    = 1;
+	led_sim_noise   = noise;
+	led_sim_lit_us  = lit_us;
+	led_sim_dark_us = dark_us;
+	for (int i = 0; i < 2; i++) {
+		test_device(&d[i], i, 0);
+		led_link_init(&d[i].link, &d[i].trx);
+		led_tune_init(&d[i].tune, &d[i].link, &d[i].profile);
+		d[i].linked = 1;
+	}
+	int bad = led_tune_start(&d[0].tune) < 0;
+	while (!bad && stop_ms && led_clock < 600000000ul) {
+		test_run(d, 2, 1000u);
+		if ((led_clock / 1000u) == stop_ms) {
+			led_tune_stop(&d[0].tune, stop_ms);
+			bad = led_tune_start(&d[0].tune) == 0;
+		}
+		if ((led_clock / 1000u) > stop_ms && !led_tune_busy(&d[0].tune) && !led_tune_busy(&d[1].tune)) {
+			bad = led_tune_start(&d[0].tune) < 0;
+			break;
+		}
+		led_tune_poll(&d[0].tune, led_clock / 1000u);
+		led_tune_poll(&d[1].tune, led_clock / 1000u);
+	}
+	while (!bad && led_clock < 600000000ul && (!r[0] || !r[1])) {
+		test_run(d, 2, 1000u);
+		for (int i = 0; i < 2; i++) {
+			const int p = led_tune_poll(&d[i].tune, led_clock / 1000u);
+			r[i] = p ? p : r[i];
+		}
+	}
+	const led_tune_t *u = &d[0].tune;
+	const led_sensor_t *s = &d[0].profile;
+	const double seconds = led_clock / 1e6;
+	bad |= memcmp(&d[0].profile, &d[1].profile, sizeof *s) != 0;
+	bad |= (u->lit_us  - lit_us)  * (u->lit_us  - lit_us)  > (lit_us  * lit_us)  / 100.0;
+	bad |= (u->dark_us - dark_us) * (u->dark_us - dark_us) > (dark_us * dark_us) / 100.0;
+	/* and frames go over it */
+	size_t passed = 0;
+	uint8_t frame[LED_LINK_MAX] = "tuned";
+	const uint32_t begin = led_clock;
+	for (size_t sent = 0; !bad && (led_clock - begin) < 60000000ul && passed < 8; ) {
+		if (!led_link_busy(&d[0].link) && sent < 8 && led_link_send(&d[0].link, frame, 16) == 0)
+			sent++;
+		test_run(d, 2, 1000u);
+		led_link_poll(&d[0].link, led_clock / 1000u);
+		led_link_poll(&d[1].link, led_clock / 1000u);
+		uint8_t got[LED_LINK_MAX];
+		if (led_link_recv(&d[1].link, got, sizeof got) == 16 && !memcmp(got, frame, 16))
+			passed++;
+	}
+	bad |= passed < 8;
+	char stopped[32] = "not stopped,";
+	if (stop_ms)
+		snprintf(stopped, sizeof stopped, "stopped after %4lums,", stop_ms);
+	fprintf(out, "tune, LEDs %5.0fus lit, %5.0fus dark, noise %3.1f%%, %-20s measured %5uus and %5uus, in %4.1fs,", lit_us, dark_us,
+			noise * 100.0, stopped, u->lit_us, u->dark_us, seconds);
+	static const char *saved[] = { "by neither,", "by one end,", "by both," };
+	fprintf(out, " period %uus saved %-11s %3.0f bits/s on the line, %3lu bits/s of frames, %u/8 frames after, %s\n",
+			s->tx_period_us, saved[(r[0] > 0) + (r[1] > 0)], 8e6 / (9.0 * s->tx_period_us), u->bps, (unsigned)passed, bad ? "wrong" : "correct");
+	led_sim_noise   = 0;
+	led_sim_lit_us  = 2000.0;
+	led_sim_dark_us = 16000.0;
+	return bad ? -1 : 0;
+}
+
+/* A capture is the light a sender gave, as the times it went on and off,
+ * and the bytes it sent. It holds the light rather than the readings taken
+ * of it so that it can be replayed to a receiver that moves its readings,
+ * the simulation turning the light into discharges. Captures are made here
+ * by a sender whose clock runs 'drift' fast and whose bits start 'offset'
+ * into the receiver's periods, after it has been left to read the dark and,
+ * if 'pulse' is set, after a start pulse, or read from a file, a line of the bytes
+ * sent in hex and then a line for each time the light was on, when it went
+ * on and when it went off, in microseconds. */
+#define TEST_CAPTURE_BYTES (64u)
+
+typedef struct {
+	uint8_t sent[TEST_CAPTURE_BYTES];
+	size_t n;
+	uint32_t edge[(TEST_CAPTURE_BYTES * 16u) + 2u];
+	size_t e;
+} test_capture_t;
+
+static void test_bytes(uint8_t *msg, size_t n) {
+	uint32_t seed = 11;
+	for (size_t i = 0; i < n; i++)
+		msg[i] = (seed = (seed * 1103515245u) + 12345u) >> 16;
+}
+
+static void test_capture(test_capture_t *c, const uint8_t *msg, size_t n, uint32_t offset, double drift, int pulse) {
+	const led_sensor_t *s = &led_sensor_communications;
+	const double scale = 1.0 + drift;
+	memset(c, 0, sizeof *c);
+	offset += TEST_LEAD_US + s->tx_period_us;
+	if (pulse) {
+		const double start = offset - (s->tx_period_us * scale);
+		c->edge[c->e++] = start + 0.5;
+		c->edge[c->e++] = start + (s->tx_mark_us * scale) + 0.5;
+	}
+	for (; c->n < n && c->n < TEST_CAPTURE_BYTES; c->n++) {
+		c->sent[c->n] = msg[c->n];
+		for (unsigned b = 0; b < 8u; b++) {
+			const double start = offset + ((((c->n * 9u) + b) * s->tx_period_us) * scale);
+			const unsigned lit = (msg[c->n] >> b) & 1u ? s->tx_mark_us : s->tx_space_us;
+			c->edge[c->e++] = start + 0.5;
+			c->edge[c->e++] = start + (lit * scale) + 0.5;
+		}
+	}
+}
+
+static int test_capture_write(const test_capture_t *c, const char *file) {
+	FILE *f = fopen(file, "wb");
+	if (!f)
+		return -1;
+	for (size_t i = 0; i < c->n; i++)
+		fprintf(f, "%02x%s", c->sent[i], i + 1u < c->n ? " " : "\n");
+	for (size_t i = 0; i + 1u < c->e; i += 2)
+		fprintf(f, "%lu %lu\n", (unsigned long)c->edge[i], (unsigned long)c->edge[i + 1u]);
+	return fclose(f) < 0 ? -1 : 0;
+}
+
+static int test_capture_read(test_capture_t *c, const char *file) {
+	FILE *f = fopen(file, "rb");
+	if (!f)
+		return -1;
+	memset(c, 0, sizeof *c);
+	int r = 0, ch = 0;
+	unsigned byte = 0;
+	unsigned long on = 0, off = 0;
+	while (c->n < TEST_CAPTURE_BYTES && fscanf(f, "%x", &byte) == 1) {
+		c->sent[c->n++] = byte;
+		while ((ch = fgetc(f)) == ' ')
+			;
+		if (ch == '\n' || ch == EOF)
+			break;
+		ungetc(ch, f);
+	}
+	while (fscanf(f, "%lu %lu", &on, &off) == 2) {
+		if (c->e + 2u > sizeof(c->edge) / sizeof(c->edge[0]) || off < on || (c->e && on < c->edge[c->e - 1u])) {
+			r = -1;
+			break;
+		}
+		c->edge[c->e++] = on;
+		c->edge[c->e++] = off;
+	}
+	if (!feof(f) || c->n == 0)
+		r = -1;
+	fclose(f);
+	return r;
+}
+
+/* The light is shone at a receiver using the adaptive decoder or, with
+ * 'adapt' cleared, the fixed thresholds and periods it had before, and the
+ * bytes it gets compared with those sent, in order, a byte missing or extra
+ * counting as eight bits wrong, giving the bit error rate */
+static double test_replay(const test_capture_t *c, int adapt) {
+	static test_device_t d;
+	static led_t light;
+	led_clock = 0;
+	led_sim_seed = 1;
+	led_init(&light, 0, 0, &led_sensor_communications);
+	led_mode(&light, LED_MODE_REVERSE_BIAS_E);
+	test_device(&d, 1, 0);
+	d.trx.adapt = adapt;
+	for (size_t i = 0; i < c->e; i++) {
+		test_run(&d, 1, c->edge[i] - led_clock);
+		led_mode(&light, i & 1u ? LED_MODE_REVERSE_BIAS_E : LED_MODE_EMIT_E);
+	}
+	test_run(&d, 1, 2u * led_sensor_communications.tx_period_us);
+	unsigned long wrong = 8ul * (d.g > c->n ? d.g - c->n : c->n - d.g);
+	for (size_t i = 0; i < c->n && i < d.g; i++)
+		for (uint8_t x = c->sent[i] ^ d.got[i]; x; x &= x - 1u)
+			wrong++;
+	return c->n ? (double)wrong / (8.0 * c->n) : 0;
+}
+
+/* Captures of bytes sent with clocks out by up to 1% and with the readings
+ * out of step, 'late' after the bits start or before them when negative,
+ * are replayed to both decoders, the adaptive one being sent a start pulse
+ * first. The old one must read everything sent in step with it, and the
+ * adaptive one everything sent to it, however far out of step. */
+static int test_replays(FILE *out) {
+	static test_capture_t c;
+	static const double drift[] = { 0, 0.001, 0.005, 0.01 };
+	static const long late[] = { 0, 100, -100, 500, -500, 1000, -1000, 2500, -2500 };
+	const uint32_t period = led_sensor_communications.tx_period_us;
+	uint8_t msg[TEST_CAPTURE_BYTES];
+	int r = 0;
+	test_bytes(msg, sizeof msg);
+	for (size_t i = 0; i < sizeof(drift) / sizeof(drift[0]); i++)
+		for (size_t j = 0; j < sizeof(late) / sizeof(late[0]); j++) {
+			const uint32_t offset = late[j] > 0 ? period - late[j] : -late[j];
+			test_capture(&c, msg, sizeof msg, offset, drift[i], 1);
+			const double now = test_replay(&c, 1);
+			test_capture(&c, msg, sizeof msg, offset, drift[i], 0);
+			const double was = test_replay(&c, 0);
+			fprintf(out, "replay, drift %3.1f%%, readings %+5ldus from the bits, BER %5.3f, was %5.3f\n",
+					drift[i] * 100.0, late[j], now, was);
+			if (now > 0 || (late[j] == 0 && drift[i] == 0 && was > 0))
+				r = -1;
+		}
+	return r;
+}
+
+/* 'led -w file' writes a capture of bytes sent with a clock 0.5% fast,
+ * after a start pulse, and 'led -r file' replays one, perhaps of real LEDs,
+ * to both decoders */
+static int test_file(const char *opt, const char *file) {
+	static test_capture_t c;
+	if (!strcmp(opt, "-w")) {
+		uint8_t msg[TEST_CAPTURE_BYTES];
+		test_bytes(msg, sizeof msg);
+		test_capture(&c, msg, sizeof msg, 0, 0.005, 1);
+		return test_capture_write(&c, file);
+	}
+	if (strcmp(opt, "-r") || test_capture_read(&c, file) < 0)
+		return -1;
+	const double now = test_replay(&c, 1), was = test_replay(&c, 0);
+	fprintf(stdout, "replay, %s, %u bytes, BER %5.3f, was %5.3f\n", file, (unsigned)c.n, now, was);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	static const uint8_t msg[] = "Hello, World! \x00\xFF\x55\xAA";
+	const size_t n = sizeof(msg) - 1u;
+	int r = 0;
+	if (argc == 3)
+		return test_file(argv[1], argv[2]) < 0;
+	if (argc != 1) {
+		fprintf(stderr, "usage: %s [-w|-r capture]\n", argv[0]);
+		return 1;
+	}
+	if (test_timing(stdout, msg, n) < 0)
+		r = 1;
+	for (uint32_t offset = 0; offset < led_sensor_communications.tx_period_us; offset += 500) {
+		const size_t right = test_transfer(offset ? NULL : stdout, msg, n, offset, 0);
+		fprintf(stdout, "transfer, readings %4uus after the bits start, %2u/%u bytes right\n", (unsigned)offset, (unsigned)right, (unsigned)n);
+		if (offset == 0 && right != n)
+			r = 1;
+	}
+	static const double noise[] = { 0, 0.01, 0.02, 0.03, 0.04 };
+	for (size_t i = 0; i < sizeof(noise) / sizeof(noise[0]); i++)
+		if (test_link(stdout, noise[i], 32, 16) < 0)
+			r = 1;
+	if (test_tune(stdout, 2000, 16000, 0, 0) < 0)
+		r = 1;
+	if (test_tune(stdout, 2000, 16000, 0.01, 0) < 0)
+		r = 1;
+	if (test_tune(stdout, 1200, 24000, 0.01, 0) < 0)
+		r = 1;
+	if (test_tune(stdout, 3000, 9000, 0.01, 0) < 0)
+		r = 1;
+	if (test_tune(stdout, 2000, 16000, 0.01, 500) < 0)
+		r = 1;
+	if (test_tune(stdout, 2000, 16000, 0.01, 3000) < 0)
+		r = 1;
+	if (test_replays(stdout) < 0)
+		r = 1;
+	return r;
+}
+#endif
@@ -5,13 +5,16 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef struct {
 	unsigned tx_mark_us,
 		tx_space_us,
 		tx_period_us,
 		rx_charge_us,
-		rx_sample_us;
+		rx_sample_us,
+		rx_mark_us,  /* discharges quicker than this are a mark */
+		rx_dark_us;  /* and slower than this no light at all */
 } led_sensor_t;
 
 typedef enum {
@@ -25,16 +28,222 @@ typedef struct {
 	led_mode_e mode;
 	unsigned cathode,  /* PIN LED Cathode (-, Short Lead) is on */
 		 anode;    /* PIN LED Anode   (+, Long  Lead) is on */
+	/* Registers and bits for the pins, looked up once by 'led_init' */
+	volatile uint8_t *anode_port, *anode_ddr;
+	volatile uint8_t *cathode_port, *cathode_ddr, *cathode_in;
+	volatile uint8_t *pcmsk; /* pin change mask for the cathode, NULL if it has none */
+	uint8_t anode_bit, cathode_bit, pcmsk_bit, pcicr_bit;
+	uint8_t reading;         /* phase of the read in progress */
+	unsigned window;         /* microseconds the discharge is timed for at most */
+	uint32_t start;          /* timer ticks the phase started at */
 } led_t;
 
+int led_init(led_t *l, unsigned anode, unsigned cathode, const led_sensor_t *sensor);
 int led_mode(led_t *l, led_mode_e mode);
 int led_set(led_t *l, const int on);
 unsigned led_read(led_t *l);
+int led_read_start(led_t *l);
+int led_read_done(led_t *l, unsigned *us);
+void led_read_stop(led_t *l);
 int led_send(led_t *l, const uint8_t b);
 int led_send_string(led_t *l, const char *s);
 
-extern const led_sensor_t led_sensor_communications; /**< Use for communications */
-extern const led_sensor_t led_sensor_light_level;    /**< Use for light sensing */
+#define LED_QUEUE (4u)  /**< bytes queued to send, a power of two */
+#define LED_CAL_READINGS (10u) /**< readings kept when measuring, as many as a slot of 'led_tune_t' takes */
+#define LED_BEACON_RUN   (16u) /**< readings of light in a row taken as a beacon, a byte can give eight */
+#define LED_TRX_LEARN    (16u) /**< bytes read before the thresholds are taken from what was read */
+#define LED_TRX_RAW      (8u)  /**< readings queued for decoding, a power of two */
+#define LED_TRX_HUNT_US  (60000u) /**< longest reading taken while waiting for light */
+
+/**@brief A transceiver, sending and receiving bytes on an LED without
+ * blocking, by being ticked regularly from a timer interrupt. Each period
+ * it either emits a bit, on for a mark or space and then dark for the rest
+ * of the period, or takes a reading, charging the LED and timing its
+ * discharge. The bits of a byte are sent least significant first followed
+ * by a dark period, which a reading that sees no light at all takes to be
+ * the start of the next byte. It only sends when it is not part way
+ * through receiving a byte, and unless 'adapt' is cleared a byte that does
+ * not follow straight on from the dark period after the last one waits
+ * until it has been dark for three periods and it has read three in a row,
+ * and is sent after a mark, a start pulse, that is not part of it. The
+ * interrupt only times the periods, frames the readings into bytes by
+ * whether they are dark and queues them in 'raw', they are decoded by
+ * 'led_trx_get', so that has to be called often, every period or so.
+ * Unless 'adapt' is cleared, after two dark readings in a row it waits for
+ * light with readings that are not cut off at the end of a period, and from
+ * how long the one that sees the start pulse takes works out when the light
+ * came on and starts its periods from then. The decoding works out the
+ * thresholds between marks, spaces and the dark by clustering the readings
+ * of bytes that were followed by a dark period, and keeps in step with the
+ * sender by how far the readings of spaces are from where they are aimed
+ * to read between the thresholds, and of marks read early, moving the
+ * periods and changing their length, which it passes back with 'aim' and
+ * 'slope'. As with the Morse code transmitter only the interrupt writes
+ * 'tx_tail' and 'raw_head', and only the caller 'tx_head' and
+ * 'raw_tail'. */
+typedef struct {
+	led_t *led;
+	volatile uint8_t tx[LED_QUEUE];
+	volatile uint8_t tx_head, tx_tail;
+	volatile uint16_t raw[LED_TRX_RAW]; /* readings, in microseconds */
+	volatile uint8_t kind[LED_TRX_RAW]; /* and what the interrupt took each to be */
+	volatile int16_t moved[LED_TRX_RAW]; /* and by how many microseconds its period had been moved */
+	volatile uint8_t raw_head, raw_tail, lost; /* 'lost' when 'raw' was full */
+	uint8_t state;
+	uint16_t tx_byte;          /* byte being sent, after its start pulse */
+	uint8_t tx_bits;           /* bits of it left */
+	uint8_t gap;               /* a dark period is due */
+	uint8_t quiet;             /* dark periods since it was last lit, up to three */
+	uint8_t bits;              /* readings of the byte coming in, eight when it waits for the dark */
+	uint8_t darks;             /* dark readings in a row */
+	uint8_t hunting;           /* the reading is waiting for light */
+	uint32_t emit, end;        /* when the light goes off and the period ends */
+	uint32_t wake;             /* when it next needs ticking, at the latest */
+#ifdef LED_TEST
+	unsigned long ticks, busy; /* ticks, and those that started a phase */
+#endif
+	unsigned long periods;     /* started */
+	volatile uint8_t beacon;   /* stay lit instead of reading, when not sending */
+	volatile uint8_t measure;  /* keep the readings in 'cal' instead of decoding them */
+	volatile uint8_t cal_n;
+	uint16_t cal[LED_CAL_READINGS];
+	uint8_t adapt;             /* learn the levels and follow the sender's clock */
+	uint16_t n;                /* periods read since the start pulse */
+	int32_t shift;             /* sixteenths of a microsecond the periods have been moved by since */
+	/* Written by the decoding with interrupts off, read by the interrupt */
+	int32_t aim;               /* what 'shift' should be, */
+	int16_t slope;             /* and how much that changes each period */
+	unsigned dark_at;          /* readings this long are dark */
+	unsigned dawn;             /* readings waiting for light shorter than this saw some */
+	unsigned lit_us;           /* a reading of light from start to end */
+	uint16_t lead;             /* 256ths of how much later than a reading starts light came on, from how much longer than 'lit_us' it took */
+	/* Decoding */
+	uint8_t rx_byte, rx_bits;  /* byte being received, bits of it so far */
+	uint8_t run;               /* readings of light in a row */
+	volatile uint8_t beaconed; /* a beacon has just ended */
+	uint8_t late;              /* the byte had a reading too late to tell a space from the dark */
+	uint16_t index;            /* of the reading, in periods since the start pulse */
+	uint16_t at;               /* that 'phase' is for */
+	int32_t phase;             /* sixteenths of a microsecond the sender's periods start after these, were they not moved */
+	int16_t drift;             /* and how much that changes each period */
+	int16_t kept;              /* 'drift' after the last byte read cleanly, to start from after a start pulse */
+	uint8_t fits;              /* readings 'phase' and 'drift' have been worked out from */
+	unsigned level[3];         /* of marks, spaces and the dark */
+	unsigned above[3], below[3]; /* how far readings stray from each level */
+	uint8_t learnt;            /* bytes the levels have been learnt from */
+	unsigned rx_mark, rx_dark; /* thresholds between the levels */
+	unsigned from_mark, from_dark; /* the profile's, which the levels started from */
+	unsigned dark_us;          /* a reading of the dark, zero until there has been one */
+	unsigned bit_us[8];        /* readings of the byte being read */
+#ifdef LED_TEST
+	unsigned long slips;       /* bytes not followed by a dark period */
+#endif
+} led_trx_t;
+
+void led_trx_init(led_trx_t *t, led_t *l);
+void led_trx_tick(led_trx_t *t);
+void led_trx_attach(led_trx_t *t); /* tick 't' from the timer interrupt, NULL for none */
+int led_trx_put(led_trx_t *t, uint8_t b); /* one if queued, zero if full */
+int led_trx_get(led_trx_t *t); /* decodes what has been read, byte received, negative if none */
+int led_trx_busy(const led_trx_t *t); /* bytes queued or being sent */
+int led_trx_waiting(const led_trx_t *t); /* readings queued for 'led_trx_get' */
+
+#define LED_LINK_MAX      (16u)   /**< largest payload of a frame */
+#define LED_LINK_TRIES    (4u)    /**< times a frame is sent before it is given up on */
+#define LED_LINK_PREAMBLE (0x55u) /**< lets a receiver settle before the sync byte */
+#define LED_LINK_SYNC     (0x7Eu) /**< starts a frame */
+#define LED_LINK_ACK      (0x80u) /**< set in the control byte of an acknowledgement */
+#define LED_LINK_TUNE     (0x40u) /**< set in the control byte of a frame for 'led_tune_t' */
+#define LED_LINK_SEQ      (0x3Fu) /**< the rest of it is a sequence number */
+#define LED_LINK_OVERHEAD (5u)    /**< preamble, sync, control, length and CRC bytes */
+
+/**@brief A link layer over the transceiver, sending frames of up to
+ * 'LED_LINK_MAX' bytes, each a preamble and sync byte, a control byte
+ * holding a sequence number, a length, the payload and a CRC-8 over the
+ * control byte, length and payload. Every frame received intact is
+ * acknowledged and a frame not acknowledged in time is sent again, up to
+ * 'LED_LINK_TRIES' times, one frame being in flight at once. A frame with
+ * the same sequence number as the last one received is acknowledged but
+ * not passed on, and a frame that arrives before the last has been taken
+ * with 'led_link_recv' is not acknowledged, so it is sent again. Frames
+ * marked with 'LED_LINK_TUNE' are left for 'led_tune_t'. It is not called
+ * from an interrupt, but polled with the time in milliseconds. */
+typedef struct {
+	led_trx_t *trx;
+	uint8_t out_control, out_n, out_i, out_crc; /* frame being queued on 'trx', a byte at a time */
+	uint8_t tx[LED_LINK_MAX], tx_n;        /* payload being sent */
+	uint8_t tx_state, tx_seq, tx_tune, tries;
+	uint8_t ack, ack_seq;                  /* acknowledgement due */
+	unsigned long sent_ms;                 /* when the frame was last sent */
+	uint8_t in_control, in_n, in_i, in_crc, in_state; /* frame being received, its payload going into 'rx' */
+	uint8_t rx[LED_LINK_MAX], rx_n, rx_full, rx_seq, rx_tune;
+	uint8_t frames, acked;                 /* data frames sent and acknowledged, wrapping around */
+#ifdef LED_TEST
+	unsigned long failed;                  /* given up on */
+	unsigned long received, duplicates, bad; /* frames passed on, repeated, failing the CRC */
+#endif
+} led_link_t;
+
+void led_link_init(led_link_t *k, led_trx_t *t);
+void led_link_poll(led_link_t *k, unsigned long ms);
+int led_link_send(led_link_t *k, const uint8_t *data, size_t length); /* zero if queued, negative if busy or too long */
+int led_link_recv(led_link_t *k, uint8_t *data, size_t length); /* length of the frame received, negative if none */
+int led_link_busy(const led_link_t *k); /* a frame is waiting to be acknowledged */
+
+#define LED_TUNE_SLOT    (12u)  /**< periods each step of a calibration takes */
+#define LED_TUNE_BOOT_US (16000u) /**< bit period used to agree on the rest */
+#define LED_TUNE_PROBES  (4u)   /**< frames sent to try out a bit period */
+#define LED_TUNE_PROBE   (16u)  /**< bytes in each */
+
+/**@brief Calibrates the LEDs at both ends of a link and then finds the
+ * quickest bit period that works between them. The end that starts it
+ * lights its LED for longer than any byte could, which the other end sees
+ * whatever profile it is using, and when it goes out, for a slot each, they
+ * both measure how long their LED takes to discharge in the dark, then each
+ * end lights its LED for a slot for the other to measure it lit. Both ends
+ * then change to a slow bit period worked out from what they measured, the
+ * other end sends back what it measured, and from the slowest lit discharge
+ * and the quickest dark one at either end the timings and thresholds for
+ * each period tried are worked out with 'led_sensor_derive', starting slow
+ * and getting an eighth quicker each time, or after one that did not work
+ * halfway back to the quickest that did, until the two are within an eighth
+ * of each other. Both ends change to the new period and back again after a
+ * fixed number of periods in which the end that started sends some frames
+ * over it, and the quickest period that sent them all without an error is
+ * kept. The ends change profile on the same period boundary, counting
+ * periods from the end of the beacon or of the frame that told them to, as
+ * the receiver needs its periods to line up with the sender's, and the end
+ * that started it waits a couple of periods after a trial before sending
+ * again, as the other end's count can be a period behind. The profile
+ * being used, 'profile', is changed as it goes, it should be the one the
+ * transceiver's LED was set up with. */
+typedef struct {
+	led_link_t *link;
+	led_sensor_t *profile;   /* in use by the LED, changed as it goes */
+	led_sensor_t good;       /* quickest known to work, to go back to */
+	uint8_t state, starter;  /* where it is, and whether it started it */
+	uint8_t stopping;        /* once the calibration, which the other end goes through regardless, is over */
+	uint8_t slot;            /* of the calibration */
+	uint8_t probes, passed;  /* sent over the period being tried, and all got through */
+	unsigned lit_us, dark_us;  /* discharge times, here then for both */
+	unsigned period_us;      /* being tried */
+	unsigned failed_us;      /* quickest period tried that did not work */
+	unsigned long start;     /* periods of the transceiver when a step started */
+	unsigned long start_ms;
+	uint8_t frames, acked;   /* of the link, before the frames being sent */
+	unsigned long bps;       /* of payload, over the quickest period that worked */
+} led_tune_t;
+
+int led_sensor_derive(led_sensor_t *s, unsigned lit_us, unsigned dark_us, unsigned period_us); /* zero if usable */
+void led_tune_init(led_tune_t *u, led_link_t *k, led_sensor_t *profile);
+int led_tune_start(led_tune_t *u); /* zero if started */
+int led_tune_poll(led_tune_t *u, unsigned long ms); /* one when done, negative if failed, else zero */
+int led_tune_busy(const led_tune_t *u);
+void led_tune_stop(led_tune_t *u, unsigned long ms); /* once calibrated, busy until the other end gives up */
+
+extern const led_sensor_t led_sensor_communications; /**< Use for communications, in flash */
+extern const led_sensor_t led_sensor_light_level;    /**< Use for light sensing, in flash */
+void led_sensor_load(led_sensor_t *to, const led_sensor_t *from); /* copies one of those into RAM */
 
 #ifdef __cplusplus
 }
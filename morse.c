@@ -43,183 +43,500 @@
    QTH        My location is...
    QTH?       What is your location?
 
-   @todo Add a Morse code decoder
-  
   */
 #include "morse.h"
-#include <avr/pgmspace.h>
 #include <stdint.h>
 #include <ctype.h>
+#include <math.h>
 #include <string.h>
 
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define pgm_read_byte(ADDR) (*(const uint8_t*)(ADDR))
+#endif
+
 #define MORSE_USE_ABBREVIATED_NUMBERS (0)
+#ifdef LARGE_TABLE
+#define MORSE_TABLE_COUNT             (256)
+#else
 #define MORSE_TABLE_COUNT             (128)
-#define MORSE_CHARACTER_LENGTH        (7)
-
-/**@todo encode this table more efficiently */
-static const PROGMEM char morse_table[MORSE_TABLE_COUNT][MORSE_CHARACTER_LENGTH] = {
-	['a']  = "._", /*     "Letter A, a" */ 
-	['b']  = "_...", /*   "Letter B, b" */ 
-	['c']  = "_._.", /*   "Letter C, c" */ 
-	['d']  = "_..", /*    "Letter D, d" */ 
-	['e']  = ".", /*      "Letter E, e" */ 
-	['f']  = ".._.", /*   "Letter F, f" */ 
-	['g']  = "__.", /*    "Letter G, g" */ 
-	['h']  = "....", /*   "Letter H, h" */ 
-	['i']  = "..", /*     "Letter I, i" */ 
-	['j']  = ".___", /*   "Letter J, j" */ 
-	['k']  = "_._", /*    "Letter K, k" */ 
-	['l']  = "._..", /*   "Letter L, l" */ 
-	['m']  = "__", /*     "Letter M, m" */ 
-	['n']  = "_.", /*     "Letter N, n" */ 
-	['o']  = "___", /*    "Letter O, o" */ 
-	['p']  = ".__.", /*   "Letter P, p" */ 
-	['q']  = "__._", /*   "Letter Q, q" */ 
-	['r']  = "._.", /*    "Letter R, r" */ 
-	['s']  = "...", /*    "Letter S, s" */ 
-	['t']  = "_", /*      "Letter T, t" */ 
-	['u']  = ".._", /*    "Letter U, u" */ 
-	['v']  = "..._", /*   "Letter V, v" */ 
-	['w']  = ".__", /*    "Letter W, w" */ 
-	['x']  = "_.._", /*   "Letter X, x" */ 
-	['y']  = "_.__", /*   "Letter Y, y" */ 
-	['z']  = "__..", /*   "Letter Z, z" */ 
-	['A']  = "._", /*     "Letter A, a" */ 
-	['B']  = "_...", /*   "Letter B, b" */ 
-	['C']  = "_._.", /*   "Letter C, c" */ 
-	['D']  = "_..", /*    "Letter D, d" */ 
-	['E']  = ".", /*      "Letter E, e" */ 
-	['F']  = ".._.", /*   "Letter F, f" */ 
-	['G']  = "__.", /*    "Letter G, g" */ 
-	['H']  = "....", /*   "Letter H, h" */ 
-	['I']  = "..", /*     "Letter I, i" */ 
-	['J']  = ".___", /*   "Letter J, j" */ 
-	['K']  = "_._", /*    "Letter K, k" */ 
-	['L']  = "._..", /*   "Letter L, l" */ 
-	['M']  = "__", /*     "Letter M, m" */ 
-	['N']  = "_.", /*     "Letter N, n" */ 
-	['O']  = "___", /*    "Letter O, o" */ 
-	['P']  = ".__.", /*   "Letter P, p" */ 
-	['Q']  = "__._", /*   "Letter Q, q" */ 
-	['R']  = "._.", /*    "Letter R, r" */ 
-	['S']  = "...", /*    "Letter S, s" */ 
-	['T']  = "_", /*      "Letter T, t" */ 
-	['U']  = ".._", /*    "Letter U, u" */ 
-	['V']  = "..._", /*   "Letter V, v" */ 
-	['W']  = ".__", /*    "Letter W, w" */ 
-	['X']  = "_.._", /*   "Letter X, x" */ 
-	['Y']  = "_.__", /*   "Letter Y, y" */ 
-	['Z']  = "__..", /*   "Letter Z, z" */ 
+#endif
+#define MORSE_TREE_SIZE               (1u << (MORSE_MAX_ELEMENTS + 1))
+
+/* The table is given as a list of characters and their codes, from which
+ * the tables for encoding and decoding are both made at compile time. 'X'
+ * entries can be decoded, 'A' entries share their code with an 'X' entry and
+ * are only used for encoding. */
+#define MORSE_LETTERS(X, A)\
+	X('a', "._")     /*   "Letter A, a" */\
+	X('b', "_...")   /*   "Letter B, b" */\
+	X('c', "_._.")   /*   "Letter C, c" */\
+	X('d', "_..")    /*   "Letter D, d" */\
+	X('e', ".")      /*   "Letter E, e" */\
+	X('f', ".._.")   /*   "Letter F, f" */\
+	X('g', "__.")    /*   "Letter G, g" */\
+	X('h', "....")   /*   "Letter H, h" */\
+	X('i', "..")     /*   "Letter I, i" */\
+	X('j', ".___")   /*   "Letter J, j" */\
+	X('k', "_._")    /*   "Letter K, k" */\
+	X('l', "._..")   /*   "Letter L, l" */\
+	X('m', "__")     /*   "Letter M, m" */\
+	X('n', "_.")     /*   "Letter N, n" */\
+	X('o', "___")    /*   "Letter O, o" */\
+	X('p', ".__.")   /*   "Letter P, p" */\
+	X('q', "__._")   /*   "Letter Q, q" */\
+	X('r', "._.")    /*   "Letter R, r" */\
+	X('s', "...")    /*   "Letter S, s" */\
+	X('t', "_")      /*   "Letter T, t" */\
+	X('u', ".._")    /*   "Letter U, u" */\
+	X('v', "..._")   /*   "Letter V, v" */\
+	X('w', ".__")    /*   "Letter W, w" */\
+	X('x', "_.._")   /*   "Letter X, x" */\
+	X('y', "_.__")   /*   "Letter Y, y" */\
+	X('z', "__..")   /*   "Letter Z, z" */\
+	A('A', "._")     /*   "Letter A, a" */\
+	A('B', "_...")   /*   "Letter B, b" */\
+	A('C', "_._.")   /*   "Letter C, c" */\
+	A('D', "_..")    /*   "Letter D, d" */\
+	A('E', ".")      /*   "Letter E, e" */\
+	A('F', ".._.")   /*   "Letter F, f" */\
+	A('G', "__.")    /*   "Letter G, g" */\
+	A('H', "....")   /*   "Letter H, h" */\
+	A('I', "..")     /*   "Letter I, i" */\
+	A('J', ".___")   /*   "Letter J, j" */\
+	A('K', "_._")    /*   "Letter K, k" */\
+	A('L', "._..")   /*   "Letter L, l" */\
+	A('M', "__")     /*   "Letter M, m" */\
+	A('N', "_.")     /*   "Letter N, n" */\
+	A('O', "___")    /*   "Letter O, o" */\
+	A('P', ".__.")   /*   "Letter P, p" */\
+	A('Q', "__._")   /*   "Letter Q, q" */\
+	A('R', "._.")    /*   "Letter R, r" */\
+	A('S', "...")    /*   "Letter S, s" */\
+	A('T', "_")      /*   "Letter T, t" */\
+	A('U', ".._")    /*   "Letter U, u" */\
+	A('V', "..._")   /*   "Letter V, v" */\
+	A('W', ".__")    /*   "Letter W, w" */\
+	A('X', "_.._")   /*   "Letter X, x" */\
+	A('Y', "_.__")   /*   "Letter Y, y" */\
+	A('Z', "__..")   /*   "Letter Z, z" */
+
 #if MORSE_USE_ABBREVIATED_NUMBERS
-	['0']  = "_", /*      "Abbreviated Number 0" */  //(sometimes a long dash is used)
-	['1']  = "._", /*     "Abbreviated Number 1" */ 
-	['2']  = ".._", /*    "Abbreviated Number 2" */ 
-	['3']  = "..._", /*   "Abbreviated Number 3" */ 
-	['4']  = "...._", /*  "Abbreviated Number 4" */ 
-	['5']  = ".", /*      "Abbreviated Number 5" */ 
-	['6']  = "_....", /*  "Abbreviated Number 6" */ 
-	['7']  = "_...", /*   "Abbreviated Number 7" */ 
-	['8']  = "_..", /*    "Abbreviated Number 8" */ 
-	['9']  = "_.", /*     "Abbreviated Number 9" */ 
+#define MORSE_NUMBERS(X, A)\
+	A('0', "_")      /*   "Abbreviated Number 0" (sometimes a long dash is used) */\
+	A('1', "._")     /*   "Abbreviated Number 1" */\
+	A('2', ".._")    /*   "Abbreviated Number 2" */\
+	A('3', "..._")   /*   "Abbreviated Number 3" */\
+	X('4', "...._")  /*   "Abbreviated Number 4" */\
+	A('5', ".")      /*   "Abbreviated Number 5" */\
+	X('6', "_....")  /*   "Abbreviated Number 6" */\
+	A('7', "_...")   /*   "Abbreviated Number 7" */\
+	A('8', "_..")    /*   "Abbreviated Number 8" */\
+	A('9', "_.")     /*   "Abbreviated Number 9" */
 #else
-	['0']  = "_____", /*  "Number 0" */ 
-	['1']  = ".____", /*  "Number 1" */ 
-	['2']  = "..___", /*  "Number 2" */ 
-	['3']  = "...__", /*  "Number 3" */ 
-	['4']  = "...._", /*  "Number 4" */ 
-	['5']  = ".....", /*  "Number 5" */ 
-	['6']  = "_....", /*  "Number 6" */ 
-	['7']  = "__...", /*  "Number 7" */ 
-	['8']  = "___..", /*  "Number 8" */ 
-	['9']  = "____.", /*  "Number 9" */ 
+#define MORSE_NUMBERS(X, A)\
+	X('0', "_____")  /*   "Number 0" */\
+	X('1', ".____")  /*   "Number 1" */\
+	X('2', "..___")  /*   "Number 2" */\
+	X('3', "...__")  /*   "Number 3" */\
+	X('4', "...._")  /*   "Number 4" */\
+	X('5', ".....")  /*   "Number 5" */\
+	X('6', "_....")  /*   "Number 6" */\
+	X('7', "__...")  /*   "Number 7" */\
+	X('8', "___..")  /*   "Number 8" */\
+	X('9', "____.")  /*   "Number 9" */
 #endif
-	[',']  = "__..__", /* "Comma ," */ 
-	['.']  = "._._._", /* "Full stop (period) ." */ 
-	['?']  = "..__..", /* "Question mark ?" */ 
-	[';']  = "_._._.", /* "Semicolon ;" */ 
-	[':']  = "___...", /* "Colon :" */  /*(or division sign)*/
-	['/']  = "_.._.", /*  "Slash /" */ 
-	['-']  = "_...._", /* "Dash -" */ 
-	['\''] = ".____.", /* "Apostrophe '" */ 
-	['"']  = "._.._.", /* "Inverted commas \""  */ 
-	['_']  = "..__._", /* "Underline _" */ 
-	['(']  = "_.__.", /*  "Left bracket or parenthesis (" */ 
-	[')']  = "_.__._", /* "Right bracket or parenthesis )" */ 
-	['=']  = "_..._", /*  "Double hyphen = equals sign" */ 
-	['+']  = "._._.", /*  "Addition sign +" */ 
-	['*']  = "_.._", /*   "Multiplication sign *" */ 
-	['@']  = ".__._.", /* "Commercial at @" */ 
-	['!']  = "_._.__", /* "Exclamation Point !" */ 
-	['\n'] = "._._", /*   "Start new line" */ 
+
+#define MORSE_PUNCTUATION(X, A)\
+	X(',',  "__..__") /*  "Comma ," */\
+	X('.',  "._._._") /*  "Full stop (period) ." */\
+	X('?',  "..__..") /*  "Question mark ?" */\
+	X(';',  "_._._.") /*  "Semicolon ;" */\
+	X(':',  "___...") /*  "Colon :" (or division sign) */\
+	X('/',  "_.._.")  /*  "Slash /" */\
+	X('-',  "_...._") /*  "Dash -" */\
+	X('\'', ".____.") /*  "Apostrophe '" */\
+	X('"',  "._.._.") /*  "Inverted commas \"" */\
+	X('_',  "..__._") /*  "Underline _" */\
+	X('(',  "_.__.")  /*  "Left bracket or parenthesis (" */\
+	X(')',  "_.__._") /*  "Right bracket or parenthesis )" */\
+	X('=',  "_..._")  /*  "Double hyphen = equals sign" */\
+	X('+',  "._._.")  /*  "Addition sign +" */\
+	A('*',  "_.._")   /*  "Multiplication sign *", as 'x' */\
+	X('@',  ".__._.") /*  "Commercial at @" */\
+	X('!',  "_._.__") /*  "Exclamation Point !" */\
+	X('\n', "._._")   /*  "Start new line" */
+
+/* <https://en.wikipedia.org/wiki/ISO/IEC_8859-1> */
 #ifdef LARGE_TABLE
-	/* <https://en.wikipedia.org/wiki/ISO/IEC_8859-1> */
-	[0XC0] = ".__._", /*  "Letter 'A' with accent" */ 
-	[0XC4] = "._._", /*   "Letter 'A' with umlaut" */ 
-	[0XD1] = "__.__", /*  "Letter 'N' with tilde" */ 
-	[0XC9] = ".._..", /*  "Letter 'E' with accent" */ 
-	[0XD6] = "___.", /*   "Letter 'O' with umlaut" */ 
-	[0XDC] = "..__", /*   "Letter 'U' with umlaut" */ 
+#define MORSE_LATIN(X, A)\
+	X(0xC0, ".__._")  /*  "Letter 'A' with accent" */\
+	A(0xC4, "._._")   /*  "Letter 'A' with umlaut", as new line */\
+	X(0xD1, "__.__")  /*  "Letter 'N' with tilde" */\
+	X(0xC9, ".._..")  /*  "Letter 'E' with accent" */\
+	X(0xD6, "___.")   /*  "Letter 'O' with umlaut" */\
+	X(0xDC, "..__")   /*  "Letter 'U' with umlaut" */
+#else
+#define MORSE_LATIN(X, A)
 #endif
+
+#define MORSE_TABLE(X, A) MORSE_LETTERS(X, A) MORSE_NUMBERS(X, A) MORSE_PUNCTUATION(X, A) MORSE_LATIN(X, A)
+
+/* A code is packed into a byte as a one bit followed by a bit for each
+ * element, a one for a dash, first element first. This is also the index of
+ * the code in a binary tree stored as an array, with the root at one and the
+ * children of a node 'n' at '2n' for a dot and '2n + 1' for a dash. Reading
+ * a character out of a string in a constant expression is a GCC extension. A
+ * code longer than 'MORSE_MAX_ELEMENTS', or than the six bits packed, does
+ * not compile, as it makes an array of negative size. */
+#define MORSE_LENGTH(S)  (sizeof(S) - 1u)
+#define MORSE_FITS(S)    (0u * sizeof(char[MORSE_LENGTH(S) <= MORSE_MAX_ELEMENTS && MORSE_MAX_ELEMENTS <= 6 ? 1 : -1]))
+#define MORSE_BIT(S, I)  ((I) < MORSE_LENGTH(S) ? (((S)[(I) < MORSE_LENGTH(S) ? (I) : 0] == '_') << (MORSE_LENGTH(S) - 1u - (I))) : 0)
+#define MORSE_PACK(S)    (MORSE_FITS(S) | (1u << MORSE_LENGTH(S)) |\
+	MORSE_BIT(S, 0) | MORSE_BIT(S, 1) | MORSE_BIT(S, 2) | MORSE_BIT(S, 3) | MORSE_BIT(S, 4) | MORSE_BIT(S, 5))
+
+#define MORSE_ENCODE(C, S) [(C)] = MORSE_PACK(S),
+#define MORSE_DECODE(C, S) [MORSE_PACK(S)] = (C),
+#define MORSE_IGNORE(C, S)
+
+static const PROGMEM uint8_t morse_codes[MORSE_TABLE_COUNT] = {
+	MORSE_TABLE(MORSE_ENCODE, MORSE_ENCODE)
 };
 
-static int morse_populated(const char *buffer, size_t length) {
-	if (!length || !buffer[0])
+static const PROGMEM uint8_t morse_tree[MORSE_TREE_SIZE] = {
+	MORSE_TABLE(MORSE_DECODE, MORSE_IGNORE)
+};
+
+uint8_t morse_code(unsigned char c) {
+#if MORSE_TABLE_COUNT < 256
+	if (c >= MORSE_TABLE_COUNT)
 		return 0;
-	return 1;
+#endif
+	return pgm_read_byte(&morse_codes[c]);
 }
 
 int morse_encode_character(unsigned char c, char *buffer, size_t length) {
-	if (length < MORSE_CHARACTER_LENGTH)
+	const uint8_t code = morse_code(c);
+	size_t n = 0;
+	if (!code)
 		return -1;
-	if ((c & 0x80))
+	while ((unsigned)(code >> n) > 1u)
+		n++;
+	if (length <= n)
 		return -1;
+	for (size_t i = 0; i < n; i++)
+		buffer[i] = (code >> (n - 1u - i)) & 1u ? '_' : '.';
+	buffer[n] = '\0';
+	return 0;
+}
 
-	for (size_t i = 0; i < length; i++) {
-		char ch = pgm_read_byte(&(morse_table[c][i]));
-		buffer[i] = ch;
-	}
-	
-	if (!morse_populated(buffer, length))
+uint8_t morse_next(uint8_t node, int dash) {
+	if (!node || node >= (MORSE_TREE_SIZE / 2u))
+		return 0;
+	return (node << 1) | !!dash;
+}
+
+int morse_decode_node(uint8_t node) {
+	if (node >= MORSE_TREE_SIZE)
 		return -1;
-	return 0;
+	const uint8_t c = pgm_read_byte(&morse_tree[node]);
+	return c ? c : -1;
 }
 
-#if 0
+/* Elements are separated by at most one space, as 'morse_print_buffer' in
+ * 'test.cpp' writes them, more than that ends the character */
 int morse_decode_character(const char *s, const char **endptr) {
-	size_t i = 0;
-	char buf[16] = { 0 };
-	char c = 0;
-
+	uint8_t node = MORSE_ROOT;
+	while (*s == ' ')
+		s++;
+	while (*s == '.' || *s == '_') {
+		node = morse_next(node, *s++ == '_');
+		if (s[0] == ' ' && (s[1] == '.' || s[1] == '_'))
+			s++;
+	}
 	if (endptr)
-		*endptr = NULL;
+		*endptr = s;
+	return node == MORSE_ROOT ? -1 : morse_decode_node(node);
+}
+
+/* A space adds the difference between the gaps after a character and after
+ * a word to the gap held back, or starts a byte of gap of its own if that
+ * would overflow it */
+#define MORSE_TIMING(MARK, SPACE) ((uint8_t)(((MARK) << 4) | (SPACE)))
+#define MORSE_TIMING_WORD (MORSE_SPACES_IN_WORD_SEPARATOR - MORSE_SPACES_IN_CHAR_SEPARATOR)
 
-	while (i < (sizeof(buf) - 1)) {
-		size_t j = 0;
-		while ((c = *s++)) {
-			j++;
-			if (isspace(c))
+size_t morse_timing_encode(morse_timing_t *e, const uint8_t *text, size_t length, uint8_t *timing, size_t size, size_t *written) {
+	size_t i = 0, w = 0;
+	uint8_t held = e->held;
+	for (; i < length; i++) {
+		if (text[i] == ' ') {
+			if (held && MORSE_TIMING_SPACE(held) + MORSE_TIMING_WORD <= 0xFu) {
+				held += MORSE_TIMING_WORD;
 				continue;
-			else
-				break;
+			}
+			if (held) {
+				if (w == size)
+					break;
+				timing[w++] = held;
+			}
+			held = MORSE_TIMING(0, MORSE_TIMING_WORD);
+			continue;
 		}
-		if ((c != '.' && c != '_') || j > 2)
+		const uint8_t code = morse_code(text[i]);
+		if (!code)
+			continue;
+		unsigned elements = 0;
+		while ((unsigned)(code >> elements) > 1u)
+			elements++;
+		if (size - w < elements - 1u + !!held)
 			break;
-		buf[i++] = c;
+		if (held)
+			timing[w++] = held;
+		while (--elements)
+			timing[w++] = MORSE_TIMING(((code >> elements) & 1u) ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER, MORSE_SPACES_IN_ELEMENT_SEPARATOR);
+		held = MORSE_TIMING((code & 1u) ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER, MORSE_SPACES_IN_CHAR_SEPARATOR);
 	}
-	if (endptr)
-		*endptr = s + i;
+	e->held = held;
+	*written = w;
+	return i;
+}
+
+size_t morse_timing_flush(morse_timing_t *e, uint8_t *timing, size_t size) {
+	if (!e->held || !size)
+		return 0;
+	timing[0] = e->held;
+	e->held = 0;
+	return 1;
+}
+
+long morse_timing(const uint8_t *text, size_t length, uint8_t *timing, size_t size) {
+	morse_timing_t e = { 0 };
+	size_t written = 0;
+	if (morse_timing_encode(&e, text, length, timing, size, &written) != length)
+		return -1;
+	written += morse_timing_flush(&e, timing + written, size - written);
+	return e.held ? -1 : (long)written;
+}
 
-	for (size_t k = 0; k < MORSE_TABLE_COUNT; k++) {
-		const morse_character_t *mc = &morse_table[k];
-		if (!morse_populated(mc))
+int morse_tx_put(morse_tx_t *t, unsigned char c) {
+	if (c != ' ' && !morse_code(c))
+		return -1;
+	if ((uint8_t)(t->head - t->tail) >= MORSE_TX_QUEUE)
+		return 0;
+	t->queue[t->head % MORSE_TX_QUEUE] = c;
+	t->head++;
+	return 1;
+}
+
+/* A mark is followed by the gap between elements, or if it was the last
+ * element, the gap between characters, a space adding what is left of the
+ * gap between words */
+static void morse_tx_next(morse_tx_t *t) {
+	if (t->on) {
+		t->on    = 0;
+		t->units = t->elements ? MORSE_SPACES_IN_ELEMENT_SEPARATOR : MORSE_SPACES_IN_CHAR_SEPARATOR;
+		return;
+	}
+	if (!t->elements) {
+		if (t->head == t->tail)
+			return;
+		const uint8_t c = t->queue[t->tail % MORSE_TX_QUEUE];
+		t->tail++;
+		if (c == ' ') {
+			t->units = MORSE_SPACES_IN_WORD_SEPARATOR - MORSE_SPACES_IN_CHAR_SEPARATOR;
+			return;
+		}
+		t->code = morse_code(c);
+		while ((unsigned)(t->code >> t->elements) > 1u)
+			t->elements++;
+	}
+	t->elements--;
+	t->on    = 1;
+	t->units = ((t->code >> t->elements) & 1u) ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER;
+}
+
+int morse_tx_tick(morse_tx_t *t) {
+	if (!t->units)
+		morse_tx_next(t);
+	if (t->units)
+		t->units--;
+	return t->on;
+}
+
+int morse_tx_busy(const morse_tx_t *t) {
+	return t->head != t->tail || t->elements || t->units || t->on;
+}
+
+/* Marks are dots or dashes, of one and three units, and spaces are gaps
+ * of one unit between elements, three between characters and seven between
+ * words, so the thresholds between them are at two and five units. Each
+ * mark, and each space between elements, moves the estimate of a unit a
+ * quarter or an eighth of the way to what it measured, so it follows a
+ * sender speeding up or slowing down. A mark too short or long for the
+ * estimate to be anywhere near starts it again, as happens when the first
+ * guess is far out. */
+#define MORSE_RX_DASH (2u) /**< units, longer marks are dashes */
+#define MORSE_RX_CHAR (2u) /**< units, longer spaces end a character */
+#define MORSE_RX_WORD (5u) /**< units, longer spaces end a word */
+
+void morse_rx_init(morse_rx_t *r, uint16_t dot) {
+	memset(r, 0, sizeof *r);
+	r->dot  = dot ? dot : 1u;
+	r->node = MORSE_ROOT;
+	r->gap  = 2;
+}
+
+static void morse_rx_put(morse_rx_t *r, uint8_t c) {
+	if ((uint8_t)(r->head - r->tail) >= MORSE_RX_QUEUE)
+		return;
+	r->queue[r->head % MORSE_RX_QUEUE] = c;
+	r->head++;
+}
+
+static void morse_rx_estimate(morse_rx_t *r, uint16_t unit, unsigned shift) {
+	const int32_t dot = r->dot + (((int32_t)unit - (int32_t)r->dot) / (1 << shift));
+	r->dot = dot < 1 ? 1 : dot;
+}
+
+void morse_rx_poll(morse_rx_t *r, uint16_t elapsed) {
+	const uint32_t units = elapsed / r->dot;
+	if (r->gap == 0 && units >= MORSE_RX_CHAR) {
+		const int c = morse_decode_node(r->node);
+		if (c > 0)
+			morse_rx_put(r, c);
+		r->node = MORSE_ROOT;
+		r->gap  = 1;
+	}
+	if (r->gap == 1 && units >= MORSE_RX_WORD) {
+		morse_rx_put(r, ' ');
+		r->gap = 2;
+	}
+}
+
+void morse_rx_key(morse_rx_t *r, int down, uint16_t duration) {
+	if (down) {
+		morse_rx_poll(r, duration);
+		if (r->gap == 0)
+			morse_rx_estimate(r, duration, 3);
+		return;
+	}
+	if (duration < r->dot / 2u || duration > (uint32_t)r->dot * 6u)
+		r->dot = duration > (uint32_t)r->dot * 6u ? duration / 3u : duration;
+	const int dash = duration > (uint32_t)r->dot * MORSE_RX_DASH;
+	morse_rx_estimate(r, dash ? duration / 3u : duration, 2);
+	r->node = morse_next(r->node, dash);
+	r->gap  = 0;
+}
+
+int morse_rx_getc(void *file, int *no_data) {
+	morse_rx_t *r = (morse_rx_t*)file;
+	if (r->head == r->tail) {
+		*no_data = -1;
+		return -1;
+	}
+	*no_data = 0;
+	const uint8_t c = r->queue[r->tail % MORSE_RX_QUEUE];
+	r->tail++;
+	return c;
+}
+
+/* The magnitude of each block, rather than its power, is compared so the
+ * thresholds are in proportion to the amplitude of the tone. Whilst the tone
+ * is off the level of the noise is averaged and whilst on that of the tone,
+ * which decays towards the noise so a tone fading is followed, and the tone
+ * is on when a block is more than half way from one to the other, and stays
+ * on until it falls below three eighths. It is not on at all unless it is
+ * twice the noise. A change must last 'MORSE_TONE_HOLD' blocks, delaying the
+ * start and end of a mark equally, so a block of noise does not break a
+ * dash in two, which would start the estimate of the speed again. */
+#define MORSE_TONE_Q     (14) /**< fractional bits of the coefficient */
+#define MORSE_TONE_QUIET (16) /**< blocks averaged for the noise before listening */
+
+/* The filter state grows by at most a sample over 'sin(2 pi frequency /
+ * rate)' each sample, so a block is limited to keep it within 30 bits, and
+ * the coefficient within 16 */
+void morse_tone_init(morse_tone_t *t, morse_rx_t *rx, uint32_t rate, uint16_t frequency, uint16_t block) {
+	const double w = (2.0 * M_PI * frequency) / rate, most = fabs(sin(w)) * 32768.0;
+	memset(t, 0, sizeof *t);
+	t->rx    = rx;
+	t->block = block ? block : 1u;
+	t->block = t->block > most ? (most < 1.0 ? 1u : (uint16_t)most) : t->block;
+	t->coeff = (int16_t)lround(fmin(2.0 * cos(w) * (1l << MORSE_TONE_Q), INT16_MAX));
+}
+
+/* 'coeff * s', shifted down by 'MORSE_TONE_Q', as two 16 by 16 bit multiplies
+ * giving 32 bits, which is all an 8-bit processor has hardware help for,
+ * rather than one giving 64; it is exact for 's' within 30 bits */
+static inline int32_t morse_tone_scale(const int16_t coeff, const int32_t s) {
+	const int16_t high = s >> 16;
+	const uint16_t low = s;
+	return ((int32_t)coeff * high * (1l << (16 - MORSE_TONE_Q))) + (((int32_t)coeff * low) >> MORSE_TONE_Q);
+}
+
+static uint32_t morse_tone_sqrt(uint64_t x) {
+	uint64_t r = 0, bit = 1ull << 62;
+	while (bit > x)
+		bit >>= 2;
+	for (; bit; bit >>= 2) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+	}
+	return r;
+}
+
+static void morse_tone_block(morse_tone_t *t, uint32_t m) {
+	if (t->quiet < MORSE_TONE_QUIET) {
+		t->quiet++;
+		t->noise += ((int32_t)m - (int32_t)t->noise) / t->quiet;
+		t->peak   = t->noise;
+		return;
+	}
+	const uint32_t span = t->peak > t->noise ? t->peak - t->noise : 0;
+	uint32_t threshold = t->noise + (t->on ? (span * 3u) / 8u : span / 2u);
+	if (t->peak < 3u * t->noise && threshold < (5u * t->noise) / 2u)
+		threshold = (5u * t->noise) / 2u;
+	const int on = m > threshold;
+	if (on) {
+		t->peak += ((int32_t)m - (int32_t)t->peak) / 8;
+	} else {
+		const uint32_t n = m < 2u * t->noise ? m : 2u * t->noise;
+		t->noise += ((int32_t)n - (int32_t)t->noise) / 16;
+	}
+	t->peak -= span / 512u;
+	t->elapsed += t->block;
+	if (on == t->on) {
+		t->changed = 0;
+	} else if (++t->changed >= MORSE_TONE_HOLD) {
+		const uint32_t since = (uint32_t)t->block * t->changed, lasted = t->elapsed - since;
+		morse_rx_key(t->rx, on, lasted > 0xFFFFu ? 0xFFFFu : lasted);
+		t->on      = on;
+		t->changed = 0;
+		t->elapsed = since;
+	}
+	if (!t->on)
+		morse_rx_poll(t->rx, t->elapsed > 0xFFFFu ? 0xFFFFu : t->elapsed);
+}
+
+void morse_tone_samples(morse_tone_t *t, const int16_t *samples, size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		const int32_t s = samples[i] + morse_tone_scale(t->coeff, t->s1) - t->s2;
+		t->s2 = t->s1;
+		t->s1 = s;
+		if (++t->n < t->block)
 			continue;
-		if (!strcmp(buf, mc->encoding))
-			return k;
+		const int64_t s1 = t->s1, s2 = t->s2;
+		const int64_t power = (s1 * s1) + (s2 * s2) - ((int64_t)morse_tone_scale(t->coeff, t->s1) * s2);
+		morse_tone_block(t, morse_tone_sqrt(power < 0 ? 0 : power));
+		t->n = 0;
+		t->s1 = t->s2 = 0;
 	}
-	
-	return -1;
 }
-#endif
 
 #if 0
 /* character: { { '.' | '_' } { ' ' }x[0-2] }+
@@ -233,31 +550,505 @@ int morse_decode_string(char *buf, size_t length, const char *s) {
 #ifdef MORSE_TEST
 
 #include <stdio.h>
-void test_decode(FILE *out, const char *s) {
+#include <stdlib.h>
+#include <time.h>
+
+#define MORSE_OLD_CHARACTER_LENGTH (7) /* bytes per character before packing */
+
+static void test_decode(FILE *out, const char *s) {
 	const char *end = NULL;
 	int ch = morse_decode_character(s, &end);
 	fprintf(out, "decoded(\"%s\") = '%c'/%d\n", s, isgraph(ch) ? ch : '.', ch);
 }
 
+/* Each character must decode back to itself, or for an alias to a character
+ * with the same code */
+static int test_table(FILE *out) {
+	int r = 0;
+	for (unsigned c = 0; c < MORSE_TABLE_COUNT; c++) {
+		char buf[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		const uint8_t code = morse_code(c);
+		int d = -1;
+		if (!code)
+			continue;
+		if (morse_encode_character(c, buf, sizeof buf) < 0 || (d = morse_decode_character(buf, NULL)) < 0 || morse_code(d) != code) {
+			fprintf(out, "character %u, \"%s\", decoded as %d\n", c, buf, d);
+			r = -1;
+		}
+	}
+	return r;
+}
+
+/* Decoding as it had to be done before, searching the whole table */
+static int test_search(const uint8_t code) {
+	for (unsigned c = 0; c < MORSE_TABLE_COUNT; c++)
+		if (morse_code(c) == code)
+			return c;
+	return -1;
+}
+
+static double test_rate(const unsigned long n, const clock_t start) {
+	return (n / ((double)(clock() - start) / CLOCKS_PER_SEC)) / 1e6;
+}
+
+static void test_speed(FILE *out) {
+	const unsigned long n = 10000000uL;
+	char codes[26][MORSE_MAX_ELEMENTS + 1];
+	unsigned long sum = 0;
+	for (int i = 0; i < 26; i++)
+		morse_encode_character('a' + i, codes[i], sizeof codes[i]);
+	clock_t start = clock();
+	for (unsigned long i = 0; i < n; i++) {
+		char buf[MORSE_MAX_ELEMENTS + 1];
+		sum += morse_encode_character('a' + (i % 26), buf, sizeof buf) + buf[0];
+	}
+	fprintf(out, "encode, %6.2f M lookups/s\n", test_rate(n, start));
+	start = clock();
+	for (unsigned long i = 0; i < n; i++)
+		sum += morse_decode_character(codes[i % 26], NULL);
+	fprintf(out, "decode, tree, %6.2f M lookups/s\n", test_rate(n, start));
+	start = clock();
+	for (unsigned long i = 0; i < n; i++)
+		sum += test_search(morse_code('a' + (i % 26)));
+	fprintf(out, "decode, search, %6.2f M lookups/s\n", test_rate(n, start));
+	fprintf(out, "(checksum %lu)\n", sum);
+}
+
+/* The timer driving the transmitter and the pin it drives are simulated, a
+ * tick for each unit, and the runs of the pin staying the same are checked
+ * against the elements and gaps the text should be sent as. Characters are
+ * put as fast as the queue takes them. */
+static int test_tx(FILE *out, const char *text) {
+	static unsigned expected[2048], got[2048];
+	size_t e = 0, g = 0, ticks = 0;
+	morse_tx_t t;
+	memset(&t, 0, sizeof t);
+	for (const char *s = text; *s; s++) {
+		char buf[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		if (*s == ' ') {
+			expected[e - 1] += MORSE_SPACES_IN_WORD_SEPARATOR - MORSE_SPACES_IN_CHAR_SEPARATOR;
+			continue;
+		}
+		if (morse_encode_character(*s, buf, sizeof buf) < 0)
+			return -1;
+		for (const char *b = buf; *b; b++) {
+			expected[e++] = *b == '_' ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER;
+			expected[e++] = b[1] ? MORSE_SPACES_IN_ELEMENT_SEPARATOR : MORSE_SPACES_IN_CHAR_SEPARATOR;
+		}
+	}
+	int level = 1;
+	for (const char *s = text; *s || morse_tx_busy(&t); ticks++) {
+		if (*s && morse_tx_put(&t, *s) > 0)
+			s++;
+		const int on = morse_tx_tick(&t);
+		if (!g && !on)
+			continue;
+		if (on != level || !g) {
+			got[g++] = 0;
+			level = on;
+		}
+		got[g - 1]++;
+	}
+	const int r = (e == g && !memcmp(expected, got, e * sizeof got[0])) ? 0 : -1;
+	fprintf(out, "tx \"%.20s%s\", %u units, %s\n", text, strlen(text) > 20 ? "..." : "",
+			(unsigned)ticks, r ? "timing wrong" : "timing correct");
+	return r;
+}
+
+/* 'paris ' is fifty units long, so words a minute is 1200 / unit in ms */
+static int test_tx_speed(FILE *out) {
+	const unsigned long words = 200000uL;
+	const char *word = "paris ";
+	unsigned long ticks = 0, sum = 0;
+	morse_tx_t t;
+	memset(&t, 0, sizeof t);
+	clock_t start = clock();
+	for (unsigned long w = 0; w < words; w++) {
+		for (const char *s = word; *s; s++)
+			while (morse_tx_put(&t, *s) == 0)
+				sum += morse_tx_tick(&t), ticks++;
+	}
+	while (morse_tx_busy(&t))
+		sum += morse_tx_tick(&t), ticks++;
+	const double taken = (double)(clock() - start) / CLOCKS_PER_SEC;
+	fprintf(out, "tx, %.2f units a word, %.1f ns a tick (%lu units on)\n",
+			(double)ticks / words, (taken * 1e9) / ticks, sum);
+	return ticks == words * 50uL ? 0 : -1;
+}
+
+/* A sender is simulated keying text at a speed that drifts by 'drift'
+ * percent over it, each element and gap being off by up to 'jitter' percent,
+ * into a receiver that starts off guessing 20 words a minute and is polled
+ * every millisecond whilst the key is up. Latency is from the end of the
+ * last element of a character to it being decoded. */
+static unsigned long test_random(void) {
+	static unsigned long seed = 1;
+	seed = (seed * 1103515245uL) + 12345uL;
+	return (seed >> 16) & 0x7FFFu;
+}
+
+static uint16_t test_jitter(const double length, const unsigned jitter) {
+	const double j = ((double)((long)(test_random() % 2001u) - 1000) / 1000.0) * (jitter / 100.0);
+	const double d = length * (1.0 + j);
+	return d < 1.0 ? 1u : (uint16_t)(d + 0.5);
+}
+
+static size_t test_distance(const char *a, const char *b) {
+	const size_t n = strlen(a), m = strlen(b);
+	static size_t row[512];
+	for (size_t j = 0; j <= m; j++)
+		row[j] = j;
+	for (size_t i = 1; i <= n; i++) {
+		size_t diagonal = row[0];
+		row[0] = i;
+		for (size_t j = 1; j <= m; j++) {
+			const size_t above = row[j];
+			const size_t cost = diagonal + (a[i - 1] != b[j - 1]);
+			row[j] = cost < above + 1 ? cost : above + 1;
+			row[j] = row[j] < row[j - 1] + 1 ? row[j] : row[j - 1] + 1;
+			diagonal = above;
+		}
+	}
+	return row[m];
+}
+
+/* The timing stream played out a unit at a time must match what the
+ * transmitter sends, and encoding in pieces, with little room for the
+ * output, must give the same stream as encoding all at once */
+static size_t test_timing_units(const uint8_t *timing, size_t n, uint8_t *units, size_t size) {
+	size_t u = 0;
+	for (size_t i = 0; i < n; i++) {
+		for (unsigned j = 0; j < MORSE_TIMING_MARK(timing[i]) && u < size; j++)
+			units[u++] = 1;
+		for (unsigned j = 0; j < MORSE_TIMING_SPACE(timing[i]) && u < size; j++)
+			units[u++] = 0;
+	}
+	return u;
+}
+
+static int test_timing(FILE *out, const char *text) {
+	static uint8_t timing[2048], pieces[2048], units[8192], ticks[8192];
+	const size_t n = strlen(text);
+	const long t = morse_timing((const uint8_t*)text, n, timing, sizeof timing);
+	if (t < 0)
+		return -1;
+	morse_timing_t e = { 0 };
+	size_t p = 0, done = 0, tick = 0;
+	while (done < n) {
+		size_t written = 0;
+		done += morse_timing_encode(&e, (const uint8_t*)text + done, (n - done) < 3 ? n - done : 3, pieces + p, 7, &written);
+		p += written;
+	}
+	p += morse_timing_flush(&e, pieces + p, sizeof(pieces) - p);
+	morse_tx_t tx;
+	memset(&tx, 0, sizeof tx);
+	for (const char *s = text; (*s || morse_tx_busy(&tx)) && tick < sizeof ticks; ) {
+		if (*s && morse_tx_put(&tx, *s) > 0) {
+			s++;
+			continue;
+		}
+		ticks[tick++] = morse_tx_tick(&tx);
+	}
+	const size_t u = test_timing_units(timing, t, units, sizeof units);
+	const int r = ((size_t)t == p && !memcmp(timing, pieces, p) && u == tick && !memcmp(units, ticks, u)) ? 0 : -1;
+	fprintf(out, "timing \"%.20s%s\", %ld bytes for %u characters, %s\n", text, n > 20 ? "..." : "",
+			t, (unsigned)n, r ? "wrong" : "correct");
+	return r;
+}
+
+/* Encoding a few megabytes of text all at once, in pieces through small
+ * buffers, and a character at a time into dots, dashes and spaces as
+ * 'morse_print_buffer' used to, written to a buffer as if to the serial
+ * port */
+#define TEST_TEXT (4ul << 20)
+
+static void test_timing_speed(FILE *out) {
+	static const char *words[] = { "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "cq", "de", "g4xyz", "73", "qth", "rst", "599", "?" };
+	static uint8_t text[TEST_TEXT], timing[TEST_TEXT * MORSE_MAX_ELEMENTS];
+	size_t n = 0;
+	unsigned long sum = 0;
+	while (n < TEST_TEXT - 8) {
+		for (const char *w = words[test_random() % (sizeof(words) / sizeof(words[0]))]; *w; w++)
+			text[n++] = *w;
+		text[n++] = ' ';
+	}
+	clock_t start = clock();
+	const long t = morse_timing(text, n, timing, sizeof timing);
+	fprintf(out, "timing, all at once, %7.2f MB/s, %.2f bytes a character\n", test_rate(n, start), (double)t / n);
+	start = clock();
+	morse_timing_t e = { 0 };
+	for (size_t done = 0; done < n; ) {
+		uint8_t piece[256];
+		size_t written = 0;
+		done += morse_timing_encode(&e, text + done, (n - done) < 64 ? n - done : 64, piece, sizeof piece, &written);
+		for (size_t i = 0; i < written; i++)
+			sum += piece[i];
+	}
+	fprintf(out, "timing, in pieces,   %7.2f MB/s\n", test_rate(n, start));
+	start = clock();
+	static char serial[4096];
+	size_t w = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (text[i] == ' ') {
+			for (int j = 0; j < MORSE_SPACES_IN_WORD_SEPARATOR; j++)
+				serial[w++ % sizeof serial] = ' ';
+			continue;
+		}
+		char buffer[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		if (morse_encode_character(text[i], buffer, sizeof buffer) < 0)
+			continue;
+		for (const char *b = buffer; *b; b++) {
+			serial[w++ % sizeof serial] = *b;
+			serial[w++ % sizeof serial] = ' ';
+		}
+		for (int j = 0; j < MORSE_SPACES_IN_CHAR_SEPARATOR - MORSE_SPACES_IN_ELEMENT_SEPARATOR; j++)
+			serial[w++ % sizeof serial] = ' ';
+	}
+	fprintf(out, "timing, characters,  %7.2f MB/s, %.2f bytes a character\n", test_rate(n, start), (double)w / n);
+	fprintf(out, "(checksum %lu)\n", sum + serial[w % sizeof serial]);
+}
+
+static int test_rx(FILE *out, const char *text, const unsigned wpm, const unsigned jitter, const int drift) {
+	char got[512] = { 0 };
+	size_t g = 0, n = strlen(text), decoded = 0;
+	double latency = 0, dot = 1200.0 / wpm;
+	int no_data = 0;
+	morse_rx_t r;
+	morse_rx_init(&r, 1200u / 20u);
+	for (size_t i = 0; i < n; i++) {
+		const double speed = dot * (1.0 + ((drift / 100.0) * i) / n);
+		char buf[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		if (text[i] == ' ' || morse_encode_character(text[i], buf, sizeof buf) < 0)
+			continue;
+		for (const char *b = buf; *b; b++) {
+			morse_rx_key(&r, 0, test_jitter(speed * (*b == '_' ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER), jitter));
+			const unsigned gap = !b[1] ? (text[i + 1] == ' ' ? MORSE_SPACES_IN_WORD_SEPARATOR : MORSE_SPACES_IN_CHAR_SEPARATOR) : MORSE_SPACES_IN_ELEMENT_SEPARATOR;
+			const uint16_t space = test_jitter(speed * gap, jitter);
+			for (uint16_t t = 1; t <= space; t++) {
+				morse_rx_poll(&r, t);
+				for (int c; (c = morse_rx_getc(&r, &no_data)) >= 0 && g < sizeof(got) - 1; ) {
+					got[g++] = c;
+					if (c != ' ')
+						latency += t, decoded++;
+				}
+			}
+			morse_rx_key(&r, 1, space);
+		}
+	}
+	const size_t errors = test_distance(text, got);
+	fprintf(out, "rx %2u wpm, %2u%% jitter, %3d%% drift, %5.1f%% characters wrong, latency %4.0f ms, %3.1f units\n",
+			wpm, jitter, drift, (100.0 * errors) / n, decoded ? latency / decoded : 0.0, decoded ? latency / decoded / dot : 0.0);
+	return (100 * errors) / n;
+}
+
+/* Audio of a text keyed at 'wpm' is made with a tone, shaped over five
+ * milliseconds so it does not click, in white noise 'snr' dB below it over
+ * the whole band, and handed to the tone detector a block at a time as an ADC
+ * would give it. There is half a second of noise before and after it. */
+#define TEST_RATE   (8000u) /* samples a second */
+#define TEST_TONE   (700u)  /* Hz */
+#define TEST_BLOCK  (80u)   /* samples, 10 ms, so 100 Hz wide */
+#define TEST_LEVEL  (8000.0)
+#define TEST_CHUNK  (256u)
+
+typedef struct {
+	morse_tone_t tone;
+	morse_rx_t rx;
+	int16_t chunk[TEST_CHUNK];
+	size_t n;
+	double phase, envelope, noise;
+	char got[512];
+	size_t g;
+} test_audio_t;
+
+static double test_gauss(void) {
+	const double u = (((test_random() << 15) | test_random()) + 1.0) / (double)(1ul << 30);
+	const double v = (test_random() + 1.0) / 32769.0;
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+static void test_audio_flush(test_audio_t *a) {
+	int no_data = 0;
+	morse_tone_samples(&a->tone, a->chunk, a->n);
+	a->n = 0;
+	for (int c; (c = morse_rx_getc(&a->rx, &no_data)) >= 0; )
+		if (a->g < sizeof(a->got) - 1)
+			a->got[a->g++] = c;
+}
+
+static void test_audio(test_audio_t *a, const int on, const double units, const double dot) {
+	const unsigned long n = units * dot * TEST_RATE / 1000.0;
+	for (unsigned long i = 0; i < n; i++) {
+		a->envelope += on ? (a->envelope < 1.0 ? 0.025 : 0.0) : (a->envelope > 0.0 ? -0.025 : 0.0);
+		a->phase += (2.0 * M_PI * TEST_TONE) / TEST_RATE;
+		double x = (TEST_LEVEL * a->envelope * sin(a->phase)) + (a->noise * test_gauss());
+		x = x > 32767.0 ? 32767.0 : x < -32768.0 ? -32768.0 : x;
+		a->chunk[a->n++] = (int16_t)x;
+		if (a->n == TEST_CHUNK)
+			test_audio_flush(a);
+	}
+}
+
+static int test_tone(FILE *out, const char *text, const unsigned wpm, const int snr) {
+	static test_audio_t a;
+	const double dot = 1200.0 / wpm;
+	const size_t n = strlen(text);
+	memset(&a, 0, sizeof a);
+	a.noise = sqrt((TEST_LEVEL * TEST_LEVEL / 2.0) / pow(10.0, snr / 10.0));
+	morse_rx_init(&a.rx, (TEST_RATE * 60u) / 1000u);
+	morse_tone_init(&a.tone, &a.rx, TEST_RATE, TEST_TONE, TEST_BLOCK);
+	test_audio(&a, 0, 500.0 / dot, dot);
+	for (size_t i = 0; i < n; i++) {
+		char buf[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		if (text[i] == ' ' || morse_encode_character(text[i], buf, sizeof buf) < 0)
+			continue;
+		for (const char *b = buf; *b; b++) {
+			test_audio(&a, 1, *b == '_' ? MORSE_DASH_DELAY_MULTIPLIER : MORSE_DOT_DELAY_MULTIPLIER, dot);
+			test_audio(&a, 0, !b[1] ? (text[i + 1] == ' ' ? MORSE_SPACES_IN_WORD_SEPARATOR : MORSE_SPACES_IN_CHAR_SEPARATOR) : MORSE_SPACES_IN_ELEMENT_SEPARATOR, dot);
+		}
+	}
+	test_audio(&a, 0, 500.0 / dot, dot);
+	test_audio_flush(&a);
+	const size_t errors = test_distance(text, a.got);
+	fprintf(out, "tone %2u wpm, %3d dB, %5.1f%% characters wrong\n", wpm, snr, (100.0 * errors) / n);
+	return (100 * errors) / n;
+}
+
+static void test_tone_speed(FILE *out) {
+	static int16_t samples[TEST_RATE];
+	const unsigned seconds = 200;
+	morse_tone_t t;
+	morse_rx_t r;
+	for (size_t i = 0; i < TEST_RATE; i++)
+		samples[i] = (int16_t)((TEST_LEVEL * sin((2.0 * M_PI * TEST_TONE * i) / TEST_RATE) * ((i / 800u) & 1u)) + (1000.0 * test_gauss()));
+	morse_rx_init(&r, (TEST_RATE * 60u) / 1000u);
+	morse_tone_init(&t, &r, TEST_RATE, TEST_TONE, TEST_BLOCK);
+	const clock_t start = clock();
+	for (unsigned i = 0; i < seconds; i++)
+		morse_tone_samples(&t, samples, TEST_RATE);
+	fprintf(out, "tone, %6.2f M samples/s, %.0f times real time at %u Hz\n",
+		test_rate(seconds * TEST_RATE, start), test_rate(seconds * TEST_RATE, start) * 1e6 / TEST_RATE, TEST_RATE);
+}
+
+static unsigned long test_le(const uint8_t *b, const size_t n) {
+	unsigned long r = 0;
+	for (size_t i = n; i; i--)
+		r = (r << 8) | b[i - 1];
+	return r;
+}
+
+/* Only 16-bit PCM is read, using the first channel, the chunks before the
+ * data are skipped past other than the format */
+static int test_wav(FILE *out, const char *name, const unsigned frequency) {
+	uint8_t header[12], chunk[8], format[16], buf[TEST_CHUNK * 2 * 8];
+	int16_t samples[TEST_CHUNK];
+	unsigned long rate = 0, channels = 0, bits = 0;
+	int no_data = 0;
+	morse_tone_t t;
+	morse_rx_t r;
+	FILE *in = fopen(name, "rb");
+	if (!in)
+		return -1;
+	if (fread(header, 1, sizeof header, in) != sizeof header || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+		goto fail;
+	for (;;) {
+		if (fread(chunk, 1, sizeof chunk, in) != sizeof chunk)
+			goto fail;
+		const unsigned long length = test_le(chunk + 4, 4);
+		if (!memcmp(chunk, "data", 4))
+			break;
+		if (!memcmp(chunk, "fmt ", 4) && length >= sizeof format) {
+			if (fread(format, 1, sizeof format, in) != sizeof format || fseek(in, length - sizeof format, SEEK_CUR) < 0)
+				goto fail;
+			channels = test_le(format + 2, 2);
+			rate     = test_le(format + 4, 4);
+			bits     = test_le(format + 14, 2);
+		} else if (fseek(in, length + (length & 1u), SEEK_CUR) < 0) {
+			goto fail;
+		}
+	}
+	if (test_le(format, 2) != 1 || bits != 16 || !channels || channels > 8 || !rate)
+		goto fail;
+	morse_rx_init(&r, (rate * 60u) / 1000u);
+	morse_tone_init(&t, &r, rate, frequency, rate / 100u);
+	for (size_t n; (n = fread(buf, 2 * channels, TEST_CHUNK, in)) > 0; ) {
+		for (size_t i = 0; i < n; i++)
+			samples[i] = (int16_t)test_le(buf + (i * 2 * channels), 2);
+		morse_tone_samples(&t, samples, n);
+		for (int c; (c = morse_rx_getc(&r, &no_data)) >= 0; )
+			fputc(c, out);
+	}
+	for (unsigned i = 0; i < 100; i++)
+		morse_rx_poll(&r, (rate / 100u) * i);
+	for (int c; (c = morse_rx_getc(&r, &no_data)) >= 0; )
+		fputc(c, out);
+	fputc('\n', out);
+	fclose(in);
+	return 0;
+fail:
+	fclose(in);
+	return -1;
+}
+
 int main(int argc, char **argv) {
 	if (argc == 1) {
+		const size_t packed = sizeof morse_codes + sizeof morse_tree;
+		const size_t old = MORSE_TABLE_COUNT * MORSE_OLD_CHARACTER_LENGTH;
+		if (test_table(stdout) < 0)
+			return 1;
+		fprintf(stdout, "tables %u bytes, were %u, %u bytes of flash saved\n",
+				(unsigned)packed, (unsigned)old, (unsigned)(old - packed));
 		test_decode(stdout, " . _ ");
 		test_decode(stdout, " . _ _ ");
 		test_decode(stdout, " _ ");
 		test_decode(stdout, " .");
 		test_decode(stdout, "_____");
 		test_decode(stdout, "_ __ _ _ ");
-		return 0;
+		test_speed(stdout);
+		if (test_tx(stdout, "sos") < 0 || test_tx(stdout, "cq cq de g4xyz 73, the quick brown fox jumps over the lazy dog 0123456789?") < 0)
+			return 1;
+		if (test_tx_speed(stdout) < 0)
+			return 1;
+		if (test_timing(stdout, "sos") < 0 || test_timing(stdout, " cq  cq de   g4xyz 73, the quick brown fox jumps over the lazy dog 0123456789?     ") < 0)
+			return 1;
+		static const char *text = "the quick brown fox jumps over the lazy dog 0123456789 ";
+		static const unsigned speeds[] = { 5, 12, 20, 30, 40 }, jitters[] = { 0, 10, 20, 30 };
+		int r = 0;
+		for (size_t i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+			for (size_t j = 0; j < sizeof(jitters) / sizeof(jitters[0]); j++)
+				if (test_rx(stdout, text, speeds[i], jitters[j], 0) > 10 && jitters[j] <= 20)
+					r = 1;
+		if (test_rx(stdout, text, 12, 10, 50) > 10 || test_rx(stdout, text, 30, 10, -40) > 10)
+			r = 1;
+		static const int snrs[] = { 20, 0, -5, -10 };
+		static const unsigned tone_speeds[] = { 12, 20, 30 };
+		for (size_t i = 0; i < sizeof(tone_speeds) / sizeof(tone_speeds[0]); i++)
+			for (size_t j = 0; j < sizeof(snrs) / sizeof(snrs[0]); j++)
+				if (test_tone(stdout, text, tone_speeds[i], snrs[j]) > 10 && snrs[j] >= 0)
+					r = 1;
+		test_tone_speed(stdout);
+		test_timing_speed(stdout);
+		return r;
 	}
 
+	if (argc >= 3 && !strcmp(argv[1], "-w"))
+		return test_wav(stdout, argv[2], argc > 3 ? (unsigned)atoi(argv[3]) : TEST_TONE) < 0;
+
 	if (argc != 2) {
-		fprintf(stderr, "usage: %s string\n", argv[0]);
-		return -1;
+		fprintf(stderr, "usage: %s string\n       %s -w file.wav [tone-Hz]\n", argv[0], argv[0]);
+		return 1;
 	}
 
-
-	if (morse_print_string(stdout, argv[1]) < 0)
-		return -1;
+	for (const char *s = argv[1]; *s; s++) {
+		char buf[MORSE_MAX_ELEMENTS + 1] = { 0 };
+		if (*s == ' ') {
+			fputs("    ", stdout);
+			continue;
+		}
+		if (morse_encode_character(*s, buf, sizeof buf) < 0)
+			return 1;
+		fprintf(stdout, "%s   ", buf);
+	}
 	fputc('\n', stdout);
 	return 0;
 }
@@ -7,8 +7,35 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 
+#define MORSE_MAX_ELEMENTS (6) /**< dots and dashes in the longest code */
+#define MORSE_ROOT         (1) /**< node decoding starts from, see 'morse_next' */
+
+/**@brief Look up the code for a character
+ * @param c character to look up
+ * @return a one bit followed by a bit for each element, one for a dash, the
+ * first element being the most significant, or zero if 'c' has no code */
+uint8_t morse_code(unsigned char c);
+
+/**@brief Encode a character as a string of '.' and '_'
+ * @return zero on success, negative if 'c' has no code or 'buffer' is not
+ * big enough, 'MORSE_MAX_ELEMENTS + 1' bytes always is */
 int morse_encode_character(unsigned char c, char *buffer, size_t length);
 
+/**@brief Step through the decoding tree, starting from 'MORSE_ROOT', once
+ * for each element received
+ * @return the next node, zero if the code is too long to be in the table */
+uint8_t morse_next(uint8_t node, int dash);
+
+/**@brief Decode the elements received so far
+ * @return the character reached at 'node', negative if there is none */
+int morse_decode_node(uint8_t node);
+
+/**@brief Decode a character written as '.' and '_', optionally separated by
+ * single spaces, skipping leading spaces
+ * @param endptr if not NULL, set to the first character not decoded
+ * @return the character decoded, negative if there is none */
+int morse_decode_character(const char *s, const char **endptr);
+
 #define MORSE_DOT_DELAY_MULTIPLIER    (1)
 #define MORSE_SPACE_DELAY_MULTIPLIER  (1)
 #define MORSE_DASH_DELAY_MULTIPLIER   (3)
@@ -17,6 +44,124 @@ int morse_encode_character(unsigned char c, char *buffer, size_t length);
 #define MORSE_SPACES_IN_CHAR_SEPARATOR    (3)
 #define MORSE_SPACES_IN_WORD_SEPARATOR    (7)
 
+#define MORSE_TIMING_MARK(B)  ((B) >> 4)   /**< units the key is down for */
+#define MORSE_TIMING_SPACE(B) ((B) & 0xFu) /**< units it is up for after */
+
+/**@brief Encoding text as a stream of timings, a byte for each element,
+ * giving how many units the key is down for and then up for, with
+ * 'MORSE_TIMING_MARK' and 'MORSE_TIMING_SPACE', ready for a timer to play
+ * out. A byte with no mark is a gap longer than fits in one. The gap after
+ * a character is held back until the next, as a space grows it into a gap
+ * between words, so text can be encoded in pieces. */
+typedef struct {
+	uint8_t held; /**< the last element encoded and not yet written, if any */
+} morse_timing_t;
+
+/**@brief Encode as much of 'text' as there is room for in 'timing',
+ * characters without a code being skipped
+ * @param written set to the bytes written to 'timing'
+ * @return characters of 'text' encoded */
+size_t morse_timing_encode(morse_timing_t *e, const uint8_t *text, size_t length, uint8_t *timing, size_t size, size_t *written);
+
+/**@brief Write out the element held back, at the end of the text
+ * @return bytes written, zero if there was nothing held or no room */
+size_t morse_timing_flush(morse_timing_t *e, uint8_t *timing, size_t size);
+
+/**@brief Encode all of 'text' in one go
+ * @return bytes written, or negative if 'timing' is too small, it never
+ * needs to be more than 'MORSE_MAX_ELEMENTS' times the length of 'text' */
+long morse_timing(const uint8_t *text, size_t length, uint8_t *timing, size_t size);
+
+#define MORSE_TX_QUEUE (16u) /**< characters queued for sending, a power of two */
+
+/**@brief A transmitter, characters are queued with 'morse_tx_put' and sent
+ * by calling 'morse_tx_tick' once every unit, from a timer interrupt, which
+ * says whether the key is down for that unit. Only 'head' is written by the
+ * one putting characters in and only 'tail' by the one ticking, so neither
+ * has to disable interrupts. */
+typedef struct {
+	volatile uint8_t queue[MORSE_TX_QUEUE];
+	volatile uint8_t head, tail;
+	uint8_t code;     /**< code of the character being sent */
+	uint8_t elements; /**< elements of it left to send */
+	uint8_t units;    /**< units left of the current mark or space */
+	uint8_t on;       /**< key down for the current mark */
+} morse_tx_t;
+
+/**@brief Queue a character to send, a space separates words
+ * @return one if it was queued, zero if the queue is full, negative if the
+ * character has no code */
+int morse_tx_put(morse_tx_t *t, unsigned char c);
+
+/**@brief Advance the transmitter by a unit
+ * @return non zero if the key is down for this unit */
+int morse_tx_tick(morse_tx_t *t);
+
+/**@brief Non zero whilst anything is queued or being sent */
+int morse_tx_busy(const morse_tx_t *t);
+
+#define MORSE_RX_QUEUE (8u)  /**< characters decoded and not yet read, a power of two */
+
+/**@brief A receiver, decoding the durations of a key being held down and
+ * released, in any unit of time, as they are made. The length of a dot is
+ * estimated from what is received so it follows the sender's speed.
+ * Characters decoded are queued to be read by 'morse_rx_getc'. */
+typedef struct {
+	uint16_t dot;   /**< estimated length of a dot */
+	uint8_t node;   /**< in the decoding tree, 'MORSE_ROOT' before any elements */
+	uint8_t gap;    /**< 0 within a character, 1 after one, 2 after a word */
+	uint8_t queue[MORSE_RX_QUEUE];
+	uint8_t head, tail;
+} morse_rx_t;
+
+/**@brief Start a receiver, with a guess at the length of a dot, the
+ * speed in words a minute being 1200 divided by it in milliseconds */
+void morse_rx_init(morse_rx_t *r, uint16_t dot);
+
+/**@brief The key has changed, the state it was in lasting 'duration' */
+void morse_rx_key(morse_rx_t *r, int down, uint16_t duration);
+
+/**@brief The key has been up for 'elapsed', which is called for whilst it
+ * stays up, ends a character or a word once the gap is long enough */
+void morse_rx_poll(morse_rx_t *r, uint16_t elapsed);
+
+/**@brief An 'embed_fgetc_t' reading the characters decoded by the receiver
+ * 'file', setting 'no_data' instead of waiting if there are none */
+int morse_rx_getc(void *file, int *no_data);
+
+#define MORSE_TONE_HOLD (2u) /**< blocks a change must last for to be believed */
+
+/**@brief A tone detector, turning audio of a Morse code tone being keyed,
+ * from a receiver, into the key changes fed to a 'morse_rx_t', timed in
+ * samples. The power at the frequency of the tone is measured for each block
+ * of samples with the Goertzel algorithm, and compared with the levels of
+ * noise and of the tone seen recently. */
+typedef struct {
+	morse_rx_t *rx;     /**< receiver fed, which counts time in samples */
+	int16_t coeff;      /**< '2cos(2 pi frequency / rate)', 14 fractional bits */
+	int32_t s1, s2;     /**< Goertzel filter state, within 30 bits */
+	uint16_t block;     /**< samples in a block */
+	uint16_t n;         /**< samples into the current block */
+	uint32_t noise;     /**< average magnitude with the tone off */
+	uint32_t peak;      /**< average magnitude with the tone on */
+	uint32_t elapsed;   /**< samples since the tone last changed */
+	uint8_t on;         /**< tone on */
+	uint8_t changed;    /**< blocks the tone has seemed to change for */
+	uint8_t quiet;      /**< blocks the noise was first measured over */
+} morse_tone_t;
+
+/**@brief Start a tone detector feeding 'rx', the smaller 'block' is
+ * the shorter the elements it can time, the larger the narrower the band it
+ * listens to is, 'rate / block' Hz wide. It is limited to '32768 sin(2 pi
+ * frequency / rate)' samples, so the filter can be run with 32-bit state and
+ * 16-bit multiplies, which is only a limit for tones near zero or half of
+ * 'rate'. */
+void morse_tone_init(morse_tone_t *t, morse_rx_t *rx, uint32_t rate, uint16_t frequency, uint16_t block);
+
+/**@brief Detect the tone in the next 'length' signed samples, of any length
+ * and any number of bits up to sixteen */
+void morse_tone_samples(morse_tone_t *t, const int16_t *samples, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
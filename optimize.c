@@ -0,0 +1,400 @@
+/**@file optimize.c
+ * @brief Peephole optimizer for eForth images
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * The compiler that produced the image does little optimization, leaving
+ * calls followed by an exit, branches to branches and instructions followed
+ * by an exit that could be merged into them. This tool finds those in an
+ * image and rewrites them in place, writing out a new 'image.c'. Nothing is
+ * moved, so the image stays the same size and all addresses in it stay
+ * valid, but fewer instructions are executed and the exits made unreachable
+ * are reported. Build with 'make optimize', or 'make host-opt' to build the
+ * host program with the optimized image, 'make check-optimize' checks that
+ * it behaves the same as the original.
+ *
+ * Usage: optimize [-v] [image.blk] > image-opt.c
+ *
+ * -v  list each change made to standard error
+ *
+ * The image linked in is used if no file is given.
+ *
+ * Code and data are mixed freely in the image, inline strings and the like
+ * follow calls to words that read them by popping their return address, so
+ * only cells known to be instructions are changed. Each word reached from the
+ * dictionary or the boot and throw vectors is summarized by how it uses the
+ * return stack of its caller:
+ *
+ * - the return address it returns to, normally its own, but for example the
+ *   word that 'variable' compiles a call to returns to its caller's, as it
+ *   pops its own to use as the address of the variable;
+ * - the deepest entry it reads or pops below its own return stack, as these
+ *   belong to its caller.
+ *
+ * The cell after a call is only known to be an instruction if the word
+ * called returns to it, and a call followed by an exit is only turned into a
+ * branch if the word called does not look at its return stack at all. Words
+ * that do anything more complicated, such as using 'rp@', are left alone, as
+ * is anything following a call to them. Code patched at run time, apart from
+ * by the installers in 'embed.c', would not be safe to change. */
+#include "embed.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FORTH_LIST     (45)     /**< cell holding the head of the forth word list */
+#define SYSTEM_LIST    (46)     /**< cell holding the head of the system word list */
+#define THROW_PC       (4)      /**< where the virtual machine jumps to on an error */
+#define EXIT           (0x601C) /**< ALU operation 0, R->PC and pop the return stack */
+#define MAX_DEPTH      (16)     /**< return stack entries tracked within a word */
+#define MAX_THREAD     (16)     /**< branches followed when threading one */
+#define NAME_LENGTH    (0x1F)   /**< bits of a name count that are its length */
+#define NAME_COMPILE   (0x20)   /**< compile only, inlined if not also immediate */
+#define NAME_IMMEDIATE (0x40)   /**< immediate */
+
+#define IS_LITERAL(X) ((X) & 0x8000)
+#define IS_ALU(X)     (((X) & 0xE000) == 0x6000)
+#define IS_CALL(X)    (((X) & 0xE000) == 0x4000)
+#define IS_ZBRANCH(X) (((X) & 0xE000) == 0x2000)
+#define IS_BRANCH(X)  (((X) & 0xE000) == 0x0000)
+#define TARGET(X)     ((X) & 0x1FFF)
+#define ALU_OP(X)     (((X) >> 8) & 0x1F)
+#define RD(X)         (delta[((X) >> 2) & 0x3])
+
+enum { CODE = 1u << 0, FALL = 1u << 1 }; /* cell flags */
+
+typedef struct {
+	int known; /**< zero if the word does something this cannot follow */
+	int level; /**< which return address it returns to, zero for its own */
+	int deep;  /**< deepest caller return stack entry used, -1 if none */
+} summary_t;
+
+static const int delta[] = { 0, 1, -2, -1 }; /* two bit signed value */
+static cell_t m[EMBED_CORE_SIZE];
+static size_t cells;
+static uint8_t flags[EMBED_CORE_SIZE], before[EMBED_CORE_SIZE];
+static summary_t summaries[EMBED_CORE_SIZE];
+static uint8_t entries[EMBED_CORE_SIZE]; /* cells called, or otherwise entered */
+static uint8_t headers[EMBED_CORE_SIZE]; /* cells of word headers, never code */
+
+/* State of a walk through a word, the return stack is modelled as 'pushed'
+ * values of the word's own on top of its caller's, of which 'popped' have
+ * been removed */
+typedef struct {
+	summary_t s;   /**< summary so far */
+	int ended;     /**< a path has ended, 's.level' is valid */
+	int mark;      /**< mark instructions, rather than summarizing */
+	int addressed; /**< a word called may have returned a return address */
+	uint8_t seen[EMBED_CORE_SIZE];
+	int8_t pushed[EMBED_CORE_SIZE], popped[EMBED_CORE_SIZE];
+} walk_t;
+
+static walk_t walker;
+
+static int fail(walk_t *w) {
+	w->s.known = 0;
+	return -1;
+}
+
+static void touch(walk_t *w, const int entry) {
+	if (entry > w->s.deep)
+		w->s.deep = entry;
+}
+
+static int end(walk_t *w, const int level) {
+	if (level > 0)
+		touch(w, level - 1);
+	if (w->ended && w->s.level != level)
+		return fail(w);
+	w->ended = 1;
+	w->s.level = level;
+	return 0;
+}
+
+static int pop(walk_t *w, int *pushed, int *popped) {
+	if (*pushed)
+		return (*pushed)--, 0;
+	if (*popped >= MAX_DEPTH)
+		return fail(w);
+	touch(w, *popped);
+	return (*popped)++, 0;
+}
+
+/* Follow the paths from 'pc', each path ends when it returns or branches to
+ * code already seen, the return stack must be the same on every path to an
+ * instruction. When summarizing, the walk is abandoned as soon as anything
+ * is found it cannot follow, when marking, only that path is. */
+static int walk(walk_t *w, cell_t pc, int pushed, int popped) {
+	for (;;) {
+		if (pc >= cells)
+			return fail(w);
+		if (headers[pc]) /* fell off the end of a word */
+			return fail(w);
+		if (w->seen[pc]) {
+			if (w->pushed[pc] != pushed || w->popped[pc] != popped)
+				return fail(w);
+			return 0;
+		}
+		w->seen[pc] = 1, w->pushed[pc] = pushed, w->popped[pc] = popped;
+		const cell_t x = m[pc];
+		if (w->mark)
+			flags[pc] |= CODE;
+		if (IS_LITERAL(x)) {
+			/* falls through */
+		} else if (IS_ALU(x)) {
+			const unsigned alu = ALU_OP(x);
+			const int rd = RD(x);
+			if (alu == 19 || alu == 21) /* rp@ rp! */
+				return fail(w);
+			if ((alu == 2 || alu == 27) && !pushed) /* r@ and yield read the top */
+				touch(w, popped);
+			if (x & 0x10) { /* R->PC */
+				if (rd != -1 || (x & 0x40) || pushed > 1)
+					return fail(w);
+				/* with one value of its own pushed, this jumps to
+				 * it like 'execute' does, which is assumed to return
+				 * where this would have, but only if that value
+				 * cannot be a return address */
+				if (pushed && (w->s.deep >= 0 || w->addressed))
+					return fail(w);
+				return end(w, popped);
+			}
+			if (rd > 0) {
+				if (++pushed > MAX_DEPTH)
+					return fail(w);
+			} else {
+				for (int i = 0; i < -rd; i++)
+					if (pop(w, &pushed, &popped) < 0)
+						return -1;
+				if ((x & 0x40) && !pushed) { /* overwrites the top */
+					if (pop(w, &pushed, &popped) < 0)
+						return -1;
+					pushed = 1;
+				}
+			}
+		} else if (IS_CALL(x)) {
+			const cell_t t = TARGET(x);
+			entries[t] = 1;
+			const summary_t *s = &summaries[t];
+			if (!s->known)
+				return fail(w);
+			if (s->level == 0) {
+				if (s->deep > 0)
+					return fail(w);
+				w->addressed |= s->deep == 0; /* it can return its return address */
+			} else {
+				/* returns to an entry of ours, or of our caller */
+				const int idx = s->level - 1;
+				if (s->deep > s->level || idx < pushed)
+					return fail(w);
+				return end(w, popped + idx - pushed);
+			}
+		} else if (IS_ZBRANCH(x)) {
+			if (walk(w, TARGET(x), pushed, popped) < 0 && !w->mark)
+				return -1;
+		} else { /* branch */
+			pc = TARGET(x);
+			continue;
+		}
+		if (w->mark)
+			flags[pc] |= FALL;
+		pc++;
+	}
+}
+
+static summary_t summarize(const cell_t entry) {
+	walk_t *w = &walker;
+	memset(w->seen, 0, sizeof w->seen);
+	w->s.known = 1, w->s.level = 0, w->s.deep = -1;
+	w->ended = 0, w->mark = 0, w->addressed = 0;
+	if (walk(w, entry, 0, 0) < 0 || !w->ended)
+		w->s.known = 0;
+	return w->s;
+}
+
+/* Mark every cell known to be an instruction, and those whose successor is
+ * executed after them */
+static void mark(void) {
+	walk_t *w = &walker;
+	memset(flags, 0, sizeof flags);
+	memset(w->seen, 0, sizeof w->seen);
+	w->mark = 1;
+	for (size_t i = 0; i < cells; i++)
+		if (entries[i]) {
+			w->s.known = 1, w->s.level = 0, w->s.deep = -1;
+			w->ended = 0, w->addressed = 0;
+			(void)walk(w, i, 0, 0);
+		}
+}
+
+static size_t analyse(void) {
+	size_t known = 0;
+	int changed = 1;
+	memset(summaries, 0, sizeof summaries);
+	/* summaries only go from unknown to known, once everything a word
+	 * calls is known, so this terminates */
+	while (changed) {
+		changed = 0, known = 0;
+		for (size_t i = 0; i < cells; i++) {
+			if (!entries[i])
+				continue;
+			if (!summaries[i].known) {
+				summaries[i] = summarize(i);
+				changed |= summaries[i].known;
+			}
+			known += summaries[i].known;
+		}
+	}
+	mark();
+	return known;
+}
+
+/* Words in the dictionary are entry points, apart from those that are only
+ * compiled inline, such as '>r', which have no exit */
+static void entry_words(cell_t head) {
+	for (size_t i = 0; head && i < cells; i++) {
+		const cell_t link = head >> 1;
+		if ((size_t)link + 1 >= cells)
+			return;
+		const unsigned count = m[link + 1] & 0xFF, length = count & NAME_LENGTH;
+		const cell_t xt = link + 1 + ((length + 2) >> 1);
+		for (cell_t j = link; j < xt && j < cells; j++)
+			headers[j] = 1;
+		if (xt < cells && (count & (NAME_COMPILE | NAME_IMMEDIATE)) != NAME_COMPILE)
+			entries[xt] = 1;
+		head = m[link];
+	}
+}
+
+static int clean(const cell_t t) {
+	return summaries[t].known && summaries[t].level == 0 && summaries[t].deep < 0;
+}
+
+static int verbose = 0;
+
+static void change(const char *what, cell_t pc, cell_t from, cell_t to) {
+	if (verbose)
+		fprintf(stderr, "%5u: %04X -> %04X %s\n", (unsigned)pc, (unsigned)from, (unsigned)to, what);
+	m[pc] = to;
+}
+
+static unsigned thread(void) {
+	unsigned n = 0;
+	for (size_t i = 0; i < cells; i++) {
+		const cell_t x = m[i];
+		if (!(flags[i] & CODE) || IS_LITERAL(x) || IS_ALU(x))
+			continue;
+		cell_t t = TARGET(x);
+		for (int j = 0; j < MAX_THREAD && t < cells && (flags[t] & CODE) && IS_BRANCH(m[t]) && TARGET(m[t]) != t; j++)
+			t = TARGET(m[t]);
+		if (IS_BRANCH(x) && t < cells && (flags[t] & CODE) && m[t] == EXIT) {
+			change("branch to exit", i, x, EXIT);
+			n++;
+		} else if (t != TARGET(x)) {
+			change("branch threaded", i, x, (x & 0xE000) | t);
+			n++;
+		}
+	}
+	return n;
+}
+
+static unsigned tail_calls(void) {
+	unsigned n = 0;
+	for (size_t i = 0; i + 1 < cells; i++) {
+		const cell_t x = m[i];
+		if ((flags[i] & (CODE | FALL)) == (CODE | FALL) && IS_CALL(x) &&
+				(flags[i + 1] & CODE) && m[i + 1] == EXIT && clean(TARGET(x))) {
+			change("tail call", i, x, TARGET(x));
+			n++;
+		}
+	}
+	return n;
+}
+
+/* The J1 instruction set allows an exit to be merged into any ALU
+ * instruction that does not itself use the return stack */
+static unsigned fuse(void) {
+	unsigned n = 0;
+	for (size_t i = 0; i + 1 < cells; i++) {
+		const cell_t x = m[i];
+		if ((flags[i] & (CODE | FALL)) != (CODE | FALL) || !IS_ALU(x))
+			continue;
+		const unsigned alu = ALU_OP(x);
+		if ((x & 0x5C) || alu == 2 || alu == 19 || alu == 21 || alu == 27)
+			continue;
+		if ((flags[i + 1] & CODE) && m[i + 1] == EXIT) {
+			change("exit fused", i, x, x | (EXIT & 0x1C));
+			n++;
+		}
+	}
+	return n;
+}
+
+static int load(const char *name) {
+	if (!name) {
+		cells = embed_default_block_size / 2;
+		for (size_t i = 0; i < cells; i++)
+			m[i] = embed_default_block[i * 2] | ((cell_t)embed_default_block[i * 2 + 1] << 8);
+		return 0;
+	}
+	FILE *f = fopen(name, "rb");
+	if (!f)
+		return -1;
+	uint8_t b[2];
+	for (cells = 0; cells < EMBED_CORE_SIZE && fread(b, 1, 2, f) == 2; cells++)
+		m[cells] = b[0] | ((cell_t)b[1] << 8);
+	fclose(f);
+	return cells > SYSTEM_LIST ? 0 : -1;
+}
+
+static void save(FILE *out) {
+	fprintf(out, "/* eForth image */\n#include \"embed.h\"\n\nconst EMBED_PROGMEM uint8_t embed_default_block[] = {\n");
+	for (size_t i = 0; i < cells * 2; i++) {
+		const unsigned byte = (m[i >> 1] >> ((i & 1) * 8)) & 0xFF;
+		fprintf(out, "%u%s,%s", byte, i == 38 ? "/* 1 = enable CRC check*/" : "", (i % 25) == 24 ? "\n" : "");
+	}
+	fprintf(out, "\n};\n\nconst size_t embed_default_block_size =  %u;\n\n", (unsigned)(cells * 2));
+}
+
+int main(int argc, char **argv) {
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-v] [image.blk]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (load(i < argc ? argv[i] : NULL) < 0) {
+		fprintf(stderr, "could not load image\n");
+		return 1;
+	}
+	entry_words(m[FORTH_LIST]);
+	entry_words(m[SYSTEM_LIST]);
+	entries[m[0]] = 1;
+	entries[THROW_PC] = 1;
+
+	analyse();
+	memcpy(before, flags, sizeof before);
+	unsigned threaded = thread();
+	analyse();
+	const unsigned tails = tail_calls();
+	const unsigned fused = fuse();
+	analyse();
+	threaded += thread();
+	const size_t known = analyse();
+	size_t words = 0, code = 0, unreachable = 0;
+	for (size_t j = 0; j < cells; j++) {
+		words += entries[j];
+		code  += !!(before[j] & CODE);
+		unreachable += (before[j] & CODE) && !(flags[j] & CODE);
+	}
+	fprintf(stderr, "%u words, %u followed\n", (unsigned)words, (unsigned)known);
+	fprintf(stderr, "%u branches threaded, %u tail calls, %u exits fused\n", threaded, tails, fused);
+	fprintf(stderr, "%u of %u cells known to be code, %u now unreachable\n",
+			(unsigned)code, (unsigned)cells, (unsigned)unreachable);
+	save(stdout);
+	return 0;
+}
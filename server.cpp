@@ -0,0 +1,384 @@
+/**@file server.cpp
+ * @brief eForth consoles for many local clients over a Unix domain socket
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * Each connection gets its own virtual machine, run as an 'embed::session'
+ * from a single epoll loop. The image is loaded once into a memory file and
+ * each core is a private mapping of it, so the pages of the image are shared
+ * between all sessions until one of them writes to a page. Input is fed to
+ * a session as it arrives, until it has a few kilobytes it has not read yet,
+ * and output is written back without blocking, a session that has not had
+ * its output read is not run until it has. Each session runs for at most its
+ * instruction budget before the others get a turn. Build with 'make server'.
+ *
+ * Usage:
+ *
+ *	server [-b budget] path
+ *	server -l clients commands path
+ *
+ * The first form serves consoles on 'path', try 'socat - UNIX-CONNECT:path'.
+ * The second is a load generator, it starts a server on 'path', connects
+ * 'clients' times and sends each 'commands' lines one after another, then
+ * reports the latency of the lines, measured from sending one to the 'ok'
+ * prompt after it, and the processor time and memory used by the server. */
+#include "embed.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const size_t core_bytes = EMBED_GUARDED_SIZE * sizeof(cell_t);
+static const size_t high_water = 4096; /**< unwritten output at which a session is held back */
+static const size_t input_limit = 4096; /**< unread input at which a client is no longer read from */
+
+struct client {
+	client(int fd, cell_t *core) : fd(fd), core(core), session(core, 512) { }
+	~client() { close(fd); munmap(core, core_bytes); }
+	int fd;
+	cell_t *core;          /**< private mapping of the shared image */
+	embed::session session;
+	std::string out;       /**< output not yet written to the socket */
+	bool queued = false;   /**< on the run queue, it used up its budget */
+	uint32_t events = EPOLLIN | EPOLLRDHUP; /**< events being waited for */
+};
+
+class server {
+public:
+	server(int image, int listener, int poll, unsigned long budget) :
+		image(image), listener(listener), poll(poll), budget(budget) { }
+
+	int loop() {
+		std::vector<epoll_event> events(64);
+		for (;;) {
+			const int n = epoll_wait(poll, events.data(), events.size(), queue.empty() ? -1 : 0);
+			if (n < 0 && errno != EINTR)
+				return -1;
+			for (int i = 0; i < n; i++) {
+				const int fd = events[i].data.fd;
+				if (fd == listener) {
+					accept_all();
+					continue;
+				}
+				auto it = clients.find(fd);
+				if (it == clients.end())
+					continue;
+				client &c = *it->second;
+				if ((events[i].events & EPOLLOUT) && flush(c) < 0) {
+					drop(c);
+					continue;
+				}
+				if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && receive(c) < 0) {
+					drop(c);
+					continue;
+				}
+				run(c);
+			}
+			/* give each session that used up its budget another turn */
+			for (size_t i = queue.size(); i; i--) {
+				const int fd = queue.front();
+				queue.pop_front();
+				auto it = clients.find(fd);
+				if (it == clients.end())
+					continue;
+				it->second->queued = false;
+				run(*it->second);
+			}
+		}
+	}
+
+private:
+	void accept_all() {
+		for (;;) {
+			const int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+				return;
+			void *core = mmap(NULL, core_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, image, 0);
+			if (core == MAP_FAILED) {
+				close(fd);
+				continue;
+			}
+			auto c = std::make_unique<client>(fd, (cell_t*)core);
+			c->session.budget(budget);
+			c->session.vm()->o.masked = 1;
+			epoll_event ev {};
+			ev.events = c->events;
+			ev.data.fd = fd;
+			if (epoll_ctl(poll, EPOLL_CTL_ADD, fd, &ev) < 0)
+				continue;
+			client &r = *c;
+			clients[fd] = std::move(c);
+			run(r);
+		}
+	}
+
+	int receive(client &c) {
+		char buf[512];
+		while (c.session.pending() < input_limit) {
+			const ssize_t r = read(c.fd, buf, std::min(sizeof buf, input_limit - c.session.pending()));
+			if (r > 0) {
+				c.session.feed(std::string_view(buf, r));
+				continue;
+			}
+			if (r == 0) {
+				c.session.close();
+				return 0;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		return watch(c);
+	}
+
+	/* Wait for the socket to become writable while there is output left
+	 * over, and to become readable only while the session is not too far
+	 * behind with its input */
+	int watch(client &c) {
+		const uint32_t events = (c.session.pending() < input_limit ? (uint32_t)(EPOLLIN | EPOLLRDHUP) : 0u) |
+			(c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+		if (events == c.events)
+			return 0;
+		epoll_event ev {};
+		ev.events = events;
+		ev.data.fd = c.fd;
+		if (epoll_ctl(poll, EPOLL_CTL_MOD, c.fd, &ev) < 0)
+			return -1;
+		c.events = events;
+		return 0;
+	}
+
+	int flush(client &c) {
+		while (!c.out.empty()) {
+			const ssize_t r = write(c.fd, c.out.data(), c.out.size());
+			if (r < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return -1;
+				break;
+			}
+			c.out.erase(0, r);
+		}
+		return watch(c);
+	}
+
+	/* Run a session until it wants input, uses up its budget or has more
+	 * output than can be written right now */
+	void run(client &c) {
+		if (c.queued)
+			return;
+		while (c.out.size() < high_water) {
+			const embed::status st = c.session.resume();
+			c.out += c.session.output();
+			c.session.output().clear();
+			if (flush(c) < 0 || st == embed::status::halted) {
+				drop(c);
+				return;
+			}
+			if (st == embed::status::input)
+				return;
+			if (st == embed::status::slice) {
+				c.queued = true;
+				queue.push_back(c.fd);
+				return;
+			}
+		}
+	}
+
+	void drop(client &c) {
+		flush(c);
+		epoll_ctl(poll, EPOLL_CTL_DEL, c.fd, NULL);
+		clients.erase(c.fd);
+	}
+
+	int image, listener, poll;
+	unsigned long budget;
+	std::unordered_map<int, std::unique_ptr<client>> clients;
+	std::deque<int> queue;
+};
+
+/* The image is loaded into a memory file once, each session maps it
+ * privately so its pages are only copied when written to. The core is large
+ * enough for the masked virtual machine, the guard region costs nothing
+ * until it is written to. The native dictionary search and block memory
+ * operations are installed into the shared image. */
+static int image_create(void) {
+	const int fd = memfd_create("embed", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, core_bytes) < 0)
+		return -1;
+	void *core = mmap(NULL, core_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (core == MAP_FAILED)
+		return -1;
+	embed_t h {};
+	h.m = core;
+	cell_t xt[4] = { 0 };
+	int r = embed_default(&h);
+	if (r >= 0)
+		r = embed_eval(&h, "' search-wordlist ' cmove ' fill ' compare\n");
+	if (r >= 0)
+		r = embed_popn(&h, xt, 4);
+	if (r >= 0)
+		r = embed_find_install(&h, xt[0]) | embed_block_install(&h, xt[1], EMBED_BLOCK_MOVE) |
+			embed_block_install(&h, xt[2], EMBED_BLOCK_FILL) | embed_block_install(&h, xt[3], EMBED_BLOCK_COMPARE);
+	embed_reset(&h); /* so each session boots, with a banner and prompts */
+	munmap(core, core_bytes);
+	return r < 0 ? -1 : fd;
+}
+
+static int listen_on(const char *path) {
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path)
+		return -1;
+	strcpy(addr.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (sockaddr*)&addr, sizeof addr) < 0 || listen(fd, SOMAXCONN) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int serve(const char *path, unsigned long budget) {
+	const int image = image_create(), listener = listen_on(path), poll = epoll_create1(EPOLL_CLOEXEC);
+	if (image < 0 || listener < 0 || poll < 0) {
+		perror("server");
+		return -1;
+	}
+	epoll_event ev {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listener;
+	if (epoll_ctl(poll, EPOLL_CTL_ADD, listener, &ev) < 0)
+		return -1;
+	server s(image, listener, poll, budget);
+	return s.loop();
+}
+
+/* Load generator, each client sends a line, waits for the 'ok' prompt that
+ * follows it and sends the next */
+struct load_client {
+	int fd = -1;
+	unsigned sent = 0;
+	std::string in;
+	std::chrono::steady_clock::time_point start;
+};
+
+static int load(const char *path, unsigned clients, unsigned commands) {
+	static const char line[] = "1 2 + . 3 4 * . here . cr\n";
+	using clock = std::chrono::steady_clock;
+	std::vector<load_client> c(clients);
+	std::vector<double> latencies;
+	latencies.reserve((size_t)clients * commands);
+	const int poll = epoll_create1(EPOLL_CLOEXEC);
+	if (poll < 0)
+		return -1;
+	sockaddr_un addr {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+	for (unsigned i = 0; i < clients; i++) {
+		c[i].fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (c[i].fd < 0 || connect(c[i].fd, (sockaddr*)&addr, sizeof addr) < 0) {
+			perror("connect");
+			return -1;
+		}
+		epoll_event ev {};
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		epoll_ctl(poll, EPOLL_CTL_ADD, c[i].fd, &ev);
+	}
+	const auto begin = clock::now();
+	for (unsigned i = 0; i < clients; i++) {
+		c[i].start = clock::now();
+		if (write(c[i].fd, line, sizeof line - 1) < 0)
+			return -1;
+	}
+	std::vector<epoll_event> events(64);
+	for (unsigned done = 0; done < clients;) {
+		const int n = epoll_wait(poll, events.data(), events.size(), 10000);
+		if (n <= 0) {
+			fprintf(stderr, "load: timed out\n");
+			return -1;
+		}
+		for (int j = 0; j < n; j++) {
+			load_client &l = c[events[j].data.u32];
+			char buf[512];
+			const ssize_t r = read(l.fd, buf, sizeof buf);
+			if (r <= 0) {
+				fprintf(stderr, "load: connection closed\n");
+				return -1;
+			}
+			l.in.append(buf, r);
+			if (l.in.find("ok\r\n") == std::string::npos)
+				continue;
+			latencies.push_back(std::chrono::duration<double>(clock::now() - l.start).count());
+			l.in.clear();
+			if (++l.sent == commands) {
+				done++;
+				close(l.fd);
+				continue;
+			}
+			l.start = clock::now();
+			if (write(l.fd, line, sizeof line - 1) < 0)
+				return -1;
+		}
+	}
+	const double taken = std::chrono::duration<double>(clock::now() - begin).count();
+	std::sort(latencies.begin(), latencies.end());
+	const size_t count = latencies.size();
+	printf("%u clients, %zu commands in %.3f s, %.0f commands/s\n", clients, count, taken, count / taken);
+	printf("latency p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+			latencies[count / 2] * 1e3, latencies[(count * 99) / 100] * 1e3, latencies[count - 1] * 1e3);
+	return 0;
+}
+
+/* Run a server in a child process to generate load for, so the resources
+ * it used can be measured on its own */
+static int load_server(const char *path, unsigned clients, unsigned commands) {
+	const pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0)
+		_exit(serve(path, 10000) < 0 ? 1 : 0);
+	usleep(100000);
+	const int r = load(path, clients, commands);
+	int status = 0;
+	rusage u {};
+	kill(pid, SIGTERM);
+	if (wait4(pid, &status, 0, &u) < 0)
+		return -1;
+	const double cpu = u.ru_utime.tv_sec + u.ru_stime.tv_sec + (u.ru_utime.tv_usec + u.ru_stime.tv_usec) / 1e6;
+	printf("server %.3f s processor time, %.0f commands per processor second, %ld KB peak, %.1f KB per session\n",
+			cpu, (double)clients * commands / cpu, u.ru_maxrss, (double)u.ru_maxrss / clients);
+	return r;
+}
+
+int main(int argc, char **argv) {
+	signal(SIGPIPE, SIG_IGN);
+	const char *path = argv[argc - 1]; /* not an option mistaken for one */
+	if (argc > 1 && path[0] != '-') {
+		if (argc == 5 && !strcmp(argv[1], "-l"))
+			return load_server(path, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0)) < 0 ? 1 : 0;
+		if (argc == 4 && !strcmp(argv[1], "-b"))
+			return serve(path, strtoul(argv[2], NULL, 0)) < 0 ? 1 : 0;
+		if (argc == 2)
+			return serve(path, 10000) < 0 ? 1 : 0;
+	}
+	fprintf(stderr, "usage: %s [-b budget] path\n       %s -l clients commands path\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,83 @@
+/**@file sessions.cpp
+ * @brief Run many eForth sessions on one thread with 'embed::session'
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * Each session is fed the same script a line at a time, as if a user was
+ * typing it in, and all of them are interleaved on the one thread. The
+ * output of each session is checked against the first and the cost of
+ * suspending and resuming a session is reported. Build with
+ * 'make sessions'.
+ *
+ * Usage: sessions [count] */
+#include "embed.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+static const char *script[] = {
+	": sq dup * ;\n",
+	"7 sq . cr\n",
+	": countdown begin dup . 1- dup 0= until drop ;\n",
+	"10 countdown cr\n",
+	"variable total 0 total !\n",
+	": add 99 for r@ total +! next ; add total @ . cr\n",
+};
+
+int main(int argc, char **argv) {
+	const size_t count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+	const size_t lines = sizeof(script) / sizeof(script[0]);
+	std::vector<std::unique_ptr<embed::session>> sessions;
+	std::vector<size_t> fed(count, 0);
+	std::vector<std::string> outputs(count);
+	for (size_t i = 0; i < count; i++) {
+		sessions.push_back(std::make_unique<embed::session>(64));
+		sessions.back()->vm()->o.options = EMBED_VM_QUITE_ON;
+	}
+	/* Sessions waiting on input with none to give them are resumed a few
+	 * times first, which is the cost of switching to a session and back */
+	const unsigned idle = 10;
+	for (size_t i = 0; i < count; i++)
+		if (sessions[i]->resume() != embed::status::input)
+			return 1;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned j = 0; j < idle; j++)
+		for (size_t i = 0; i < count; i++)
+			if (sessions[i]->resume() != embed::status::input)
+				return 1;
+	const std::chrono::duration<double> switching = std::chrono::steady_clock::now() - start;
+
+	start = std::chrono::steady_clock::now();
+	unsigned long resumes = 0;
+	for (size_t running = count; running;) {
+		running = 0;
+		for (size_t i = 0; i < count; i++) {
+			embed::session &s = *sessions[i];
+			embed::status st = s.resume();
+			resumes++;
+			outputs[i] += s.output();
+			s.output().clear();
+			if (st == embed::status::input) {
+				if (fed[i] < lines)
+					s.feed(script[fed[i]++]);
+				else
+					s.close();
+			}
+			running += st != embed::status::halted;
+		}
+	}
+	const std::chrono::duration<double> taken = std::chrono::steady_clock::now() - start;
+	for (size_t i = 1; i < count; i++) {
+		if (outputs[i] != outputs[0]) {
+			fprintf(stderr, "session %zu output differs\n", i);
+			return 1;
+		}
+	}
+	fputs(outputs[0].c_str(), stdout);
+	printf("%zu sessions, %lu resumes, %.3f s, %.2f us per resume\n",
+			count, resumes, taken.count(), (taken.count() * 1e6) / resumes);
+	printf("idle resume %.3f us\n", (switching.count() * 1e6) / (count * idle));
+	return 0;
+}
@@ -0,0 +1,436 @@
+/**@file shrink.c
+ * @brief Remove the words an application does not need from an eForth image
+ * @author Richard James Howe
+ * @license MIT
+ *
+ * The default image holds a complete eForth system, most of which a finished
+ * application never uses, and on the smaller AVRs every word costs flash and
+ * makes the dictionary slower to search. Given the names of the words an
+ * application needs, this tool keeps those and everything they or the
+ * interpreter can reach, drops the rest, relinks the word lists and moves the
+ * code that is left down to close the gaps, writing out a new 'image.c' that
+ * boots to the interpreter as before. What was kept and the size saved are
+ * reported to standard error. Build with 'make shrink', 'make check-shrink'
+ * builds the host program with a reduced image and checks it behaves the
+ * same as the original.
+ *
+ * Usage: shrink [-a] [-v] [-f file] [-i image.blk] [word...] > image-small.c
+ *
+ * -a       keep the headers of every word kept, not only of those named
+ * -v       list every word and whether it was kept
+ * -f file  keep the words named in a file, such as the source of the
+ *          application, anything in it that is not a word is ignored
+ * -i file  shrink the image in a file instead of the one linked in
+ *
+ * Words only called by those named lose their headers, unless '-a' is given,
+ * so they can no longer be found by the interpreter. Words used when
+ * extending the system at run time, such as ':', ';' and 'if', have to be
+ * named to be kept.
+ *
+ * Code and data are mixed in the image, so moving code means telling them
+ * apart. Each word is swept from its start taking every cell to be an
+ * instruction, apart from those following a call to a word known to read
+ * what follows the call: the runtimes of variables, constants, 'next' and
+ * the string words, and 'compile'. Calls and branches are relocated, as are
+ * literals and variables holding the address of the start of a word, other
+ * numbers are left as they are. The cells below 'KERNEL' hold the registers,
+ * the system variables and the words the compiler inlines, they are always
+ * kept and never move. Only the layout of the default image is known, an
+ * image extended and saved with 'save' can be shrunk, but not if it defines
+ * words that read data compiled after calls to them, and a literal number
+ * that happens to be the address of a word would be changed. */
+#include "embed.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KERNEL      (290)  /**< cells below this are always kept and never move */
+#define IMAGE_SIZE  (15)   /**< cell holding the size of the image in bytes */
+#define CP          (44)   /**< cell holding the dictionary pointer */
+#define THROW_PC    (4)    /**< where the virtual machine jumps to on an error */
+#define BOOT        (20)   /**< first instruction executed */
+#define DOVAR       (21)   /**< 'r> exit', called by variables and created words */
+#define DOCONST     (23)   /**< 'r> @ exit', called by constants */
+#define NEXT        (587)  /**< runtime of 'next', the address looped to follows a call */
+#define COMPILE     (1586) /**< 'compile', the instruction it compiles follows a call */
+#define STRING      (1611) /**< called first by the runtimes of '$"', '."' and 'abort"' */
+#define NAME_LENGTH (0x1F) /**< bits of a name count that are its length */
+
+#define IS_LITERAL(X) ((X) & 0x8000)
+#define IS_ALU(X)     (((X) & 0xE000) == 0x6000)
+#define IS_CALL(X)    (((X) & 0xE000) == 0x4000)
+#define IS_BRANCH(X)  (((X) & 0xE000) == 0x0000)
+#define TARGET(X)     ((X) & 0x1FFF)
+
+/* the heads of the root, editor, forth and system word lists */
+static const cell_t lists[] = { 25, 26, 45, 46 };
+
+enum { RAW, HEADER, CODE, DATA, TEXT, ADDRESS }; /* what a cell holds */
+enum { NONE, CELL, BYTE };                       /* how it refers to another */
+
+typedef struct {
+	cell_t link, xt, end; /**< header, first instruction and end of a word */
+	int kept, named;      /**< the word is kept, and so is its header */
+} word_t;
+
+static cell_t m[EMBED_CORE_SIZE], out[EMBED_CORE_SIZE], moved[EMBED_CORE_SIZE];
+static size_t cells;
+static uint8_t kind[EMBED_CORE_SIZE], start[EMBED_CORE_SIZE], keep[EMBED_CORE_SIZE];
+static int owner[EMBED_CORE_SIZE]; /* word each cell is part of, -1 if none */
+static int piece[EMBED_CORE_SIZE]; /* piece each cell is part of, -1 if none */
+static cell_t first[EMBED_CORE_SIZE];
+static uint8_t kept[EMBED_CORE_SIZE];
+static word_t words[EMBED_CORE_SIZE / 2];
+static size_t nwords;
+
+static int byte(size_t addr) {
+	return (m[addr >> 1] >> ((addr & 1) * 8)) & 0xFF;
+}
+
+static int compare_words(const void *a, const void *b) {
+	const word_t *x = a, *y = b;
+	return (int)x->link - (int)y->link;
+}
+
+static int dictionary(void) {
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		for (cell_t head = m[lists[i]]; head; head = m[head >> 1]) {
+			const cell_t link = head >> 1;
+			if ((head & 1) || (size_t)link + 1 >= cells || nwords >= sizeof(words) / sizeof(words[0]))
+				return -1;
+			const cell_t xt = link + 1 + (((m[link + 1] & NAME_LENGTH) + 2) >> 1);
+			if (xt >= cells)
+				return -1;
+			int seen = 0;
+			for (size_t j = 0; j < nwords; j++)
+				seen |= words[j].link == link;
+			if (seen)
+				break;
+			words[nwords].link = link, words[nwords].xt = xt;
+			nwords++;
+		}
+	}
+	qsort(words, nwords, sizeof(words[0]), compare_words);
+	for (size_t i = 0; i < cells; i++)
+		owner[i] = -1;
+	for (size_t i = 0; i < nwords; i++) {
+		words[i].end = i + 1 < nwords ? words[i + 1].link : cells;
+		if (words[i].xt > words[i].end)
+			return -1;
+		for (cell_t j = words[i].link; j < words[i].end; j++)
+			owner[j] = i;
+	}
+	return nwords && words[0].link < KERNEL && owner[KERNEL] >= 0 && words[owner[KERNEL]].link == KERNEL ? 0 : -1;
+}
+
+/* Classify the cells of a word, each is an instruction unless it follows a
+ * call to a word that reads what follows the call */
+static void sweep(cell_t pc, const cell_t end) {
+	while (pc < end) {
+		const cell_t x = m[pc];
+		kind[pc++] = CODE;
+		if (!IS_CALL(x) || pc >= end)
+			continue;
+		const cell_t t = TARGET(x);
+		if (t == DOVAR || t == DOCONST) {
+			while (pc < end)
+				kind[pc++] = t == DOVAR ? DATA : RAW;
+		} else if (t == NEXT) {
+			kind[pc++] = ADDRESS;
+		} else if (t == COMPILE) {
+			kind[pc++] = CODE;
+		} else if (t < cells && m[t] == (0x4000 | STRING)) {
+			for (cell_t n = ((m[pc] & 0xFF) + 2) >> 1; n && pc < end; n--)
+				kind[pc++] = TEXT;
+		}
+	}
+}
+
+static int ends(const cell_t x) {
+	return IS_BRANCH(x) || (IS_ALU(x) && (x & 0x10));
+}
+
+/* A number is taken to be an address if it is that of the start of a word
+ * that can move, code that follows the end of other code or is called */
+static int word_address(const cell_t v, cell_t *to) {
+	if ((v & 1) || (v >> 1) < KERNEL || (v >> 1) >= cells || !start[v >> 1])
+		return NONE;
+	*to = v >> 1;
+	return BYTE;
+}
+
+static int refers(const cell_t i, cell_t *to) {
+	const cell_t x = m[i];
+	switch (kind[i]) {
+	case CODE:
+		if (IS_LITERAL(x))
+			return word_address(x & 0x7FFF, to);
+		if (IS_ALU(x) || TARGET(x) >= cells)
+			return NONE;
+		*to = TARGET(x);
+		return CELL;
+	case DATA:
+		return word_address(x, to);
+	case ADDRESS:
+		if ((x & 1) || (x >> 1) >= cells)
+			return NONE;
+		*to = x >> 1;
+		return BYTE;
+	}
+	return NONE;
+}
+
+static int classify(void) {
+	static const cell_t fixed[] = { 0, 7, THROW_PC, BOOT }; /* pc, its shadow and entry points */
+	if (m[DOVAR] != 0x628D || m[DOVAR + 1] != 0x601C || m[DOCONST] != 0x628D || m[DOCONST + 1] != 0x631C)
+		return -1;
+	for (size_t i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++)
+		kind[fixed[i]] = CODE;
+	sweep(DOVAR, DOCONST + 2);
+	for (size_t i = 0; i < nwords; i++) {
+		for (cell_t j = words[i].link; j < words[i].xt; j++)
+			kind[j] = HEADER;
+		sweep(words[i].xt, words[i].end);
+		start[words[i].xt] = 1;
+	}
+	kind[CP] = RAW;
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+		kind[lists[i]] = RAW;
+	for (size_t i = 0; i < cells; i++) {
+		const cell_t x = m[i];
+		if (kind[i] != CODE)
+			continue;
+		if (IS_CALL(x) && TARGET(x) < cells)
+			start[TARGET(x)] = 1;
+		if (i + 1 < cells && kind[i + 1] == CODE && ends(x))
+			start[i + 1] = 1;
+	}
+	/* everything referred to has to be code, or the sweep went wrong */
+	for (size_t i = 0; i < cells; i++) {
+		cell_t t = 0;
+		if (refers(i, &t) != NONE && kind[t] != CODE) {
+			fprintf(stderr, "cell %u refers to %u, which is not code\n", (unsigned)i, (unsigned)t);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Split the image into pieces that are kept or dropped as a whole, at the
+ * start of each word and of any code following the end of other code, which
+ * can only be reached by referring to it. Most words are followed by the
+ * headerless words defined after them, which are often used elsewhere. */
+static void split(void) {
+	int p = -1;
+	for (size_t i = 0; i < cells; i++) {
+		const int w = owner[i];
+		if (w >= 0 && (words[w].link == i || (kind[i] == CODE && kind[i - 1] == CODE && ends(m[i - 1]))))
+			first[++p] = i;
+		piece[i] = p;
+	}
+}
+
+static void reach(const cell_t c, cell_t *stack, size_t *sp) {
+	const int p = piece[c];
+	if (p < 0 || kept[p])
+		return;
+	kept[p] = 1;
+	stack[(*sp)++] = first[p];
+}
+
+static void refer(const cell_t i, cell_t *stack, size_t *sp) {
+	cell_t t = 0;
+	if (refers(i, &t) != NONE)
+		reach(t, stack, sp);
+}
+
+/* Keep everything reachable from the kernel and the words named */
+static void mark(void) {
+	static cell_t stack[EMBED_CORE_SIZE];
+	size_t sp = 0;
+	for (cell_t i = 0; i < KERNEL; i++)
+		if (piece[i] >= 0)
+			kept[piece[i]] = 1;
+	for (cell_t i = 0; i < KERNEL; i++)
+		refer(i, stack, &sp);
+	for (size_t i = 0; i < nwords; i++) {
+		words[i].named |= words[i].link < KERNEL;
+		if (words[i].named)
+			reach(words[i].link, stack, &sp);
+	}
+	while (sp) {
+		const cell_t c = stack[--sp];
+		for (cell_t i = c; i < cells && piece[i] == piece[c]; i++)
+			refer(i, stack, &sp);
+	}
+	for (size_t i = 0; i < nwords; i++)
+		words[i].kept = kept[piece[words[i].link]];
+}
+
+static size_t name(const char *s, const size_t length) {
+	size_t found = 0;
+	for (size_t i = 0; i < nwords; i++) {
+		const cell_t link = words[i].link;
+		if ((m[link + 1] & NAME_LENGTH) != length)
+			continue;
+		size_t j = 0;
+		for (; j < length && byte(((size_t)link + 1) * 2 + 1 + j) == (uint8_t)s[j]; j++)
+			;
+		if (j == length)
+			words[i].named = 1, found++;
+	}
+	return found;
+}
+
+static int name_file(const char *file) {
+	FILE *f = fopen(file, "rb");
+	if (!f)
+		return -1;
+	char s[NAME_LENGTH + 2];
+	size_t n = 0;
+	for (int ch = 0; (ch = fgetc(f)) != EOF;) {
+		if (ch > ' ') {
+			if (n < sizeof s)
+				s[n++] = ch;
+			continue;
+		}
+		if (n && n <= NAME_LENGTH)
+			(void)name(s, n);
+		n = 0;
+	}
+	if (n && n <= NAME_LENGTH)
+		(void)name(s, n);
+	fclose(f);
+	return 0;
+}
+
+/* Move the cells kept down, fix up what refers to them and relink the word
+ * lists without the headers dropped */
+static size_t relocate(const int all) {
+	size_t n = 0;
+	for (size_t i = 0; i < cells; i++) {
+		const int p = piece[i];
+		keep[i] = p < 0 || (kept[p] && (kind[i] != HEADER || words[owner[i]].named || all));
+		moved[i] = n;
+		n += keep[i];
+	}
+	for (size_t i = 0; i < cells; i++) {
+		if (!keep[i])
+			continue;
+		cell_t x = m[i], t = 0;
+		const int how = refers(i, &t);
+		if (how == CELL)
+			x = (x & 0xE000) | moved[t];
+		else if (how == BYTE)
+			x = (kind[i] == CODE ? 0x8000 : 0) | (moved[t] << 1);
+		if (how != NONE && !keep[t]) {
+			fprintf(stderr, "cell %u refers to %u, which was dropped\n", (unsigned)i, (unsigned)t);
+			return 0;
+		}
+		out[moved[i]] = x;
+	}
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+		cell_t last = lists[i];
+		for (cell_t head = m[lists[i]]; head; head = m[head >> 1]) {
+			if (!keep[head >> 1])
+				continue;
+			out[last] = moved[head >> 1] << 1;
+			last = moved[head >> 1];
+		}
+		out[last] = 0;
+	}
+	if (m[IMAGE_SIZE] == m[CP])
+		out[IMAGE_SIZE] = n << 1;
+	out[CP] = n << 1;
+	return n;
+}
+
+static int load(const char *name) {
+	if (!name) {
+		cells = embed_default_block_size / 2;
+		for (size_t i = 0; i < cells; i++)
+			m[i] = embed_default_block[i * 2] | ((cell_t)embed_default_block[i * 2 + 1] << 8);
+	} else {
+		FILE *f = fopen(name, "rb");
+		if (!f)
+			return -1;
+		uint8_t b[2];
+		for (cells = 0; cells < EMBED_CORE_SIZE && fread(b, 1, 2, f) == 2; cells++)
+			m[cells] = b[0] | ((cell_t)b[1] << 8);
+		fclose(f);
+	}
+	if (cells <= KERNEL)
+		return -1;
+	if ((m[CP] >> 1) < cells) /* the rest is not part of the dictionary */
+		cells = m[CP] >> 1;
+	return 0;
+}
+
+static void save(FILE *o, const size_t n) {
+	fprintf(o, "/* eForth image */\n#include \"embed.h\"\n\nconst EMBED_PROGMEM uint8_t embed_default_block[] = {\n");
+	for (size_t i = 0; i < n * 2; i++) {
+		const unsigned b = (out[i >> 1] >> ((i & 1) * 8)) & 0xFF;
+		fprintf(o, "%u%s,%s", b, i == 38 ? "/* 1 = enable CRC check*/" : "", (i % 25) == 24 ? "\n" : "");
+	}
+	fprintf(o, "\n};\n\nconst size_t embed_default_block_size =  %u;\n\n", (unsigned)(n * 2));
+}
+
+static void report(const int verbose, const size_t n) {
+	size_t kept = 0, named = 0;
+	for (size_t i = 0; i < nwords; i++) {
+		const word_t *w = &words[i];
+		kept  += w->kept;
+		named += w->kept && keep[w->link];
+		if (!verbose)
+			continue;
+		size_t size = 0;
+		for (cell_t j = w->link; j < w->end; j++)
+			size += keep[j];
+		fprintf(stderr, "%-7s %4u/%-4u ", !w->kept ? "dropped" : keep[w->link] ? "kept" : "unnamed",
+				(unsigned)size, (unsigned)(w->end - w->link));
+		for (size_t j = 0; j < (m[w->link + 1] & NAME_LENGTH); j++)
+			fputc(byte(((size_t)w->link + 1) * 2 + 1 + j), stderr);
+		fputc('\n', stderr);
+	}
+	fprintf(stderr, "%u of %u words kept, %u with headers\n", (unsigned)kept, (unsigned)nwords, (unsigned)named);
+	fprintf(stderr, "%u of %u cells kept, image %u bytes, was %u, %u bytes saved\n",
+			(unsigned)n, (unsigned)cells, (unsigned)(n * 2), (unsigned)(cells * 2), (unsigned)((cells - n) * 2));
+}
+
+int main(int argc, char **argv) {
+	const char *image = NULL, *file = NULL;
+	int i = 1, all = 0, verbose = 0;
+	for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+		if (!strcmp(argv[i], "-a")) {
+			all = 1;
+		} else if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		} else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+			file = argv[++i];
+		} else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			image = argv[++i];
+		} else {
+			fprintf(stderr, "usage: %s [-a] [-v] [-f file] [-i image.blk] [word...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (load(image) < 0 || dictionary() < 0 || classify() < 0) {
+		fprintf(stderr, "could not load image, or its layout is not known\n");
+		return 1;
+	}
+	if (file && name_file(file) < 0) {
+		fprintf(stderr, "could not read %s\n", file);
+		return 1;
+	}
+	for (; i < argc; i++)
+		if (!name(argv[i], strlen(argv[i])))
+			fprintf(stderr, "no word called '%s'\n", argv[i]);
+	split();
+	mark();
+	const size_t n = relocate(all);
+	if (!n)
+		return 1;
+	report(verbose, n);
+	save(stdout, n);
+	return 0;
+}
@@ -14,9 +14,6 @@
  * @todo Yield interpreter when there is no input so we can do other work
  * @todo Speed up the interpreter, it is currently very slow. This could
  * be done by removing much of the indirection in the virtual machine.
- * @todo Add an Morse code decoder, the project has an encoder, but it would be
- * interesting to see if the eForth interpreter could gets its input from a
- * Morse code key, with its output going to an LED/Buzzer.
  * @todo Add code to use a simple LED for two way communications/as a light
  * sensor - an LED is a PN junction that generates a small current when hit by
  * light, this can be used as a crude light sensor and for two way
@@ -29,7 +26,9 @@
 #include <Arduino.h>
 #include <HardwareSerial.h>
 #include <avr/eeprom.h>
+#include <avr/interrupt.h>
 #include "embed.h"
+#include "crc8.h"
 #include "morse.h"
 #include "led.h"
 #include "Streaming.h"
@@ -40,10 +39,40 @@
 #define NPAGES           (5u)
 #define UNIT_DELAY_MS    (200)
 #define MORSE_OUTPUT_PIN (7)
+#define MORSE_KEY_PIN    (2)   /* pin a Morse key pulls low for input, 0 for none */
+#define MORSE_KEY_WPM    (12)  /* first guess at the speed of the sender */
+#define MORSE_DEBOUNCE_MS (8)  /* the key changing quicker than this is bounce */
 #define SERIAL_BAUD      (115200) //(9600)
+#define WARM_START       (1)
+#define SNAPSHOT_MAGIC   (0x4657u) /* 'WF' */
+#define SNAPSHOT_EEPROM  (PAGE_SIZE * 2u) /* after the EEPROM mapped into the VM */
+#define SNAPSHOT_CELLS   ((PAGE_SIZE * 2u) + 32u) /* pages 0 and 1, plus the variables at the start of page 2 */
+#define PROFILE_MAGIC    (0x4C54u) /* 'TL' */
+#define PROFILE_EEPROM   ((E2END + 1u) - sizeof(profile_t)) /* at the very end, after the snapshot */
+
+/* The LED link and its tuner take 336 bytes of SRAM, which with the
+ * virtual machine's pages leaves too little for the stack of an ATmega328P,
+ * so there they are left out unless built with '-DUSE_LED_LINK=1'. Without
+ * them the words that use them throw, and reading and sending on an LED
+ * directly still work. */
+#ifndef USE_LED_LINK
+#if RAMEND > 0x8FFu
+#define USE_LED_LINK (1)
+#else
+#define USE_LED_LINK (0)
+#endif
+#endif
 
 static embed_t embed;
+#if USE_LED_LINK
 static led_t led;
+static led_trx_t led_trx; /* runs on 'led' from the timer interrupt */
+static led_link_t led_link; /* sends and receives frames with 'led_trx' */
+static led_sensor_t led_profile; /* 'led' uses, as tuned by 'led_tune' */
+static led_tune_t led_tune;
+static int8_t led_tuned; /* how the last tune went, positive if it settled */
+static bool led_tune_keyed; /* started by 'ltune', so a key stops it */
+#endif
 
 typedef struct {
 	cell_t m[NPAGES][PAGE_SIZE];
@@ -51,6 +80,26 @@ typedef struct {
 
 static pages_t pages = { 0 };
 
+/* A snapshot consists of this header followed by the first SNAPSHOT_CELLS
+ * cells of 'pages_t', which are contiguous and contain the register block,
+ * the user variables, the dictionary space after the image and the word
+ * list variables. The stacks and the terminal input buffer are not saved, a
+ * restored image is reset before being run. */
+typedef struct {
+	uint16_t magic;      /* SNAPSHOT_MAGIC if valid */
+	uint16_t image_size; /* embed_default_block_size of the image saved */
+	uint16_t cells;      /* SNAPSHOT_CELLS when saved */
+	uint8_t  crc;        /* crc8 of the saved cells */
+} snapshot_t;
+
+/* The profile found by tuning the LED link is kept in EEPROM too, so it
+ * does not have to be tuned again after a reset */
+typedef struct {
+	uint16_t magic;       /* PROFILE_MAGIC if valid */
+	led_sensor_t profile;
+	uint8_t  crc;         /* crc8 of the profile */
+} profile_t;
+
 static const uint16_t page_0 = 0x0000;
 /*static const uint16_t page_1 = PAGE_SIZE ;*/
 static const uint16_t page_2 = 0x2000;
@@ -63,94 +112,279 @@ static const uint16_t page_7 = 0x4000 + (PAGE_SIZE*4);
 
 static const uint16_t page_8 = (EMBED_CORE_SIZE - PAGE_SIZE);
 
+/* A background task, started with 'spawn', shares the stack pages with the
+ * console task, taking the top half of the variable stack page, less the
+ * two task control blocks at the end of it, and the bottom half of the return
+ * stack page. No more memory is needed for it, but once it is started the
+ * console's variable stack is limited to the 64 cells below it, rather than
+ * the 112 below the control blocks, and its return stack to the 64 cells
+ * above it, rather than the whole page. */
+static const uint16_t task_console    = page_3 + PAGE_SIZE - (EMBED_TASK_CELLS * 2u);
+static const uint16_t task_background = task_console + EMBED_TASK_CELLS;
+static const uint16_t task_sp0        = page_3 + (PAGE_SIZE / 2u);
+static const uint16_t task_rp0        = page_8 + (PAGE_SIZE / 2u) - 1u;
+static const uint16_t task_rlimit     = page_8 - 1u;
+
+static embed_tasks_t tasks;
+
 static inline bool within(cell_t range, cell_t addr) {
 	return (addr >= range) && (addr < (range + PAGE_SIZE));
 }
 
-/**@todo change so this is non-blocking */
-static int morse_write_char(const int pin, const int method, const char c) {
-	if (c != '.' && c != '_' && c != ' ')
-		return -1;
+/* A direct mapped cache in SRAM of the lines of the image in flash used
+ * most recently, off unless built with '-DROM_CACHE_LINES=n'. Reading a
+ * cell with 'pgm_read_word' costs only a little more than reading one out of
+ * SRAM, so finding it in the cache first costs more than it saves: 'cachesim'
+ * estimates even 2KB of cache is slower. It is kept for parts whose flash is
+ * slower to read, '13 vm' prints and clears the hit and miss counts. */
+#ifndef ROM_CACHE_LINES
+#define ROM_CACHE_LINES (0u)  /* lines, a power of two, zero for no cache */
+#endif
+#define ROM_CACHE_LINE  (2u)  /* cells per line, a power of two */
+
+#if ROM_CACHE_LINES
+typedef struct {
+	uint16_t tag[ROM_CACHE_LINES]; /* line number plus one, zero if empty */
+	cell_t m[ROM_CACHE_LINES][ROM_CACHE_LINE];
+	uint32_t hits, misses;
+} rom_cache_t;
+
+static rom_cache_t rom_cache;
+#endif
+
+static inline cell_t rom_flash_read(cell_t addr) {
+#if ROM_CACHE_LINES
+	const uint16_t line = addr / ROM_CACHE_LINE, set = line % ROM_CACHE_LINES;
+	if (rom_cache.tag[set] != line + 1u) {
+		/* the last line can run past the end of the image, which is
+		 * harmless as it is still flash */
+		memcpy_P(rom_cache.m[set], embed_default_block + (line * sizeof rom_cache.m[set]), sizeof rom_cache.m[set]);
+		rom_cache.tag[set] = line + 1u;
+		rom_cache.misses++;
+	} else {
+		rom_cache.hits++;
+	}
+	return rom_cache.m[set][addr % ROM_CACHE_LINE];
+#else
+	return pgm_read_word(embed_default_block + (addr << 1));
+#endif
+}
 
-	switch (method) {
-	case 0:
-		Serial.write(c);
-		break;
-	case 1: 
-		pinMode(pin, OUTPUT);
-		switch (c) {
-		case '.':
-			digitalWrite(pin, HIGH);
-			delay(UNIT_DELAY_MS * MORSE_DOT_DELAY_MULTIPLIER);
-			digitalWrite(pin, LOW);
-			break;
-		case '_':
-			digitalWrite(pin, HIGH);
-			delay(UNIT_DELAY_MS * MORSE_DASH_DELAY_MULTIPLIER);
-			digitalWrite(pin, LOW);
-			break;
-		case ' ':
-			digitalWrite(pin, LOW);
-			delay(UNIT_DELAY_MS * MORSE_SPACE_DELAY_MULTIPLIER);
-		}
-		break;
-	case 2:
-	{
-		const int r1 = morse_write_char(pin, 0, c);
-		const int r2 = morse_write_char(pin, 1, c);
-		if (r1 < 0 || r2 < 0)
-			return -1;
-		break;
+static int snapshot_save(const pages_t *p) {
+	assert(p);
+	BUILD_BUG_ON((SNAPSHOT_EEPROM + sizeof(snapshot_t) + (SNAPSHOT_CELLS * sizeof(cell_t))) > (E2END + 1uL));
+	const uint8_t *m = reinterpret_cast<const uint8_t*>(&p->m[0][0]);
+	const size_t length = SNAPSHOT_CELLS * sizeof(cell_t);
+	snapshot_t s;
+	s.magic      = SNAPSHOT_MAGIC;
+	s.image_size = embed_default_block_size;
+	s.cells      = SNAPSHOT_CELLS;
+	s.crc        = crc8(m, length);
+	/* header is written last so a power failure mid-save leaves it invalid */
+	snapshot_t * const e = reinterpret_cast<snapshot_t*>(SNAPSHOT_EEPROM);
+	eeprom_update_word(&e->magic, 0);
+	eeprom_update_block(m, e + 1, length);
+	eeprom_update_block(&s, e, sizeof s);
+	return 0;
+}
+
+static int snapshot_load(pages_t *p) {
+	assert(p);
+	uint8_t *m = reinterpret_cast<uint8_t*>(&p->m[0][0]);
+	const size_t length = SNAPSHOT_CELLS * sizeof(cell_t);
+	const snapshot_t * const e = reinterpret_cast<const snapshot_t*>(SNAPSHOT_EEPROM);
+	snapshot_t s;
+	eeprom_read_block(&s, e, sizeof s);
+	if (s.magic != SNAPSHOT_MAGIC || s.image_size != embed_default_block_size || s.cells != SNAPSHOT_CELLS)
+		return -1;
+	eeprom_read_block(m, e + 1, length);
+	if (crc8(m, length) != s.crc) {
+		memset(m, 0, length);
+		return -1;
 	}
-	default:
+	return 0;
+}
+
+static void snapshot_discard(void) {
+	snapshot_t * const e = reinterpret_cast<snapshot_t*>(SNAPSHOT_EEPROM);
+	eeprom_update_word(&e->magic, 0);
+}
+
+#if USE_LED_LINK
+static void profile_save(const led_sensor_t *l) {
+	assert(l);
+	BUILD_BUG_ON((SNAPSHOT_EEPROM + sizeof(snapshot_t) + (SNAPSHOT_CELLS * sizeof(cell_t))) > PROFILE_EEPROM);
+	profile_t p;
+	p.magic   = PROFILE_MAGIC;
+	p.profile = *l;
+	p.crc     = crc8(reinterpret_cast<const uint8_t*>(l), sizeof *l);
+	profile_t * const e = reinterpret_cast<profile_t*>(PROFILE_EEPROM);
+	eeprom_update_word(&e->magic, 0);
+	eeprom_update_block(&p, e, sizeof p);
+}
+
+static int profile_load(led_sensor_t *l) {
+	assert(l);
+	const profile_t * const e = reinterpret_cast<const profile_t*>(PROFILE_EEPROM);
+	profile_t p;
+	eeprom_read_block(&p, e, sizeof p);
+	if (p.magic != PROFILE_MAGIC || crc8(reinterpret_cast<const uint8_t*>(&p.profile), sizeof p.profile) != p.crc)
 		return -1;
+	*l = p.profile;
+	return 0;
+}
+
+/* Polls the LED link, through the tuner as it might be tuning it, keeping
+ * the profile it settles on. A tune 'ltune' started is stopped by a key that
+ * is left waiting, as it is by a word looping on 'ltune?', where at the
+ * prompt keys are read as they come. */
+static void led_poll(void) {
+	if (led_tune_keyed && Serial.available() > 0) {
+		led_tune_stop(&led_tune, millis());
+		led_tune_keyed = false;
+		led_tuned = -1;
 	}
+	const int r = led_tune_poll(&led_tune, millis());
+	if (r > 0)
+		profile_save(&led_profile);
+	if (r != 0) {
+		led_tune_keyed = false;
+		led_tuned = r;
+	}
+}
+
+/* Called between instructions, it decodes readings as soon as the LED has
+ * queued any, so a word running for longer than a bit period does not fill
+ * the queue and lose a byte, and never makes the virtual machine yield */
+static int led_yield_cb(void *param) {
+	(void)param;
+	if (led_trx_waiting(&led_trx))
+		led_poll();
+	return 0;
+}
+
+/* The transceiver is not ticked whilst a word uses an LED directly */
+static void led_hold(bool hold) {
+	led_trx_attach(hold ? NULL : &led_trx);
+}
+
+/* Whilst waiting for a connection the link is polled and, unless it is
+ * being tuned, bytes counting up from 'i' are sent on it */
+static void led_beacon(unsigned *i) {
+	led_poll();
+	if (!led_tune_busy(&led_tune) && led_trx_put(&led_trx, *i))
+		(*i)++;
+}
+#else
+static void led_poll(void) {
+}
+
+static void led_hold(bool hold) {
+	(void)hold;
+}
+
+static void led_beacon(unsigned *i) {
+	(void)i;
+}
+#endif
+
+/* Morse code is written to the serial port as '.', '_' and ' ' */
+static int morse_write_char(const char c) {
+	if (c != '.' && c != '_' && c != ' ')
+		return -1;
+	Serial.write(c);
 	return 1;
 }
 
-static int morse_write_spaces(const int pin, const int method, const int count) {
+static int morse_write_spaces(const int count) {
 	for (int i = 0; i < count; i++)
-		if (morse_write_char(pin, method, ' ') < 0)
+		if (morse_write_char(' ') < 0)
 			return -1;
 	return count;
 }
 
-/* 1 == LED, 0 == serial */
-static int morse_print_buffer(const int pin, const int method, const uint8_t *s, size_t length) {
+/* The text is encoded a piece at a time into a stream of timings, which
+ * are written out as a dot or dash for each mark and a space for each unit
+ * the key is up */
+static int morse_print_buffer(const uint8_t *s, size_t length) {
 	assert(s);
+	morse_timing_t e = { 0 };
+	uint8_t timing[16];
+	size_t done = 0;
 	int r = 0;
-	unsigned char c = 0;
-	for (size_t i = 0; i < length; i++) {
-		c = s[i];
-		if (c == ' ') {
-			if (morse_write_spaces(pin, method, MORSE_SPACES_IN_WORD_SEPARATOR) < 0)
-				return -1;
-			r += MORSE_SPACES_IN_WORD_SEPARATOR;
-		} else {
-			char buffer[10] = { 0 };
-			if (morse_encode_character(c, buffer, (sizeof buffer) - 1) < 0)
+	do {
+		size_t written = 0;
+		done += morse_timing_encode(&e, s + done, length - done, timing, sizeof timing, &written);
+		if (done == length)
+			written += morse_timing_flush(&e, timing + written, sizeof timing - written);
+		for (size_t i = 0; i < written; i++) {
+			const uint8_t mark = MORSE_TIMING_MARK(timing[i]), space = MORSE_TIMING_SPACE(timing[i]);
+			if (mark && morse_write_char(mark == MORSE_DASH_DELAY_MULTIPLIER ? '_' : '.') < 0)
 				return -1;
-			char enc = 0;
-			const char *en = buffer;
-			while ((enc = *en++)) {
-				if (morse_write_char(pin, method, enc) < 0)
-					return -1;
-				if (morse_write_char(pin, method, ' ') < 0)
-					return -1;
-				r += 2;
-			}
-			const int chsep = MORSE_SPACES_IN_CHAR_SEPARATOR - MORSE_SPACES_IN_ELEMENT_SEPARATOR;
-			if (morse_write_spaces(pin, method, chsep) < 0)
+			if (morse_write_spaces(space) < 0)
 				return -1;
-			r += chsep;
+			r += !!mark + space;
 		}
-	}
+	} while (done < length || e.held);
 	return r;
 }
 
-/*static int morse_print_string(const int pin, const int method, const char *s) {
-	return morse_print_buffer(pin, method, reinterpret_cast<const uint8_t*>(s), strlen(s));
-}*/
+/* Morse code is sent on a pin by a transmitter that Timer 1 ticks once a
+ * unit, so sending only has to queue the characters and the interpreter
+ * carries on whilst they are sent. The pin is only changed when nothing is
+ * being sent, and only written when the key goes up or down, so between
+ * messages it is free for anything else. */
+static morse_tx_t morse_tx;
+static volatile uint8_t morse_pin = MORSE_OUTPUT_PIN;
+
+ISR(TIMER1_COMPA_vect) {
+	static uint8_t down;
+	const uint8_t on = morse_tx_tick(&morse_tx) ? HIGH : LOW;
+	if (on != down)
+		digitalWrite(morse_pin, down = on);
+}
+
+static void morse_timer_setup(void) {
+	BUILD_BUG_ON(((F_CPU / 1024uL) * UNIT_DELAY_MS / 1000uL) > 0xFFFFuL);
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS12) | _BV(CS10); /* clear on compare, F_CPU/1024 */
+	OCR1A  = ((F_CPU / 1024uL) * UNIT_DELAY_MS / 1000uL) - 1u;
+	TIMSK1 = _BV(OCIE1A);
+}
+
+/* A Morse key is read as another source of input, sampled whenever the
+ * interpreter asks for some, which it does far more often than once a
+ * millisecond whilst it waits, and decoded as it is keyed. */
+static morse_rx_t morse_rx;
+static uint8_t morse_key_down;
+static unsigned long morse_key_since;
+
+static void morse_key_poll(void) {
+	const unsigned long now = millis(), held = now - morse_key_since;
+	const uint16_t duration = held > 0xFFFFuL ? 0xFFFFu : held;
+	const uint8_t down = digitalRead(MORSE_KEY_PIN) == LOW;
+	if (down != morse_key_down && held >= MORSE_DEBOUNCE_MS) {
+		morse_rx_key(&morse_rx, down, duration);
+		morse_key_down  = down;
+		morse_key_since = now;
+	} else if (!morse_key_down) {
+		morse_rx_poll(&morse_rx, duration);
+	}
+}
+
+/* Queue as much of a string as there is room for, characters without a
+ * code are skipped, returning how much was taken */
+static size_t morse_send(const int pin, const uint8_t *s, size_t length) {
+	size_t i = 0;
+	if (!morse_tx_busy(&morse_tx)) {
+		pinMode(pin, OUTPUT);
+		morse_pin = pin;
+	}
+	for (; i < length; i++)
+		if (morse_tx_put(&morse_tx, s[i]) == 0)
+			break;
+	return i;
+}
 
 extern "C" {
 	typedef void(*avr_reset_func)(void);
@@ -176,174 +410,272 @@ extern "C" {
 		return NULL;
 	}
 
-	static int callback_cb(embed_t *h, void *param) {
-		(void)(param);
-		cell_t op = 0;
-		int status = embed_pop(h, &op);
-		if (status != 0)
-			goto error;
-		switch (op) {
-		case 0: /* Pin Mode */
-		{
-			uint16_t pin = 0, direction = 0;
-			if ((status = embed_pop(h, &pin)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &direction)) != 0)
-				goto error;
-			if (VERBOSE > 2)
-				Serial << F("\r\npin-mode: ") << pin << F("/") << direction << F("\r\n");
-			pinMode(pin, direction ? ((direction & 0x8000) ? INPUT_PULLUP : INPUT) : OUTPUT);
-			break;
-		}
-		case 1: /* Read Pin */
-		{
-			uint16_t pin = 0;
-			if ((status = embed_pop(h, &pin)) != 0)
-				goto error;
-			if (VERBOSE > 2)
-				Serial << F("\r\npin-read: ") << pin << F("\r\n");
-			status = embed_push(h, digitalRead(pin) == HIGH ? -1 : 0);
-			break;
-		}
-		case 2: /* Write Pin */
-		{
-			uint16_t pin = 0, on = 0;
-			if ((status = embed_pop(h, &pin)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &on)) != 0)
-				goto error;
-			if (VERBOSE > 2)
-				Serial << F("\r\npin-set: ") << pin << F("/") << on << F("\r\n");
-			digitalWrite(pin, on ? HIGH : LOW);
-			break;
-		}
-		case 3: /* delay */
-		{
-			uint16_t milliseconds = 0;
-			if ((status = embed_pop(h, &milliseconds)) != 0)
-				goto error;
-			delay(milliseconds);
-			break;
-		}
-		case 4: /* reset AVR */
-			avr_reset();
-			break;
-		case 5: /* Read LED */
-		{ /* See led.c for a description of what this does */
-			led_t led;
-			memset(&led, 0, sizeof led);
-			uint16_t anode = 0, cathode = 0;
-			if ((status = embed_pop(h, &cathode)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &anode)) != 0)
-				goto error;
-			led.anode   = anode;
-			led.cathode = cathode;
-			led.sensor  = &led_sensor_communications;
-			unsigned r = led_read(&led);
-			embed_push(h, r);
-			break;
-		}
-		case 6: /* Send byte */
-		{
-			led_t led;
-			memset(&led, 0, sizeof led);
-			uint16_t anode = 0, cathode = 0, byte = 0;
-			if ((status = embed_pop(h, &cathode)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &anode)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &byte)) != 0)
-				goto error;
-			led.anode   = anode;
-			led.cathode = cathode;
-			led.sensor  = &led_sensor_communications;
-			led_send(&led, byte);
-			break;
-		}
-		case 7: /* Read LED sensor loop */
-redo:
-			while (1) {
-				unsigned r[8] = { 0 };
-				uint8_t b = 0;
-				for (size_t i = 0; i < 8; i++)
-					r[i] = led_read(&led);
-				for (size_t i = 0; i < 8; i++) { // @todo make a proper decoder!
-					if (r[i] < 2200)
-						continue;
-					else if (r[i] < 4400)
-						b |= 1u << i;
-					else
-						goto redo;
-				}
-				Serial.print(b, HEX);
-				Serial.print(" ");
-			}
-		case 8: /* Print a Morse code string */
-		{
-			uint16_t pin = 0, method = 0, string_location = 0;
-			if ((status = embed_pop(h, &pin)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &method)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &string_location)) != 0)
-				goto error;
-			/**@bug morse_print_buffer needs to be rewritten so it
-			 * uses the correct read macro depending on whether the
-			 * string is in EEPROM, RAM or Flash */
-
-			/* : x $" hello" ; x 2 4 8 system +order vm */
-			uint8_t *string = reinterpret_cast<uint8_t *>(resolve(h, string_location >> 1));
-			if (!string)
-				return 1;
-			morse_print_buffer(pin, method, string + 1, *string);
-			break;
-		}
-		case 9: /* Read LED light level */
-		{ /* See led.c for a description of what this does */
-			led_t led;
-			memset(&led, 0, sizeof led);
-			uint16_t anode = 0, cathode = 0;
-			if ((status = embed_pop(h, &cathode)) != 0)
-				goto error;
-			if ((status = embed_pop(h, &anode)) != 0)
-				goto error;
-			led.anode   = anode;
-			led.cathode = cathode;
-			led.sensor  = &led_sensor_light_level;
-			unsigned long t = 0;
-			for (size_t i = 0; i < 8; i++)
-				t = (t + led_read(&led)) / 2uL;
-			embed_push(h, t / 16u);
-			break;
-		}
-		default:
-			return 21;
+	/* Primitives callable from eForth with 'n vm', where 'n' is the
+	 * position of the primitive in 'primitives', stack effects are given
+	 * in the comments. */
+
+	static int pin_mode_cb(embed_t *h, void *param, cell_t *s) { /* direction pin -- */
+		(void)h; (void)param;
+		const uint16_t direction = s[0], pin = s[1];
+		if (VERBOSE > 2)
+			Serial << F("\r\npin-mode: ") << pin << F("/") << direction << F("\r\n");
+		pinMode(pin, direction ? ((direction & 0x8000) ? INPUT_PULLUP : INPUT) : OUTPUT);
+		return 0;
+	}
+
+	static int pin_read_cb(embed_t *h, void *param, cell_t *s) { /* pin -- f */
+		(void)h; (void)param;
+		if (VERBOSE > 2)
+			Serial << F("\r\npin-read: ") << s[0] << F("\r\n");
+		s[0] = digitalRead(s[0]) == HIGH ? -1 : 0;
+		return 0;
+	}
+
+	static int pin_write_cb(embed_t *h, void *param, cell_t *s) { /* on pin -- */
+		(void)h; (void)param;
+		const uint16_t on = s[0], pin = s[1];
+		if (VERBOSE > 2)
+			Serial << F("\r\npin-set: ") << pin << F("/") << on << F("\r\n");
+		digitalWrite(pin, on ? HIGH : LOW);
+		return 0;
+	}
+
+	static int delay_cb(embed_t *h, void *param, cell_t *s) { /* milliseconds -- */
+		(void)h; (void)param;
+		delay(s[0]);
+		return 0;
+	}
+
+	static int reset_cb(embed_t *h, void *param, cell_t *s) { /* -- */
+		(void)h; (void)param; (void)s;
+		avr_reset();
+		return 0;
+	}
+
+	static int led_read_cb(embed_t *h, void *param, cell_t *s) { /* anode cathode -- u */
+		(void)h; (void)param;
+		/* See led.c for a description of what this does */
+		led_t led;
+		led_sensor_t profile;
+		led_sensor_load(&profile, &led_sensor_communications);
+		led_hold(true);
+		led_init(&led, s[0], s[1], &profile);
+		s[0] = led_read(&led);
+		led_hold(false);
+		return 0;
+	}
+
+	static int led_send_cb(embed_t *h, void *param, cell_t *s) { /* byte anode cathode -- */
+		(void)h; (void)param;
+		led_t led;
+		led_sensor_t profile;
+		led_sensor_load(&profile, &led_sensor_communications);
+		led_hold(true);
+		led_init(&led, s[1], s[2], &profile);
+		led_send(&led, s[0]);
+		led_hold(false);
+		return 0;
+	}
+
+	static int led_loop_cb(embed_t *h, void *param, cell_t *s) { /* -- , until a key is hit */
+		(void)h; (void)param; (void)s;
+#if USE_LED_LINK
+		uint8_t frame[LED_LINK_MAX];
+		while (Serial.available() == 0) {
+			led_poll();
+			const int n = led_link_recv(&led_link, frame, sizeof frame);
+			if (n < 0)
+				continue;
+			Serial.write(frame, n);
+			Serial.println();
 		}
-		error:
-			return status;
+		return 0;
+#else
+		return 21; /* not implemented */
+#endif
+	}
+
+	static int led_link_send_cb(embed_t *h, void *param, cell_t *s) { /* c-addr -- f */
+		(void)param;
+#if USE_LED_LINK
+		const uint8_t *string = reinterpret_cast<uint8_t *>(resolve(h, s[0] >> 1));
+		if (!string)
+			return 1;
+		s[0] = !led_tune_busy(&led_tune) && led_link_send(&led_link, string + 1, *string) == 0 ? -1 : 0;
+		led_poll();
+		return 0;
+#else
+		(void)h; (void)s;
+		return 21; /* not implemented */
+#endif
+	}
+
+	static int led_link_recv_cb(embed_t *h, void *param, cell_t *s) { /* c-addr -- u, -1 if none */
+		(void)param;
+#if USE_LED_LINK
+		const cell_t cell = s[0] >> 1, last = cell + (LED_LINK_MAX / 2u);
+		uint16_t *start = resolve(h, cell);
+		if (!start || resolve(h, last) != start + (last - cell))
+			return 1; /* no room for the largest frame */
+		uint8_t *string = reinterpret_cast<uint8_t *>(start);
+		led_poll();
+		const int n = led_link_recv(&led_link, string + 1, LED_LINK_MAX);
+		if (n >= 0)
+			*string = n;
+		s[0] = n;
+		return 0;
+#else
+		(void)h; (void)s;
+		return 21; /* not implemented */
+#endif
+	}
+
+	static int led_tune_cb(embed_t *h, void *param, cell_t *s) { /* -- f, true if it started */
+		(void)h; (void)param;
+#if USE_LED_LINK
+		/* It carries on in the background, from 'led_poll', and
+		 * 'ltune?' (18 vm) says how it went */
+		s[0] = led_tune_start(&led_tune) == 0 ? -1 : 0;
+		if (s[0])
+			led_tune_keyed = true;
+		return 0;
+#else
+		(void)s;
+		return 21; /* not implemented */
+#endif
+	}
+
+	static int led_tuned_cb(embed_t *h, void *param, cell_t *s) { /* -- n, -1 while tuning, else bits/s or 0 if it failed */
+		(void)h; (void)param;
+#if USE_LED_LINK
+		led_poll();
+		if (led_tune_busy(&led_tune))
+			s[0] = -1;
+		else
+			s[0] = led_tuned > 0 ? 8000000uL / (9uL * led_profile.tx_period_us) : 0;
+		return 0;
+#else
+		(void)s;
+		return 21; /* not implemented */
+#endif
+	}
+
+	static int morse_print_cb(embed_t *h, void *param, cell_t *s) { /* c-addr method pin -- u */
+		(void)param;
+		const uint16_t string_location = s[0], method = s[1], pin = s[2];
+		/**@bug morse_print_buffer needs to be rewritten so it
+		 * uses the correct read macro depending on whether the
+		 * string is in EEPROM, RAM or Flash */
+
+		/* Method 0 writes to the serial port, 1 sends on 'pin', 2
+		 * does both, 'u' is how many characters were queued to send,
+		 * the rest can be sent when there is room, 'morse?' (14 vm)
+		 * is true until everything has been sent.
+		 * : x $" hello" ; x 2 7 8 system +order vm */
+		uint8_t *string = reinterpret_cast<uint8_t *>(resolve(h, string_location >> 1));
+		if (!string || method > 2)
+			return 1;
+		if (method != 1 && morse_print_buffer(string + 1, *string) < 0)
+			return 1;
+		s[0] = method ? morse_send(pin, string + 1, *string) : *string;
+		return 0;
+	}
+
+	static int morse_busy_cb(embed_t *h, void *param, cell_t *s) { /* -- f */
+		(void)h; (void)param;
+		s[0] = morse_tx_busy(&morse_tx) ? -1 : 0;
+		return 0;
+	}
+
+	static int light_level_cb(embed_t *h, void *param, cell_t *s) { /* anode cathode -- u */
+		(void)h; (void)param;
+		/* See led.c for a description of what this does */
+		led_t led;
+		led_sensor_t profile;
+		led_sensor_load(&profile, &led_sensor_light_level);
+		led_hold(true);
+		led_init(&led, s[0], s[1], &profile);
+		unsigned long t = 0;
+		for (size_t i = 0; i < 8; i++)
+			t = (t + led_read(&led)) / 2uL;
+		led_hold(false);
+		s[0] = t / 16u;
+		return 0;
+	}
+
+	static int snapshot_discard_cb(embed_t *h, void *param, cell_t *s) { /* -- */
+		(void)h; (void)param; (void)s;
+		/* Discard saved image, next reset is a cold start */
+		snapshot_discard();
+		return 0;
+	}
+
+	static int spawn_cb(embed_t *h, void *param, cell_t *s) { /* xt -- */
+		/* Start, or restart, the background task running 'xt', which
+		 * should loop forever calling 'pause' (11 vm) */
+		const int r = embed_task_spawn(h, (embed_tasks_t*)param, task_background, s[0], task_sp0, task_rp0, task_console, task_rlimit);
+		return r == -3 ? 3 : r < 0 ? 21 : 0;
+	}
+
+	static int cache_cb(embed_t *h, void *param, cell_t *s) { /* -- */
+		(void)h; (void)param; (void)s;
+#if ROM_CACHE_LINES
+		Serial << F("\r\ncache: ") << rom_cache.hits << F(" hits, ") << rom_cache.misses << F(" misses\r\n");
+		rom_cache.hits = rom_cache.misses = 0;
+		return 0;
+#else
+		return 21; /* not implemented */
+#endif
 	}
 
+	/* Names are left NULL, as each word defined takes up dictionary
+	 * space and there is very little of it, see 'eForth_extend'. */
+	static const embed_primitive_t primitives[] PROGMEM = {
+		{ NULL, pin_mode_cb,         2, 0 }, /* 0 */
+		{ NULL, pin_read_cb,         1, 1 }, /* 1 */
+		{ NULL, pin_write_cb,        2, 0 }, /* 2 */
+		{ NULL, delay_cb,            1, 0 }, /* 3 */
+		{ NULL, reset_cb,            0, 0 }, /* 4 */
+		{ NULL, led_read_cb,         2, 1 }, /* 5 */
+		{ NULL, led_send_cb,         3, 0 }, /* 6 */
+		{ NULL, led_loop_cb,         0, 0 }, /* 7 */
+		{ NULL, morse_print_cb,      3, 1 }, /* 8 */
+		{ NULL, light_level_cb,      2, 1 }, /* 9 */
+		{ NULL, snapshot_discard_cb, 0, 0 }, /* 10 */
+		{ NULL, embed_pause_cb,      0, 0 }, /* 11 */
+		{ NULL, spawn_cb,            1, 0 }, /* 12 */
+		{ NULL, cache_cb,            0, 0 }, /* 13 */
+		{ NULL, morse_busy_cb,       0, 1 }, /* 14 */
+		{ NULL, led_link_send_cb,    1, 1 }, /* 15 */
+		{ NULL, led_link_recv_cb,    1, 1 }, /* 16 */
+		{ NULL, led_tune_cb,         0, 1 }, /* 17 */
+		{ NULL, led_tuned_cb,        0, 1 }, /* 18 */
+	};
+
+	static const embed_primitives_t registry = {
+		primitives, sizeof(primitives) / sizeof(primitives[0]), (void*)&tasks
+	};
+
+	/* The pages are checked in the order they are most used in, as found
+	 * by 'cachesim' replaying a trace made by 'host -t': the image in flash,
+	 * which instructions are fetched from, then the stacks. */
 	static cell_t  rom_read_cb(embed_t const * const h, cell_t addr) {
 		pages_t *p = (pages_t*)h->m;
 		const uint16_t blksz = embed_default_block_size >> 1;
 
 		/* RAM + ROM */
-		if (within(page_0, addr)) {
-			return p->m[0][addr];
-		} else if ((addr >= PAGE_SIZE) && (addr < blksz)) {
-			const uint16_t naddr = addr << 1;
-			const uint16_t lo    = pgm_read_byte(embed_default_block + naddr + 0);
-			const uint16_t hi    = pgm_read_byte(embed_default_block + naddr + 1);
-			return (hi << 8u) | lo;
-		} else if (within(blksz, addr)) {
-			return p->m[1][addr - blksz];
-		} else if (within(page_2, addr)) {
-			return p->m[2][addr - page_2];
+		if ((cell_t)(addr - PAGE_SIZE) < (blksz - PAGE_SIZE)) {
+			return rom_flash_read(addr);
 		} else if (within(page_3, addr)) {
 			return p->m[3][addr - page_3];
 		} else if (within(page_8, addr)) {
 			return p->m[4][addr - page_8];
+		} else if (within(blksz, addr)) {
+			return p->m[1][addr - blksz];
+		} else if (within(page_0, addr)) {
+			return p->m[0][addr];
+		} else if (within(page_2, addr)) {
+			return p->m[2][addr - page_2];
 		}
 
 		if (within(page_4, addr)) {
@@ -359,29 +691,28 @@ redo:
 		return 0;
 	}
 
+	/* Writes to the image in flash are ignored, they match no page */
 	static void rom_write_cb(embed_t * const h, cell_t addr, cell_t value) {
 		pages_t * const p = (pages_t*)h->m;
 
 		const uint16_t blksz = embed_default_block_size >> 1;
 
-		/* RAM + ROM */
-		if (within(page_0, addr)) {
-			p->m[0][addr] = value;
+		/* RAM */
+		if (within(page_3, addr)) {
+			p->m[3][addr - page_3] = value;
+			return;
+		} else if (within(page_8, addr)) {
+			p->m[4][addr - page_8] = value;
 			return;
-		} else if ((addr >= PAGE_SIZE) && (addr < blksz)) {
-			/* ROM */
 		} else if (within(blksz, addr)) {
 			p->m[1][addr - blksz]   = value;
 			return;
+		} else if (within(page_0, addr)) {
+			p->m[0][addr] = value;
+			return;
 		} else if (within(page_2, addr)) {
 			p->m[2][addr - page_2] = value;
 			return;
-		} else if (within(page_3, addr)) {
-			p->m[3][addr - page_3] = value;
-			return;
-		} else if (within(page_8, addr)) {
-			p->m[4][addr - page_8] = value;
-			return;
 		}
 
 		/* EEPROM */
@@ -400,11 +731,29 @@ redo:
 		}
 	}
 
+	/* The flash resident part of the image cannot change, so 'save' ignores
+	 * the range it is given and snapshots the writable pages instead */
+	static int save_cb(const embed_t *h, const void *name, const size_t start, const size_t length) {
+		(void)name;
+		(void)start;
+		(void)length;
+		return snapshot_save((const pages_t*)h->m) < 0 ? -76 /* write-file IOR */ : 0;
+	}
+
 	static int serial_getc_cb(void *file, int *no_data) {
 		(void)file;
+		/* With nothing to read the image returns from 'embed_vm', so
+		 * 'loop' can switch tasks, this is how 'key' pauses */
+		if (Serial.available() == 0) {
+			led_poll();
+			if (MORSE_KEY_PIN) {
+				morse_key_poll();
+				return morse_rx_getc(&morse_rx, no_data);
+			}
+			*no_data = -1;
+			return -1;
+		}
 		*no_data = 0;
-		while (Serial.available() == 0)
-			;
 		return Serial.read();
 	}
 
@@ -417,11 +766,36 @@ redo:
 	}
 }
 
+/* As 'embed_sgetc_cb', for a string in flash */
+static int pgm_getc_cb(void *string_ptr, int *no_data) {
+	PGM_P *sp = (PGM_P*)string_ptr;
+	const char ch = pgm_read_byte(*sp);
+	if (!ch)
+		return -1;
+	(*sp)++;
+	*no_data = 0;
+	return ch;
+}
+
+/* As 'embed_eval', for a string in flash, where a string in RAM would take
+ * up as much of it as it is long for as long as the program runs */
+static int eval_P(embed_t *h, PGM_P str) {
+	embed_opt_t o_old = *embed_opt_get(h);
+	embed_opt_t o_new = o_old;
+	o_new.get     = pgm_getc_cb;
+	o_new.in      = &str;
+	o_new.options = EMBED_VM_QUITE_ON;
+	embed_opt_set(h, &o_new);
+	const int r = embed_vm(h);
+	embed_opt_set(h, &o_old);
+	return r;
+}
+
 /**@todo bake this into the core image instead of defining things here, this
  * saves on space and execution time.  */
 static int eForth_extend(embed_t *h) { 
 	assert(h);
-	if (embed_eval(h, 
+	if (eval_P(h, PSTR(
 		"system +order\r\n"
 		// ": mode 0 vm ;\r\n"
 		// ": read 1 vm ;\r\n"
@@ -432,9 +806,17 @@ static int eForth_extend(embed_t *h) {
 		": tx  4 5  6 vm ;\r\n" 
 		": leds 7 vm ;\r\n" 
 		": light 4 5 9 vm ;\r\n" 
+		": pause 11 vm ;\r\n"
+		": spawn 12 vm ;\r\n"
+		": morse 7 8 vm ;\r\n"
+		": morse? 14 vm ;\r\n"
+		": ltx 15 vm ;\r\n"
+		": lrx 16 vm ;\r\n"
+		": ltune 17 vm ;\r\n"
+		": ltune? 18 vm ;\r\n"
 		/* "system -order\r\n"*/
 		"cr\r\n"
-		) != 0)
+		)) != 0)
 		goto fail;
 	return 0;
 fail:
@@ -450,8 +832,13 @@ static void eForth_opt_setup(embed_t *h, pages_t *p) {
 	h->o.get       =  serial_getc_cb;
 	h->o.put       =  serial_putc_cb;
 	h->o.read      =  rom_read_cb;
-	h->o.callback  =  callback_cb;
+	h->o.callback  =  embed_primitives_cb;
+	h->o.param     =  (void*)&registry;
 	h->o.write     =  rom_write_cb;
+	h->o.save      =  save_cb;
+#if USE_LED_LINK
+	h->o.yield     =  led_yield_cb;
+#endif
 	h->o.options   =  EMBED_VM_RAW_TERMINAL;
 }
 
@@ -469,7 +856,7 @@ static void establish_contact(void) {
 	unsigned i = 0;
 	Serial.println(F("eForth: awaiting connection"));
 	while (Serial.available() <= 0) {
-		led_send(&led, i++);
+		led_beacon(&i);
 		//Serial.println(F("eForth: awaiting connection"));
 		//delay(300);
 	}
@@ -478,32 +865,62 @@ static void establish_contact(void) {
 static void wait_for_key(void) {
 	unsigned i = 0;
 	Serial.println(F("(hit any key to continue)"));
-	while (!Serial && (Serial.available() == 0))
-		led_send(&led, i++);
+	while (!Serial && (Serial.available() == 0)) {
+		led_beacon(&i);
+	}
 }
 
 void setup(void) {
-	led.anode   = 4;
-	led.cathode = 5;
-	led.sensor  = &led_sensor_communications;
-	led_set(&led, 1);
+#if USE_LED_LINK
+	const int tuned = profile_load(&led_profile) == 0;
+	if (!tuned)
+		led_sensor_load(&led_profile, &led_sensor_communications);
+	led_init(&led, 4, 5, &led_profile);
+	led_trx_init(&led_trx, &led);
+	led_trx_attach(&led_trx);
+	led_link_init(&led_link, &led_trx);
+	led_tune_init(&led_tune, &led_link, &led_profile);
+	led_tuned = tuned ? 1 : -1;
+	if (!tuned) /* carries on in the background, from 'led_poll' */
+		led_tune_start(&led_tune);
+#endif
 
 	Serial.begin(SERIAL_BAUD);
 	while (!Serial)
 		; 
+	morse_timer_setup();
+	if (MORSE_KEY_PIN)
+		pinMode(MORSE_KEY_PIN, INPUT_PULLUP);
+	morse_rx_init(&morse_rx, 1200u / MORSE_KEY_WPM);
+	const unsigned long start = millis();
 	eForth_opt_setup(&embed, &pages);
-	Serial.println(F("loading image"));
-	pages_load(&pages, embed_default_block, embed_default_block_size);
-	eForth_extend(&embed);
+	if (WARM_START && snapshot_load(&pages) == 0) {
+		Serial.println(F("restored saved image"));
+	} else {
+		Serial.println(F("loading image"));
+		pages_load(&pages, embed_default_block, embed_default_block_size);
+		eForth_extend(&embed);
+	}
 	embed_reset(&embed);
 	eForth_opt_setup(&embed, &pages);
+	embed_task_init(&embed, &tasks, task_console, task_console, task_rlimit);
+	if (VERBOSE)
+		Serial << F("boot: ") << (millis() - start) << F("ms\r\n");
 	establish_contact();
 }
 
 void loop(void) {
 	wait_for_key();
 	Serial << F("\r\nstarting...");
-	const int r = embed_vm(&embed);
+	int r = 0;
+	while ((r = embed_vm(&embed)) == 1) { /* waiting for input */
+		if (embed_task_switch(&embed, &tasks) < 0) {
+			/* the console's stack is into the background task's,
+			 * it cannot be thrown to whilst waiting, so it is reset */
+			Serial << F("\r\nstack overflow\r\n");
+			embed_reset(&embed);
+		}
+	}
 	Serial << F("\r\ndone (r = ") << r << F(")\r\n");
 }
 